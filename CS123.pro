@@ -33,6 +33,7 @@ SOURCES += \
     scenegraph/OpenGLScene.cpp \
     scenegraph/SceneviewScene.cpp \
     scenegraph/RayScene.cpp \
+    scenegraph/RaySceneDraw.cpp \
     ui/Canvas2D.cpp \
     ui/SupportCanvas2D.cpp \
     ui/SupportCanvas3D.cpp \
@@ -63,8 +64,15 @@ SOURCES += \
     gl/util/errorchecker.cpp \
     intersect/implicitshape.cpp \
     intersect/kdtree.cpp \
+    intersect/accelerator.cpp \
+    intersect/bvh.cpp \
+    intersect/trimesh.cpp \
     shapes/tetmesh.cpp \
+    shapes/tetmeshdraw.cpp \
+    shapes/tetkernel.cpp \
+    shapes/surfacebuffer.cpp \
     shapes/tetmeshparser.cpp \
+    shapes/tetmeshbinary.cpp \
     shapes/timing.cpp \
     gl/textures/DepthCubeTexture.cpp \
     gl/textures/DepthTexture.cpp \
@@ -114,9 +122,15 @@ HEADERS += \
     gl/util/errorchecker.h \
     intersect/implicitshape.h \
     intersect/kdtree.h \
+    intersect/accelerator.h \
+    intersect/bvh.h \
+    intersect/trimesh.h \
     shapes/tetmesh.h \
+    shapes/tetkernel.h \
+    shapes/surfacebuffer.h \
     tetgen/tetgen.h \
     shapes/tetmeshparser.h \
+    shapes/tetmeshbinary.h \
     shapes/timing.h \
     gl/textures/DepthCubeTexture.h \
     gl/textures/DepthTexture.h \
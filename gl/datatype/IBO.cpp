@@ -2,7 +2,7 @@
 
 namespace CS123 { namespace GL {
 
-IBO::IBO(int *data, int size) :
+IBO::IBO(const int *data, int size) :
     m_handle(-1)
 {
     glGenBuffers(1, &m_handle);
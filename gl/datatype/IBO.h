@@ -7,7 +7,7 @@ namespace CS123 { namespace GL {
 
 class IBO {
 public:
-    IBO(int* data, int size);
+    IBO(const int* data, int size);
     ~IBO();
 
     void bind() const;
@@ -29,12 +29,15 @@ VAO::VAO(const VBO &vbo, const IBO &ibo, int numberOfVerticesToRender) :
     m_size(0),
     m_triangleLayout(vbo.triangleLayout())
 {
-    // TODO [OPTIONAL]
-    // There's another way of drawing with OpenGL that uses IBOs,
-    // or Index Buffer Objects.  Feel free to look them up or ask us
-    // about them if you're curious!
-    // This constructor should be almost identical to the one above,
-    // just also bind the IBO after binding the vbo (and unbind it)
+    glGenVertexArrays(1, &m_handle);
+
+    // the element buffer binding is VAO state, so the IBO has to be bound while the VAO is
+    bind();
+    vbo.bindAndEnable();
+    ibo.bind();
+    unbind();
+    vbo.unbind();
+    ibo.unbind();
 }
 
 VAO::VAO(VAO &&that) :
@@ -81,8 +84,7 @@ void VAO::draw(int count) {
             glDrawArrays(m_triangleLayout, 0, count);
             break;
         case VAO::DRAW_INDEXED:
-            // TODO [OPTIONAL]
-            // If you want to use IBO's, you'll need to call glDrawElements here
+            glDrawElements(m_triangleLayout, count, GL_UNSIGNED_INT, 0);
             break;
     }
 }
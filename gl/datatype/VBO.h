@@ -22,14 +22,23 @@ public:
      * @param sizeInFloats Number of floats in the array.
      * @param markers List of VBOAttribMarkers that describe how the data is laid out.
      * @param layout Layout of the vertex data.
+     * @param usage GL usage hint, GL_DYNAMIC_DRAW for data that will be replaced with setData.
      */
-    VBO(const float *data, int sizeInFloats, std::vector<VBOAttribMarker> markers, GEOMETRY_LAYOUT layout = LAYOUT_TRIANGLES);
+    VBO(const float *data, int sizeInFloats, std::vector<VBOAttribMarker> markers, GEOMETRY_LAYOUT layout = LAYOUT_TRIANGLES,
+        GLenum usage = GL_STATIC_DRAW);
     VBO(const VBO&) = delete;
     VBO& operator=(const VBO&) = delete;
     VBO(VBO &&that);
     VBO& operator=(VBO &&);
     ~VBO();
 
+    /**
+     * @brief Replaces the buffer contents. Writes into the existing storage if the size is unchanged.
+     * @param data Pointer to the beginning of the data.
+     * @param sizeInFloats Number of floats in the array.
+     */
+    void setData(const float *data, int sizeInFloats);
+
     void bindAndEnable() const;
     GEOMETRY_LAYOUT triangleLayout() const;
     int numberOfVertices() const;
@@ -46,6 +55,7 @@ private:
     int m_numberOfFloatsPerVertex;
     GLuint m_stride;
     GEOMETRY_LAYOUT m_triangleLayout;
+    GLenum m_usage;
 };
 
 }}
@@ -0,0 +1,16 @@
+#include "accelerator.h"
+#include "Settings.h"
+#include "intersect/kdtree.h"
+#include "intersect/bvh.h"
+
+std::unique_ptr<Accelerator> Accelerator::build(int type, const std::vector<object_node_t>& nodes,
+                                                glm::vec3 minbound, glm::vec3 maxbound, ThreadPool *pool) {
+    switch(type) {
+    case RAY_ACCEL_BVH:
+        return BVH::buildTree(nodes, 2);
+    case RAY_ACCEL_BVH4:
+        return BVH::buildTree(nodes, 4);
+    default:
+        return KDTree::buildTree(nodes, minbound, maxbound, pool);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+#include "scenegraph/Scene.h"
+#include <memory>
+#include "intersect/implicitshape.h"
+
+class ThreadPool;
+
+struct ixInfo {
+    ISPlace place;
+    double t;
+    const object_node_t *obj;
+    glm::vec4 ix;
+    // for MESH hits (see tAndPlace)
+    glm::vec3 normal;
+};
+
+// What the ray tracer needs from a spatial index over the scene's primitives. Every index
+// keeps a pointer into the vector it was built from, which has to outlive it and not be
+// resized.
+class Accelerator
+{
+public:
+    virtual ~Accelerator() {}
+    // Builds the index picked by type (@see RayAccelerator) over nodes, which all lie
+    // within minbound and maxbound. The kd-tree builds on pool if there is one.
+    static std::unique_ptr<Accelerator> build(int type, const std::vector<object_node_t>& nodes,
+                                              glm::vec3 minbound, glm::vec3 maxbound, ThreadPool *pool = nullptr);
+    // nearest hit along P + t d, t >= 0
+    virtual struct ixInfo traverse(glm::vec4 P, glm::vec4 d) = 0;
+    virtual const char *name() const = 0;
+    virtual size_t numNodes() const = 0;
+    virtual size_t numPrimRefs() const = 0;
+    // size of the nodes and primitive index lists
+    virtual size_t numBytes() const = 0;
+    // Catches up with the primitives in moved having new bounds and transforms. Returns false
+    // if this kind of index can't, and has to be built again instead.
+    virtual bool refit(const std::vector<int>& moved) { (void) moved; return false; }
+
+protected:
+    // Intersects P + t d with obj and keeps the hit in nearest if it's closer.
+    static void intersectPrimitive(glm::vec4 P, glm::vec4 d, const object_node_t *obj, struct ixInfo& nearest) {
+        glm::vec4 eye_os = obj->invtrans * P;
+        glm::vec4 v_dir_os = obj->invtrans * d;
+        auto t_p = ImplicitShape::getIntersectT(*obj, eye_os, v_dir_os);
+        double t = t_p.t;
+        if(t >= 0 && t < nearest.t) {
+            nearest.place = t_p.pl;
+            nearest.t = t;
+            nearest.obj = obj;
+            nearest.ix = eye_os + glm::vec4(t, t, t, 0) * v_dir_os;
+            nearest.normal = t_p.normal;
+        }
+    }
+};
+
+#endif // ACCELERATOR_H
@@ -0,0 +1,584 @@
+#include "bvh.h"
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace {
+// SAH cost model, same ratio as the kd-tree's: a primitive test is worth a node step and a half.
+const float BVH_TRAVERSAL_COST = 1.f;
+const float BVH_INTERSECT_COST = 1.5f;
+// centroid bins per axis. More bins find slightly better splits for a slower build.
+const int BVH_BINS = 16;
+// nodes with more primitives than this get split even when the SAH says not to
+const int BVH_MAX_LEAF = 8;
+// deeper nodes become leaves, which bounds the traversal stacks
+const int BVH_MAX_DEPTH = 64;
+// refit() rebuilds a subtree once its box has grown to this many times its area at build time
+const float BVH_REBUILD_RATIO = 2.f;
+// Primitives refit() may rebuild for each one that moved. Unspent allowance carries over to
+// later frames, so a big loose subtree waits a few frames instead of making one frame slow.
+const size_t BVH_REBUILD_PRIMS_PER_MOVED = 16;
+
+float halfArea(glm::vec3 minbound, glm::vec3 maxbound) {
+    glm::vec3 e = maxbound - minbound;
+    return e.x * e.y + e.y * e.z + e.x * e.z;
+}
+
+struct Bin {
+    glm::vec3 minbound, maxbound;
+    int count;
+};
+
+int binOf(float centroid, float cmin, float scale) {
+    return std::min(static_cast<int>((centroid - cmin) * scale), BVH_BINS - 1);
+}
+
+// Entry distance of P + t d into the box, clipped to [0, tmax]. Takes the near and far plane
+// by the sign of d, so a box with min > max is never hit; a NaN (origin on a face of a slab
+// the ray runs along) leaves the interval alone.
+bool hitBox(glm::vec3 minbound, glm::vec3 maxbound, glm::vec3 o, glm::vec3 invd, float tmax, float& tmin) {
+    float t0 = 0, t1 = tmax;
+    for(int axis = 0; axis < 3; axis++) {
+        float tnear = ((invd[axis] >= 0 ? minbound[axis] : maxbound[axis]) - o[axis]) * invd[axis];
+        float tfar = ((invd[axis] >= 0 ? maxbound[axis] : minbound[axis]) - o[axis]) * invd[axis];
+        if(tnear > t0)
+            t0 = tnear;
+        if(tfar < t1)
+            t1 = tfar;
+    }
+    tmin = t0;
+    return t0 <= t1;
+}
+
+// hitBox() on all four boxes of a BVH4Node. Returns a mask of the ones hit, with their entry
+// distances in tnear.
+int hitBoxes4(const BVH4Node& n, glm::vec3 o, glm::vec3 invd, float tmax, float tnear[4]) {
+    const float *mins[3] = {n.minx, n.miny, n.minz};
+    const float *maxs[3] = {n.maxx, n.maxy, n.maxz};
+#ifdef __SSE__
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps(tmax);
+    for(int axis = 0; axis < 3; axis++) {
+        __m128 oa = _mm_set1_ps(o[axis]);
+        __m128 ia = _mm_set1_ps(invd[axis]);
+        __m128 nearPlane = _mm_load_ps(invd[axis] >= 0 ? mins[axis] : maxs[axis]);
+        __m128 farPlane = _mm_load_ps(invd[axis] >= 0 ? maxs[axis] : mins[axis]);
+        // max/min return their second operand when either is NaN
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, oa), ia), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, oa), ia), t1);
+    }
+    _mm_storeu_ps(tnear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    for(int i = 0; i < 4; i++) {
+        glm::vec3 minbound(mins[0][i], mins[1][i], mins[2][i]);
+        glm::vec3 maxbound(maxs[0][i], maxs[1][i], maxs[2][i]);
+        if(hitBox(minbound, maxbound, o, invd, tmax, tnear[i]))
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+}
+
+BVH::BVH(const std::vector<object_node_t>& prims, int width) :
+    m_prims(prims.data()),
+    m_width(width),
+    m_nodes(),
+    m_info(),
+    m_dirty(),
+    m_nodes4(),
+    m_lanes(),
+    m_primIndices(),
+    m_leafOf(),
+    m_centroids(),
+    m_rebuildRatio(BVH_REBUILD_RATIO),
+    m_rebuildCredit(0),
+    m_lastRefitNodes(0),
+    m_lastRebuiltPrims(0) {
+}
+
+std::unique_ptr<BVH> BVH::buildTree(const std::vector<object_node_t>& nodes, int width) {
+    std::unique_ptr<BVH> tree(new BVH(nodes, width));
+    tree->m_centroids.resize(nodes.size());
+    for(size_t i = 0; i < nodes.size(); i++) {
+        tree->m_centroids[i] = (nodes[i].minbound + nodes[i].maxbound) / 2.f;
+    }
+    tree->m_primIndices.resize(nodes.size());
+    std::iota(tree->m_primIndices.begin(), tree->m_primIndices.end(), 0);
+    tree->m_leafOf.resize(nodes.size());
+    tree->m_nodes.reserve(2 * nodes.size());
+    tree->m_info.reserve(2 * nodes.size());
+    tree->build(0, nodes.size(), 0, BVH_NONE, BVH_NONE);
+    if(width == 4) {
+        tree->m_lanes.assign(tree->m_nodes.size(), BVH_NONE);
+        tree->collapse(0);
+    }
+    return tree;
+}
+
+// Appends the subtree over the count primitives at first in m_primIndices depth-first,
+// reordering them so each leaf's are contiguous, and returns its root. It takes no more than
+// budget nodes (BVH_NONE for no limit); past that, leaves get bigger instead.
+uint32_t BVH::build(uint32_t first, uint32_t count, int depth, uint32_t parent, uint32_t budget) {
+    uint32_t node = m_nodes.size();
+    m_nodes.push_back(BVHNode());
+    m_info.push_back({parent, 0, first, count, 0});
+    glm::vec3 minbound(INFINITY), maxbound(-INFINITY);
+    glm::vec3 cmin(INFINITY), cmax(-INFINITY);
+    for(uint32_t i = first; i < first + count; i++) {
+        int prim = m_primIndices[i];
+        minbound = glm::min(minbound, m_prims[prim].minbound);
+        maxbound = glm::max(maxbound, m_prims[prim].maxbound);
+        cmin = glm::min(cmin, m_centroids[prim]);
+        cmax = glm::max(cmax, m_centroids[prim]);
+    }
+    m_nodes[node].minbound = minbound;
+    m_nodes[node].maxbound = maxbound;
+    m_info[node].builtArea = halfArea(minbound, maxbound);
+
+    // bin the centroids on each axis and sweep the planes between bins for the cheapest split
+    int bestAxis = -1, bestBin = 0;
+    float bestCost = INFINITY;
+    float area = halfArea(minbound, maxbound);
+    bool canSplit = depth < BVH_MAX_DEPTH && budget >= 3;
+    if(count > 1 && canSplit && area > 0) {
+        for(int axis = 0; axis < 3; axis++) {
+            float extent = cmax[axis] - cmin[axis];
+            if(!(extent > 0))
+                continue;
+            float scale = BVH_BINS / extent;
+            Bin bins[BVH_BINS];
+            for(Bin& bin : bins) {
+                bin = {glm::vec3(INFINITY), glm::vec3(-INFINITY), 0};
+            }
+            for(uint32_t i = first; i < first + count; i++) {
+                int prim = m_primIndices[i];
+                Bin& bin = bins[binOf(m_centroids[prim][axis], cmin[axis], scale)];
+                bin.minbound = glm::min(bin.minbound, m_prims[prim].minbound);
+                bin.maxbound = glm::max(bin.maxbound, m_prims[prim].maxbound);
+                bin.count++;
+            }
+            // rightArea[i] is the area of everything in bins i and up
+            float rightArea[BVH_BINS];
+            glm::vec3 rmin(INFINITY), rmax(-INFINITY);
+            for(int i = BVH_BINS - 1; i > 0; i--) {
+                rmin = glm::min(rmin, bins[i].minbound);
+                rmax = glm::max(rmax, bins[i].maxbound);
+                rightArea[i] = rmin.x <= rmax.x ? halfArea(rmin, rmax) : 0;
+            }
+            glm::vec3 lmin(INFINITY), lmax(-INFINITY);
+            int nl = 0;
+            for(int i = 0; i < BVH_BINS - 1; i++) {
+                lmin = glm::min(lmin, bins[i].minbound);
+                lmax = glm::max(lmax, bins[i].maxbound);
+                nl += bins[i].count;
+                int nr = count - nl;
+                if(nl == 0 || nr == 0)
+                    continue;
+                float cost = BVH_TRAVERSAL_COST +
+                        BVH_INTERSECT_COST * (halfArea(lmin, lmax) * nl + rightArea[i + 1] * nr) / area;
+                if(cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = i;
+                }
+            }
+        }
+    }
+
+    uint32_t mid;
+    if(bestAxis >= 0 && (bestCost < BVH_INTERSECT_COST * count || count > BVH_MAX_LEAF)) {
+        float cminAxis = cmin[bestAxis];
+        float scale = BVH_BINS / (cmax[bestAxis] - cminAxis);
+        auto split = std::partition(m_primIndices.begin() + first, m_primIndices.begin() + first + count,
+                                    [&](int prim) {
+            return binOf(m_centroids[prim][bestAxis], cminAxis, scale) <= bestBin;
+        });
+        mid = split - m_primIndices.begin();
+    } else if(count > BVH_MAX_LEAF && canSplit) {
+        // all the centroids are in one spot, so no plane separates them; halve the list instead
+        bestAxis = 0;
+        mid = first + count / 2;
+    } else {
+        m_nodes[node].offset = first;
+        m_nodes[node].flags = BVH_LEAF | (count << 2);
+        m_info[node].slotEnd = node + 1;
+        for(uint32_t i = first; i < first + count; i++) {
+            m_leafOf[m_primIndices[i]] = node;
+        }
+        return node;
+    }
+    // the children share the budget by primitive count, the second also getting whatever
+    // the first didn't use
+    uint32_t firstBudget = BVH_NONE;
+    if(budget != BVH_NONE)
+        firstBudget = std::max<uint32_t>(1, std::min<uint64_t>(budget - 2, (uint64_t) (budget - 1) * (mid - first) / count));
+    build(first, mid - first, depth + 1, node, firstBudget); // lands at node + 1
+    uint32_t secondBudget = budget == BVH_NONE ? BVH_NONE : budget - (m_nodes.size() - node);
+    uint32_t second = build(mid, first + count - mid, depth + 1, node, secondBudget);
+    m_nodes[node].offset = second;
+    m_nodes[node].flags = bestAxis;
+    m_info[node].slotEnd = m_nodes.size();
+    return node;
+}
+
+// Rebuilds the subtree at node from its primitives into the slots it owns.
+void BVH::rebuild(uint32_t node) {
+    BVHRefitInfo info = m_info[node];
+    if(info.parent == BVH_NONE) {
+        m_nodes.clear();
+        m_info.clear();
+        build(0, m_primIndices.size(), 0, BVH_NONE, BVH_NONE);
+        return;
+    }
+    int depth = 0;
+    for(uint32_t n = info.parent; n != BVH_NONE; n = m_info[n].parent) {
+        depth++;
+    }
+    // build past the end of the array, then move it into place
+    uint32_t scratch = m_nodes.size();
+    build(info.primFirst, info.primCount, depth, info.parent, info.slotEnd - node);
+    uint32_t shift = scratch - node;
+    for(uint32_t i = 0; i < m_nodes.size() - scratch; i++) {
+        BVHNode n = m_nodes[scratch + i];
+        BVHRefitInfo in = m_info[scratch + i];
+        if(n.isLeaf()) {
+            for(uint32_t p = n.offset; p < n.offset + n.primCount(); p++) {
+                m_leafOf[m_primIndices[p]] = node + i;
+            }
+        } else {
+            n.offset -= shift;
+        }
+        if(i > 0)
+            in.parent -= shift;
+        in.slotEnd -= shift;
+        m_nodes[node + i] = n;
+        m_info[node + i] = in;
+    }
+    // the subtree keeps all its slots, in case it's rebuilt bigger next time
+    m_info[node].slotEnd = info.slotEnd;
+    m_nodes.resize(scratch);
+    m_info.resize(scratch);
+}
+
+void BVH::refitNode(uint32_t node) {
+    BVHNode& n = m_nodes[node];
+    glm::vec3 minbound(INFINITY), maxbound(-INFINITY);
+    if(n.isLeaf()) {
+        for(uint32_t i = n.offset; i < n.offset + n.primCount(); i++) {
+            minbound = glm::min(minbound, m_prims[m_primIndices[i]].minbound);
+            maxbound = glm::max(maxbound, m_prims[m_primIndices[i]].maxbound);
+        }
+    } else {
+        minbound = glm::min(m_nodes[node + 1].minbound, m_nodes[n.offset].minbound);
+        maxbound = glm::max(m_nodes[node + 1].maxbound, m_nodes[n.offset].maxbound);
+    }
+    n.minbound = minbound;
+    n.maxbound = maxbound;
+}
+
+bool BVH::refit(const std::vector<int>& moved) {
+    m_lastRefitNodes = 0;
+    m_lastRebuiltPrims = 0;
+    if(m_nodes.empty())
+        return true;
+    // every node above a moved primitive, deepest (highest index) first. Paths up from
+    // primitives in the same leaf mostly overlap, so each walk stops at the first node an
+    // earlier one marked.
+    m_dirty.resize(m_nodes.size());
+    std::vector<uint32_t> dirty;
+    for(int prim : moved) {
+        m_centroids[prim] = (m_prims[prim].minbound + m_prims[prim].maxbound) / 2.f;
+        for(uint32_t n = m_leafOf[prim]; n != BVH_NONE && !m_dirty[n]; n = m_info[n].parent) {
+            m_dirty[n] = true;
+            dirty.push_back(n);
+        }
+    }
+    if(dirty.size() * 8 > m_nodes.size()) {
+        // cheaper to pick them out of a sweep over the array than to sort them
+        dirty.clear();
+        for(uint32_t n = m_nodes.size(); n-- > 0;) {
+            if(m_dirty[n])
+                dirty.push_back(n);
+        }
+    } else {
+        std::sort(dirty.begin(), dirty.end(), std::greater<uint32_t>());
+    }
+    // children sit after their parent, so they're refit before it
+    for(uint32_t n : dirty) {
+        refitNode(n);
+        m_dirty[n] = false;
+    }
+    m_lastRefitNodes = dirty.size();
+
+    // going down from the root, the first subtree on each path that's gotten too loose is a
+    // candidate to rebuild, along with everything inside it
+    std::vector<std::pair<float, uint32_t>> candidates;
+    uint32_t coveredEnd = 0;
+    for(auto it = dirty.rbegin(); it != dirty.rend(); ++it) {
+        uint32_t n = *it;
+        float area = halfArea(m_nodes[n].minbound, m_nodes[n].maxbound);
+        if(n < coveredEnd || !(area > m_rebuildRatio * m_info[n].builtArea))
+            continue;
+        // the area it has grown by is what it adds to the SAH cost
+        candidates.emplace_back(area - m_info[n].builtArea, n);
+        coveredEnd = m_info[n].slotEnd;
+    }
+    // Loosest first, for as many primitives as the moves have paid for. The first one that
+    // doesn't fit stops the pass, so it's the first rebuilt once enough has built up.
+    std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<float, uint32_t>>());
+    m_rebuildCredit = std::min(m_rebuildCredit + BVH_REBUILD_PRIMS_PER_MOVED * moved.size(), m_primIndices.size());
+    std::vector<uint32_t> loose;
+    size_t loosePrims = 0;
+    for(auto& c : candidates) {
+        uint32_t prims = m_info[c.second].primCount;
+        if(loosePrims + prims > m_rebuildCredit)
+            break;
+        loose.push_back(c.second);
+        loosePrims += prims;
+    }
+    // past half the scene, one build from the root is cheaper than piecemeal ones
+    if(2 * loosePrims > m_primIndices.size()) {
+        loose.assign(1, 0);
+        loosePrims = m_primIndices.size();
+    }
+    m_rebuildCredit -= std::min(loosePrims, m_rebuildCredit);
+    for(uint32_t n : loose) {
+        rebuild(n);
+        m_lastRebuiltPrims += m_info[n].primCount;
+    }
+    bool rebuilt = !loose.empty();
+
+    if(m_width == 4) {
+        if(rebuilt) {
+            m_nodes4.clear();
+            m_lanes.assign(m_nodes.size(), BVH_NONE);
+            collapse(0);
+        } else {
+            for(uint32_t n : dirty) {
+                if(m_lanes[n] == BVH_NONE)
+                    continue;
+                BVH4Node& out = m_nodes4[m_lanes[n] / 4];
+                int lane = m_lanes[n] % 4;
+                out.minx[lane] = m_nodes[n].minbound.x;
+                out.miny[lane] = m_nodes[n].minbound.y;
+                out.minz[lane] = m_nodes[n].minbound.z;
+                out.maxx[lane] = m_nodes[n].maxbound.x;
+                out.maxy[lane] = m_nodes[n].maxbound.y;
+                out.maxz[lane] = m_nodes[n].maxbound.z;
+            }
+        }
+    }
+    return true;
+}
+
+float BVH::sahCost() const {
+    if(m_nodes.empty() || m_primIndices.empty())
+        return 0;
+    float rootArea = halfArea(m_nodes[0].minbound, m_nodes[0].maxbound);
+    if(!(rootArea > 0))
+        return 1;
+    float cost = 0;
+    // walked rather than scanned, since rebuilt subtrees can leave unused slots
+    std::vector<uint32_t> stack(1, 0);
+    while(!stack.empty()) {
+        uint32_t node = stack.back();
+        stack.pop_back();
+        const BVHNode& n = m_nodes[node];
+        float area = halfArea(n.minbound, n.maxbound) / rootArea;
+        if(n.isLeaf()) {
+            cost += area * BVH_INTERSECT_COST * n.primCount();
+        } else {
+            cost += area * BVH_TRAVERSAL_COST;
+            stack.push_back(node + 1);
+            stack.push_back(n.offset);
+        }
+    }
+    return cost / (BVH_INTERSECT_COST * m_primIndices.size());
+}
+
+// Appends the BVH4Node for the binary subtree at node and returns its index. Its children
+// are found by repeatedly opening the biggest interior node among them, the one most rays
+// would step into anyway, until there are four.
+uint32_t BVH::collapse(uint32_t node) {
+    uint32_t children[4];
+    int n = 0;
+    if(m_nodes[node].isLeaf()) {
+        children[n++] = node;
+    } else {
+        children[n++] = node + 1;
+        children[n++] = m_nodes[node].offset;
+    }
+    while(n < 4) {
+        int biggest = -1;
+        float biggestArea = -1;
+        for(int i = 0; i < n; i++) {
+            const BVHNode& c = m_nodes[children[i]];
+            if(!c.isLeaf() && halfArea(c.minbound, c.maxbound) > biggestArea) {
+                biggest = i;
+                biggestArea = halfArea(c.minbound, c.maxbound);
+            }
+        }
+        if(biggest < 0)
+            break;
+        uint32_t open = children[biggest];
+        children[biggest] = open + 1;
+        children[n++] = m_nodes[open].offset;
+    }
+
+    uint32_t index = m_nodes4.size();
+    m_nodes4.push_back(BVH4Node());
+    for(int i = 0; i < 4; i++) {
+        BVH4Node& out = m_nodes4[index];
+        const BVHNode *c = i < n ? &m_nodes[children[i]] : nullptr;
+        if(c == nullptr || (c->isLeaf() && c->primCount() == 0)) {
+            out.minx[i] = out.miny[i] = out.minz[i] = INFINITY;
+            out.maxx[i] = out.maxy[i] = out.maxz[i] = -INFINITY;
+            out.child[i] = BVH_NONE;
+            out.count[i] = 0;
+            continue;
+        }
+        out.minx[i] = c->minbound.x;
+        out.miny[i] = c->minbound.y;
+        out.minz[i] = c->minbound.z;
+        out.maxx[i] = c->maxbound.x;
+        out.maxy[i] = c->maxbound.y;
+        out.maxz[i] = c->maxbound.z;
+        m_lanes[children[i]] = index * 4 + i;
+        if(c->isLeaf()) {
+            out.child[i] = c->offset;
+            out.count[i] = c->primCount();
+        } else {
+            out.count[i] = 0;
+            uint32_t child = collapse(children[i]);
+            // collapse() may have moved m_nodes4
+            m_nodes4[index].child[i] = child;
+        }
+    }
+    return index;
+}
+
+struct ixInfo BVH::traverse(glm::vec4 P, glm::vec4 d) {
+    return m_width == 4 ? traverse4(P, d) : traverse2(P, d);
+}
+
+struct ixInfo BVH::traverse2(glm::vec4 P, glm::vec4 d) {
+    struct ixInfo nearest;
+    nearest.place = UNDEF;
+    nearest.t = INFINITY;
+    nearest.obj = NULL;
+    glm::vec3 o(P);
+    glm::vec3 invd = 1.f/glm::vec3(d);
+    float tmin;
+    if(m_nodes.empty() || !hitBox(m_nodes[0].minbound, m_nodes[0].maxbound, o, invd, INFINITY, tmin))
+        return nearest;
+
+    // the farther child of each node on the way down, with where the ray enters it
+    struct {
+        uint32_t node;
+        float tmin;
+    } stack[BVH_MAX_DEPTH + 1];
+    int top = 0;
+    uint32_t node = 0;
+    while(true) {
+        const BVHNode& n = m_nodes[node];
+        if(n.isLeaf()) {
+            const int *prims = &m_primIndices[n.offset];
+            for(uint32_t i = 0; i < n.primCount(); i++) {
+                intersectPrimitive(P, d, &m_prims[prims[i]], nearest);
+            }
+        } else {
+            uint32_t a = node + 1, b = n.offset;
+            float ta, tb;
+            bool hitA = hitBox(m_nodes[a].minbound, m_nodes[a].maxbound, o, invd, nearest.t, ta);
+            bool hitB = hitBox(m_nodes[b].minbound, m_nodes[b].maxbound, o, invd, nearest.t, tb);
+            if(hitA && hitB) {
+                if(tb < ta) {
+                    std::swap(a, b);
+                    std::swap(ta, tb);
+                }
+                stack[top++] = {b, tb};
+                node = a;
+                continue;
+            } else if(hitA) {
+                node = a;
+                continue;
+            } else if(hitB) {
+                node = b;
+                continue;
+            }
+        }
+        // skip anything the ray only reaches past the nearest hit so far
+        do {
+            if(top == 0)
+                return nearest;
+            top--;
+        } while(stack[top].tmin > nearest.t);
+        node = stack[top].node;
+    }
+}
+
+struct ixInfo BVH::traverse4(glm::vec4 P, glm::vec4 d) {
+    struct ixInfo nearest;
+    nearest.place = UNDEF;
+    nearest.t = INFINITY;
+    nearest.obj = NULL;
+    if(m_nodes4.empty())
+        return nearest;
+    glm::vec3 o(P);
+    glm::vec3 invd = 1.f/glm::vec3(d);
+
+    // each node visited leaves at most three siblings behind
+    struct {
+        uint32_t node;
+        float tmin;
+    } stack[3 * BVH_MAX_DEPTH + 4];
+    int top = 0;
+    uint32_t node = 0;
+    while(true) {
+        const BVH4Node& n = m_nodes4[node];
+        float tnear[4];
+        int mask = hitBoxes4(n, o, invd, nearest.t, tnear);
+        // children hit, nearest first
+        int order[4], nhit = 0;
+        for(int i = 0; i < 4; i++) {
+            // a NaN ray "hits" every box, empty ones included
+            if(!(mask & (1 << i)) || n.child[i] == BVH_NONE)
+                continue;
+            int j = nhit++;
+            for(; j > 0 && tnear[order[j - 1]] > tnear[i]; j--)
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+        // leaves get tested right away, in order, so a hit can cull the children behind it
+        int interior[4], ninterior = 0;
+        for(int k = 0; k < nhit; k++) {
+            int i = order[k];
+            if(tnear[i] > nearest.t)
+                break;
+            if(n.count[i] > 0) {
+                const int *prims = &m_primIndices[n.child[i]];
+                for(uint32_t p = 0; p < n.count[i]; p++) {
+                    intersectPrimitive(P, d, &m_prims[prims[p]], nearest);
+                }
+            } else {
+                interior[ninterior++] = i;
+            }
+        }
+        // farthest pushed first so the nearest comes off next
+        for(int k = ninterior - 1; k >= 0; k--) {
+            stack[top++] = {n.child[interior[k]], tnear[interior[k]]};
+        }
+        do {
+            if(top == 0)
+                return nearest;
+            top--;
+        } while(stack[top].tmin > nearest.t);
+        node = stack[top].node;
+    }
+}
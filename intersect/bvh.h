@@ -0,0 +1,108 @@
+#ifndef BVH_H
+#define BVH_H
+#include "intersect/accelerator.h"
+#include <cstdint>
+
+// One binary BVH node, 32 bytes. The low 2 bits of flags are BVH_LEAF or the axis the node's
+// primitives were split on. Interior: the first child is the next node in the array, the
+// second is at offset. Leaf: primCount = flags >> 2 primitives starting at offset in the
+// tree's primitive index list.
+#define BVH_LEAF 3
+#define BVH_NONE 0xffffffffu
+struct BVHNode {
+    glm::vec3 minbound;
+    uint32_t offset;
+    glm::vec3 maxbound;
+    uint32_t flags;
+
+    bool isLeaf() const { return (flags & 3) == BVH_LEAF; }
+    int axis() const { return flags & 3; }
+    uint32_t primCount() const { return flags >> 2; }
+};
+
+// Four children's boxes side by side, one lane per child, so a ray is tested against all of
+// them at once. A child is a node index, or a leaf of count[i] primitives at child[i] in the
+// primitive index list if count[i] > 0. Unused slots have an empty box and child BVH_NONE.
+struct alignas(16) BVH4Node {
+    float minx[4], miny[4], minz[4];
+    float maxx[4], maxy[4], maxz[4];
+    uint32_t child[4];
+    uint32_t count[4];
+};
+
+// What refit() keeps about each binary node. A subtree owns the node slots [node, slotEnd),
+// which can run past its last node after it's been rebuilt smaller, and the primitive index
+// list entries [primFirst, primFirst + primCount).
+struct BVHRefitInfo {
+    uint32_t parent;        // BVH_NONE for the root
+    uint32_t slotEnd;
+    uint32_t primFirst, primCount;
+    float builtArea;        // half surface area when the subtree was last built
+};
+
+// Bounding volume hierarchy over the scene's primitives, built top-down with the surface
+// area heuristic evaluated at a fixed number of bins per axis. Unlike the kd-tree every
+// primitive lands in exactly one leaf, and a node's box shrinks to fit what's in it.
+//
+// Nodes are laid out depth-first in one array. With width 4 the binary tree is collapsed
+// into BVH4Nodes afterwards, which takes about half the node visits for the same leaves.
+// Both walks visit children nearest first, so a close hit culls the rest early.
+//
+// For animation, refit() takes the primitives whose bounds changed and grows or shrinks
+// only the boxes above them, so a frame costs about (moved primitives) x (depth). A box
+// refit around primitives that moved apart stays valid but gets loose. A node's share of the
+// SAH cost is proportional to its area, so once it has grown past the rebuild ratio times
+// its area at build time, the highest such subtree is rebuilt in place from its primitives.
+// Each moved primitive pays for rebuilding a few primitives, so the rebuilds, like the refit,
+// cost in proportion to what moved; loose subtrees the allowance doesn't cover yet wait for
+// later frames, loosest first.
+class BVH : public Accelerator
+{
+public:
+    // width is 2 or 4
+    static std::unique_ptr<BVH> buildTree(const std::vector<object_node_t>& nodes, int width);
+    struct ixInfo traverse(glm::vec4 P, glm::vec4 d) override;
+    const char *name() const override { return m_width == 4 ? "BVH4" : "BVH"; }
+    size_t numNodes() const override { return m_width == 4 ? m_nodes4.size() : m_nodes.size(); }
+    size_t numPrimRefs() const override { return m_primIndices.size(); }
+    size_t numBytes() const override {
+        return m_nodes.size() * (sizeof(BVHNode) + sizeof(BVHRefitInfo)) + m_nodes4.size() * sizeof(BVH4Node) +
+                m_primIndices.size() * (sizeof(int) + sizeof(uint32_t) + sizeof(glm::vec3));
+    }
+    bool refit(const std::vector<int>& moved) override;
+    // INFINITY never rebuilds, only refits
+    void setRebuildRatio(float ratio) { m_rebuildRatio = ratio; }
+    // binary nodes refit and primitives rebuilt by the last refit()
+    size_t lastRefitNodes() const { return m_lastRefitNodes; }
+    size_t lastRebuiltPrims() const { return m_lastRebuiltPrims; }
+    // SAH cost of the binary tree, relative to testing every primitive in the root's box
+    float sahCost() const;
+private:
+    BVH(const std::vector<object_node_t>& prims, int width);
+    uint32_t build(uint32_t first, uint32_t count, int depth, uint32_t parent, uint32_t budget);
+    void rebuild(uint32_t node);
+    void refitNode(uint32_t node);
+    uint32_t collapse(uint32_t node);
+    struct ixInfo traverse2(glm::vec4 P, glm::vec4 d);
+    struct ixInfo traverse4(glm::vec4 P, glm::vec4 d);
+    const object_node_t *m_prims;
+    int m_width;
+    // the binary tree, also kept for width 4 to refit
+    std::vector<BVHNode> m_nodes;
+    std::vector<BVHRefitInfo> m_info;
+    // scratch for refit(), all false between calls
+    std::vector<bool> m_dirty;
+    std::vector<BVH4Node> m_nodes4;
+    // for width 4, which BVH4Node lane (node * 4 + lane) each binary node's box is copied to
+    std::vector<uint32_t> m_lanes;
+    std::vector<int> m_primIndices;
+    // per primitive
+    std::vector<uint32_t> m_leafOf;
+    std::vector<glm::vec3> m_centroids;
+    float m_rebuildRatio;
+    // primitives refit() may still rebuild (see BVH_REBUILD_PRIMS_PER_MOVED)
+    size_t m_rebuildCredit;
+    size_t m_lastRefitNodes, m_lastRebuiltPrims;
+};
+
+#endif // BVH_H
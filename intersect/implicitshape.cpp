@@ -1,10 +1,11 @@
 #include "implicitshape.h"
+#include "intersect/trimesh.h"
 #include <algorithm>
 
 const char *placestring[N_PLACE+1] = {"undefined", "sphere", "cone body", "cone cap",
                              "cyl top", "cyl bot", "cyl body", "cube front",
                              "cube back", "cube left", "cube right", "cube up",
-                              "cube down", "really undefined"
+                              "cube down", "mesh", "really undefined"
                             };
 
 ImplicitShape::ImplicitShape()
@@ -30,6 +31,15 @@ struct tAndPlace ImplicitShape::getIntersectT(PrimitiveType type, glm::vec4 P, g
         return {INFINITY, UNDEF};
     }
 }
+
+struct tAndPlace ImplicitShape::getIntersectT(const object_node_t &obj, glm::vec4 P, glm::vec4 d) {
+    if(obj.primitive.type == PrimitiveType::PRIMITIVE_MESH) {
+        if(obj.mesh == nullptr)
+            return {INFINITY, UNDEF};
+        return obj.mesh->intersect(P, d);
+    }
+    return getIntersectT(obj.primitive.type, P, d);
+}
 struct tAndPlace ImplicitShape::coneIntersectT(glm::vec4 P, glm::vec4 d) {
     // cap
     double capT = (-0.5 - P.y) / d.y;
@@ -387,6 +397,9 @@ glm::vec2 ImplicitShape::getTexCoords(ISPlace place, glm::vec4 p) {
         return glm::vec2(p.z + 0.5, -p.y + 0.5);
     case CUBE_R:
         return glm::vec2(-p.z + 0.5, -p.y + 0.5);
+    case MESH:
+        // meshes have no texture coordinates, and this keeps them from being texture or bump mapped
+        return glm::vec2(-1, -1);
     default:
         return glm::vec2(0, 0);
     }
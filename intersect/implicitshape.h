@@ -17,12 +17,15 @@ enum ISPlace {
     CUBE_R,
     CUBE_U,
     CUBE_D,
+    MESH,
     N_PLACE
 };
 
 struct tAndPlace {
     double t;
     ISPlace pl;
+    // object space, unnormalized, and only set for MESH; getNormal() covers the other places
+    glm::vec3 normal;
 };
 
 extern const char *placestring[N_PLACE+1];
@@ -32,6 +35,8 @@ class ImplicitShape
 public:
     ImplicitShape();
     static struct tAndPlace getIntersectT(PrimitiveType type, glm::vec4 P, glm::vec4 d);
+    // P and d in obj's object space. Unlike the above this can hit meshes, through obj.mesh.
+    static struct tAndPlace getIntersectT(const object_node_t &obj, glm::vec4 P, glm::vec4 d);
     static struct tAndPlace coneIntersectT(glm::vec4 P, glm::vec4 d);
     static struct tAndPlace cylinderIntersectT(glm::vec4 P, glm::vec4 d);
     static struct tAndPlace cubeIntersectT(glm::vec4 P, glm::vec4 d);
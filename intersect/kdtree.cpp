@@ -2,25 +2,14 @@
 #include "intersect/implicitshape.h"
 #include <algorithm>
 #include "Settings.h"
+#include "scenegraph/ThreadPool.h"
 
-KDTree::KDTree(int nnodes, std::unique_ptr<KDTree> l, std::unique_ptr<KDTree> r, int depth, glm::vec3 mib, glm::vec3 mxb) :
-    m_nodecount(nnodes),
+KDTree::KDTree(const std::vector<object_node_t>& prims, glm::vec3 mib, glm::vec3 mxb) :
+    m_prims(prims.data()),
     m_nodes(),
+    m_primIndices(),
     m_minbound(mib),
-    m_maxbound(mxb),
-    m_depth(depth) {
-    m_l = std::move(l);
-    m_r = std::move(r);
-}
-
-KDTree::KDTree(std::vector<object_node_t> nodes, std::unique_ptr<KDTree> l, std::unique_ptr<KDTree> r, int depth, glm::vec3 mib, glm::vec3 mxb) :
-    m_nodecount(nodes.size()),
-    m_nodes(nodes),
-    m_minbound(mib),
-    m_maxbound(mxb),
-    m_depth(depth) {
-    m_l = std::move(l);
-    m_r = std::move(r);
+    m_maxbound(mxb) {
 }
 
 double surfaceArea(glm::vec3 box) {
@@ -28,181 +17,453 @@ double surfaceArea(glm::vec3 box) {
     return (box.x * box.y + box.y * box.z + box.x * box.z);
 }
 
-struct split {
-    double plane;
-    int axis;
-};
-
-struct split chooseSplit(const std::vector<object_node_t>& m_nodes, int depth, glm::vec3 minbound, glm::vec3 maxbound) {
-    int splitAxis = depth % 3;
-    double minAxis = minbound[splitAxis];
-    double maxAxis = maxbound[splitAxis];
-    double axis = NAN;
-    double bestCost = m_nodes.size() * surfaceArea(maxbound - minbound);
-    for(unsigned long i = 0; i < m_nodes.size(); i++) {
-        for(int pn = 0; pn <= 1; pn += 1) {
-            double ax = pn ? m_nodes[i].maxbound[splitAxis] : m_nodes[i].minbound[splitAxis];
-            //printf("min is %f, max is %f. Considering %f\n", minAxis, maxAxis, ax);
-            if(ax < minAxis || ax > maxAxis)
-                continue;
-
-            glm::vec3 split1max = maxbound;
-            split1max[splitAxis] = ax;
-            glm::vec3 split1min = minbound;
-            split1min[splitAxis] = ax;
-
-            double leftarea = surfaceArea(split1max - minbound);
-            double rightarea = surfaceArea(maxbound - split1min);
-            int leftcount = 0;
-            int rightcount = 0;
-
-            for(unsigned long j = 0; j < m_nodes.size(); j++) {
-                double objbL = m_nodes[j].minbound[splitAxis];
-                double objbR = m_nodes[j].maxbound[splitAxis];
-                if(!(objbR < minAxis || objbL >= ax)) {
-                    leftcount++;
-                }
-                if(!(objbR < ax || objbL >= maxAxis)) {
-                    rightcount++;
-                }
-            }
-
-            double cost = leftarea * leftcount + rightarea * rightcount;
-            if(cost < bestCost) {
-                bestCost = cost;
-                axis = ax;
-            }
-        }
-    }
-    return {axis, splitAxis};
-}
-
 // Note: This implementation is based on
 // "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)"
 // by Ingo Wald, Vlastimil Havran
 // (http://dcgi.felk.cvut.cz/home/havran/ARTICLES/ingo06rtKdtree.pdf)
+//
+// Every primitive contributes a start and an end event (or one planar event if it's flat)
+// per axis. The three event lists are sorted once at the root; after that each split only
+// partitions them, so no level sorts more than the events of the primitives it cuts in two.
+
+// SAH cost model. Stepping through a node costs KD_TRAVERSAL_COST and testing a primitive
+// KD_INTERSECT_COST; implicit shapes need a matrix multiply and a quadric solve, so a test
+// is worth several node steps. A node stays a leaf unless splitting it is cheaper than
+// testing everything in it.
+const float KD_TRAVERSAL_COST = 1.f;
+const float KD_INTERSECT_COST = 1.5f;
+// splits that cut off empty space get their cost scaled by this, so rays that miss everything
+// can skip the empty part in one step
+const float KD_EMPTY_BONUS = 0.8f;
 
 enum EventType {
     END,
+    PLANAR,
     START
 };
 
 struct KDEvent {
-    const object_node_t *obj;
     float plane;
+    int prim;
     EventType type;
 };
 
-double calculateSAH(int l, int r, double plane, int axis, glm::vec3 mnb, glm::vec3 mxb) {
-    double relplane = plane - mnb[axis];
+struct KDEventLists {
+    std::vector<KDEvent> axis[3];
+};
+
+// which children of the split a primitive belongs to
+enum PrimSide : uint8_t {
+    LEFT_ONLY,
+    RIGHT_ONLY,
+    BOTH
+};
+
+struct split {
+    float plane;
+    int axis;
+    bool planarLeft; // whether primitives lying in the plane go left
+    float cost;
+};
+
+bool eventLess(const KDEvent& a, const KDEvent& b) {
+    // end before planar before start at the same plane, the prim only to make the order total
+    if(a.plane != b.plane)
+        return a.plane < b.plane;
+    if(a.type != b.type)
+        return a.type < b.type;
+    return a.prim < b.prim;
+}
+
+void addEvents(KDEventLists& events, int prim, glm::vec3 mn, glm::vec3 mx) {
+    for(int axis = 0; axis < 3; axis++) {
+        if(mn[axis] == mx[axis]) {
+            events.axis[axis].push_back((KDEvent){mn[axis], prim, PLANAR});
+        } else {
+            events.axis[axis].push_back((KDEvent){mn[axis], prim, START});
+            events.axis[axis].push_back((KDEvent){mx[axis], prim, END});
+        }
+    }
+}
+
+float calculateSAH(int nl, int nr, float plane, int axis, glm::vec3 mnb, glm::vec3 mxb, float invArea) {
     glm::vec3 box = mxb - mnb;
-    box[axis] -= relplane; // end - plane, so right side
-    double saR = surfaceArea(box);
-    box[axis] = relplane; // up to plane, so left side
-    double saL = surfaceArea(box);
-    return l * saL + r * saR;
+    box[axis] = plane - mnb[axis]; // up to plane, so left side
+    float pl = surfaceArea(box) * invArea;
+    box[axis] = mxb[axis] - plane; // plane to end, so right side
+    float pr = surfaceArea(box) * invArea;
+    float cost = KD_TRAVERSAL_COST + KD_INTERSECT_COST * (pl * nl + pr * nr);
+    if(nl == 0 || nr == 0)
+        cost *= KD_EMPTY_BONUS;
+    return cost;
 }
 
-bool eventLess(const KDEvent& a, const KDEvent& b) {
-    return (a.plane < b.plane) || (a.plane == b.plane && a.type < b.type); // end before start
+// Sweeps one axis for a split cheaper than best, for the n primitives in ev.
+void findSplitOnAxis(const std::vector<KDEvent>& ev, int axis, int n, glm::vec3 minbound, glm::vec3 maxbound,
+                     float invArea, struct split& best) {
+    int nl = 0, nr = n;
+    size_t i = 0;
+    while(i < ev.size()) {
+        float plane = ev[i].plane;
+        int ends = 0, planars = 0, starts = 0;
+        for(; i < ev.size() && ev[i].plane == plane && ev[i].type == END; i++)
+            ends++;
+        for(; i < ev.size() && ev[i].plane == plane && ev[i].type == PLANAR; i++)
+            planars++;
+        for(; i < ev.size() && ev[i].plane == plane && ev[i].type == START; i++)
+            starts++;
+        nr -= planars + ends;
+        // a plane on the node's own boundary would give a child with no volume
+        if(plane > minbound[axis] && plane < maxbound[axis]) {
+            float costLeft = calculateSAH(nl + planars, nr, plane, axis, minbound, maxbound, invArea);
+            float costRight = calculateSAH(nl, nr + planars, plane, axis, minbound, maxbound, invArea);
+            if(costLeft < best.cost) {
+                best = {plane, axis, true, costLeft};
+            }
+            if(costRight < best.cost) {
+                best = {plane, axis, false, costRight};
+            }
+        }
+        nl += starts + planars;
+    }
 }
 
-struct split chooseSplitNlogN2(const std::vector<object_node_t>& nodes, int depth, glm::vec3 minbound, glm::vec3 maxbound) {
-    double bestCost = calculateSAH(0, nodes.size(), minbound[0], 0, minbound, maxbound); //nodes.size() * surfaceArea(maxbound - minbound);
-    int bestAxis = -1;
-    double bestPlane = NAN;
-    int n = nodes.size();
-
-    std::vector<KDEvent> events;
-    // looping per axis performs slower for building than just using balanced splits w/ depth % 3, obviously,
-    // and performance gains aren't worth the loss in building.
-    int axis = depth % 3;
-    for(int i = 0; i < n; i++) {
-        if(nodes[i].minbound[axis]> minbound[axis])
-            events.push_back((KDEvent){&nodes[i], nodes[i].minbound[axis], START});
-        if(nodes[i].maxbound[axis] < maxbound[axis])
-            events.push_back((KDEvent){&nodes[i], nodes[i].maxbound[axis], END});
-    }
-    std::sort(events.begin(), events.end(), eventLess);
-    int Nl = 0;
-    int Nr = n;
-    for(unsigned long i = 0; i < events.size(); i++) {
-        KDEvent *event = &events[i];
-        assert(event->plane > minbound[axis] && event->plane < maxbound[axis]);
-        if(event->type == END)
-            Nr--; // this is not included in the right plane anymore
-        double cost = calculateSAH(Nl, Nr, event->plane, axis, minbound, maxbound);
-        if(cost < bestCost) {
-            bestCost = cost;
-            bestPlane = event->plane;
-            bestAxis = axis;
+// Moves the events of one axis into the children: one-sided primitives' events as they are,
+// merged with the straddling primitives' clipped events, which get sorted here.
+void partitionAxis(std::vector<KDEvent>& ev, std::vector<KDEvent>& lc, std::vector<KDEvent>& rc,
+                   const std::vector<uint8_t>& side, int nl, int nr,
+                   std::vector<KDEvent>& l, std::vector<KDEvent>& r) {
+    std::sort(lc.begin(), lc.end(), eventLess);
+    std::sort(rc.begin(), rc.end(), eventLess);
+    // same as std::merge but filtering the parent's list on the fly
+    l.reserve(2 * nl);
+    r.reserve(2 * nr);
+    size_t li = 0, ri = 0;
+    for(const KDEvent& e : ev) {
+        if(side[e.prim] == LEFT_ONLY) {
+            for(; li < lc.size() && eventLess(lc[li], e); li++)
+                l.push_back(lc[li]);
+            l.push_back(e);
+        } else if(side[e.prim] == RIGHT_ONLY) {
+            for(; ri < rc.size() && eventLess(rc[ri], e); ri++)
+                r.push_back(rc[ri]);
+            r.push_back(e);
         }
-        if(event->type == START)
-            Nl++; // this now has to be included in left plane, but not until next evt
+    }
+    l.insert(l.end(), lc.begin() + li, lc.end());
+    r.insert(r.end(), rc.begin() + ri, rc.end());
+    std::vector<KDEvent>().swap(ev); // free the parent's lists on the way down
+    std::vector<KDEvent>().swap(lc);
+    std::vector<KDEvent>().swap(rc);
+}
+
+// Sorts a long event list as sorted chunks in parallel followed by rounds of pairwise merges.
+// eventLess is a total order, so the result is the same as one std::sort.
+void parallelSort(std::vector<KDEvent>& ev, ThreadPool& pool) {
+    int nchunks = std::min<int>(pool.size(), std::max<int>(ev.size() / 4096, 1));
+    std::vector<size_t> bounds(nchunks + 1);
+    for(int i = 0; i <= nchunks; i++) {
+        bounds[i] = ev.size() * i / nchunks;
+    }
+    pool.parallelFor(0, nchunks, [&ev, &bounds](int lo, int hi) {
+        for(int i = lo; i < hi; i++) {
+            std::sort(ev.begin() + bounds[i], ev.begin() + bounds[i + 1], eventLess);
+        }
+    });
+    for(int width = 1; width < nchunks; width *= 2) {
+        int npairs = (nchunks + 2 * width - 1) / (2 * width);
+        pool.parallelFor(0, npairs, [&ev, &bounds, width, nchunks](int lo, int hi) {
+            for(int p = lo; p < hi; p++) {
+                int first = p * 2 * width;
+                int mid = std::min(first + width, nchunks);
+                int last = std::min(first + 2 * width, nchunks);
+                std::inplace_merge(ev.begin() + bounds[first], ev.begin() + bounds[mid], ev.begin() + bounds[last], eventLess);
+            }
+        });
+    }
+}
+
+struct KDBuildTask;
+
+// Builds a subtree into its own node and index arrays, with indices local to them.
+//
+// With a pool, the nodes near the root are built on the calling thread with their three axes
+// swept and partitioned in parallel, and every node with fewer than m_taskSize primitives is
+// left as a placeholder and queued as a task instead, to be built on the pool by a serial
+// KDBuilder. Every node goes through the same steps either way, so the tree comes out
+// identical to a serial build.
+class KDBuilder {
+public:
+    KDBuilder(const object_node_t *prims, size_t numPrims, ThreadPool *pool, int taskSize) :
+        m_prims(prims),
+        m_side(numPrims),
+        m_pool(pool),
+        m_taskSize(taskSize) {
+    }
+
+    uint32_t build(KDEventLists& events, int nprims, int depth, glm::vec3 minbound, glm::vec3 maxbound);
+    // drops the scratch space, which is as big as the scene, once the subtree is built
+    void finish() { std::vector<uint8_t>().swap(m_side); }
+
+    std::vector<KDNode> nodes;
+    std::vector<int> primIndices;
+    // for each placeholder in nodes, the index of its task in tasks, -1 for real nodes
+    std::vector<int> taskOf;
+    std::vector<std::unique_ptr<KDBuildTask>> tasks;
 
+private:
+    void makeLeaf(uint32_t node, const std::vector<KDEvent>& events);
+
+    const object_node_t *m_prims;
+    // which side of the current split each primitive goes, slot per scene primitive
+    std::vector<uint8_t> m_side;
+    ThreadPool *m_pool;
+    int m_taskSize;
+};
+
+struct KDBuildTask {
+    KDEventLists events;
+    int nprims, depth;
+    glm::vec3 minbound, maxbound;
+    std::unique_ptr<KDBuilder> subtree;
+};
+
+// Leaf over the primitives in one axis' events, which each have exactly one start or planar
+// event there. Sorted by index so leaves don't depend on how events were ordered.
+void KDBuilder::makeLeaf(uint32_t node, const std::vector<KDEvent>& events) {
+    size_t offset = primIndices.size();
+    for(const KDEvent& e : events) {
+        if(e.type != END)
+            primIndices.push_back(e.prim);
     }
-    return {bestPlane, bestAxis};
+    std::sort(primIndices.begin() + offset, primIndices.end());
+    nodes[node].primOffset = offset;
+    nodes[node].flags = KD_LEAF | ((primIndices.size() - offset) << 2);
 }
 
-std::unique_ptr<KDTree> KDTree::buildTree(const std::vector<object_node_t>& m_nodes, int depth, glm::vec3 minbound, glm::vec3 maxbound) {
-    // depth determines where we split: % 3 = 0 -> x, % 3 = 1 -> y, % 3 = 2 -> z
-    if(m_nodes.size() <= 2)
-        return std::make_unique<KDTree>(m_nodes, nullptr, nullptr, depth, minbound, maxbound);
-    //struct split spl = chooseSplit(m_nodes, depth, minbound, maxbound);
-    struct split spl = chooseSplitNlogN2(m_nodes, depth, minbound, maxbound);
-    double axis = spl.plane;
-    int splitAxis = spl.axis;
-    if(std::isnan(axis) || splitAxis == -1) { // no split necessary
-        return std::make_unique<KDTree>(m_nodes, nullptr, nullptr, depth, minbound, maxbound);
-    }
-    double minAxis = minbound[splitAxis];
-    double maxAxis = maxbound[splitAxis];
-    std::vector<object_node_t> left_nodes;
-    std::vector<object_node_t> right_nodes;
-    for(unsigned long i = 0; i < m_nodes.size(); i++) {
-        double objbL = m_nodes[i].minbound[splitAxis];
-        double objbR = m_nodes[i].maxbound[splitAxis];
-        if(!((objbL <= minAxis && objbR <= minAxis)
-                || (objbL >= axis && objbR >= axis))) {
-            left_nodes.push_back(m_nodes[i]);
+// Appends the subtree over the nprims primitives in events depth-first and returns its root.
+// Consumes events.
+uint32_t KDBuilder::build(KDEventLists& events, int nprims, int depth, glm::vec3 minbound, glm::vec3 maxbound) {
+    uint32_t node = nodes.size();
+    nodes.push_back(KDNode());
+    if(m_pool != nullptr) {
+        taskOf.push_back(-1);
+        if(nprims < m_taskSize) {
+            taskOf[node] = tasks.size();
+            tasks.push_back(std::unique_ptr<KDBuildTask>(
+                                new KDBuildTask{std::move(events), nprims, depth, minbound, maxbound, nullptr}));
+            return node;
+        }
+    }
+
+    struct split spl = {NAN, -1, false, INFINITY};
+    // MAX_DEPTH also bounds traverse()'s stack
+    float area = surfaceArea(maxbound - minbound);
+    if(nprims > 0 && depth < MAX_DEPTH && area > 0) {
+        struct split axisBest[3];
+        auto sweep = [&](int axis) {
+            axisBest[axis] = {NAN, -1, false, INFINITY};
+            findSplitOnAxis(events.axis[axis], axis, nprims, minbound, maxbound, 1.f / area, axisBest[axis]);
+        };
+        if(m_pool != nullptr) {
+            m_pool->parallelFor(0, 3, [&sweep](int lo, int hi) {
+                for(int axis = lo; axis < hi; axis++)
+                    sweep(axis);
+            });
+        } else {
+            for(int axis = 0; axis < 3; axis++)
+                sweep(axis);
         }
-        if(!((objbL <= axis && objbR <= axis)
-             || (objbL >= maxAxis && objbR >= maxAxis))) {
-            right_nodes.push_back(m_nodes[i]);
+        // earliest axis wins ties
+        for(int axis = 0; axis < 3; axis++) {
+            if(axisBest[axis].cost < spl.cost)
+                spl = axisBest[axis];
         }
     }
-    if(left_nodes.size() == 0) {
-        assert(right_nodes.size() == m_nodes.size());
-        return std::make_unique<KDTree>(m_nodes, nullptr, nullptr, depth, minbound, maxbound);
+    if(!(spl.cost < KD_INTERSECT_COST * nprims)) {
+        makeLeaf(node, events.axis[0]);
+        return node;
+    }
+
+    // classify against the split. Touching the plane from one side puts a primitive on that
+    // side only, same as the traversal assumes.
+    for(const KDEvent& e : events.axis[0]) {
+        m_side[e.prim] = BOTH;
     }
-    if(right_nodes.size() == 0) {
-        assert(left_nodes.size() == m_nodes.size());
-        return std::make_unique<KDTree>(m_nodes, nullptr, nullptr, depth, minbound, maxbound);
+    for(const KDEvent& e : events.axis[spl.axis]) {
+        if(e.type == END && e.plane <= spl.plane)
+            m_side[e.prim] = LEFT_ONLY;
+        else if(e.type == START && e.plane >= spl.plane)
+            m_side[e.prim] = RIGHT_ONLY;
+        else if(e.type == PLANAR) {
+            if(e.plane < spl.plane || (e.plane == spl.plane && spl.planarLeft))
+                m_side[e.prim] = LEFT_ONLY;
+            else
+                m_side[e.prim] = RIGHT_ONLY;
+        }
     }
     glm::vec3 leftmax = maxbound;
-    leftmax[splitAxis] = axis;
+    leftmax[spl.axis] = spl.plane;
     glm::vec3 rightmin = minbound;
-    rightmin[splitAxis] = axis;
-    // i had a threaded impl that would do one of these trees on a thread
-    // and the other without and then join the thread, but it was slower
-    std::unique_ptr<KDTree> rightTree = buildTree(right_nodes, depth+1, rightmin, maxbound);
-    std::unique_ptr<KDTree> leftTree = buildTree(left_nodes, depth+1, minbound, leftmax);
-    return std::make_unique<KDTree>(m_nodes.size(), std::move(leftTree), std::move(rightTree), depth, minbound, maxbound);
+    rightmin[spl.axis] = spl.plane;
+
+    // one-sided primitives keep their events, already in order. Straddling ones get new
+    // events clipped to each child, which are the only ones that need sorting.
+    KDEventLists left, right, leftClipped, rightClipped;
+    int nl = 0, nr = 0;
+    for(const KDEvent& e : events.axis[0]) {
+        if(e.type == END)
+            continue;
+        if(m_side[e.prim] == LEFT_ONLY) {
+            nl++;
+        } else if(m_side[e.prim] == RIGHT_ONLY) {
+            nr++;
+        } else {
+            nl++;
+            nr++;
+            const object_node_t& obj = m_prims[e.prim];
+            addEvents(leftClipped, e.prim, glm::max(obj.minbound, minbound), glm::min(obj.maxbound, leftmax));
+            addEvents(rightClipped, e.prim, glm::max(obj.minbound, rightmin), glm::min(obj.maxbound, maxbound));
+        }
+    }
+    auto partition = [&](int axis) {
+        partitionAxis(events.axis[axis], leftClipped.axis[axis], rightClipped.axis[axis], m_side, nl, nr,
+                      left.axis[axis], right.axis[axis]);
+    };
+    if(m_pool != nullptr) {
+        m_pool->parallelFor(0, 3, [&partition](int lo, int hi) {
+            for(int axis = lo; axis < hi; axis++)
+                partition(axis);
+        });
+    } else {
+        for(int axis = 0; axis < 3; axis++)
+            partition(axis);
+    }
+
+    build(left, nl, depth+1, minbound, leftmax); // lands at node + 1
+    uint32_t above = build(right, nr, depth+1, rightmin, maxbound);
+    nodes[node].split = spl.plane;
+    nodes[node].flags = spl.axis | (above << 2);
+    return node;
+}
+
+// Copies the subtree at node of a builder's arrays to the end of the tree's, renumbering
+// child and primitive offsets and expanding task placeholders into the subtrees their
+// tasks built. Returns where node ended up.
+uint32_t KDTree::splice(const KDBuilder& from, uint32_t node) {
+    if(!from.taskOf.empty() && from.taskOf[node] >= 0) {
+        const KDBuilder& subtree = *from.tasks[from.taskOf[node]]->subtree;
+        uint32_t base = m_nodes.size();
+        uint32_t primBase = m_primIndices.size();
+        for(KDNode n : subtree.nodes) {
+            if(n.isLeaf())
+                n.primOffset += primBase;
+            else
+                n.flags += base << 2;
+            m_nodes.push_back(n);
+        }
+        m_primIndices.insert(m_primIndices.end(), subtree.primIndices.begin(), subtree.primIndices.end());
+        return base;
+    }
+    uint32_t to = m_nodes.size();
+    KDNode n = from.nodes[node];
+    m_nodes.push_back(n);
+    if(n.isLeaf()) {
+        m_nodes[to].primOffset = m_primIndices.size();
+        m_primIndices.insert(m_primIndices.end(), from.primIndices.begin() + n.primOffset,
+                             from.primIndices.begin() + n.primOffset + n.primCount());
+        return to;
+    }
+    splice(from, node + 1);
+    uint32_t above = splice(from, n.aboveChild());
+    m_nodes[to].flags = n.axis() | (above << 2);
+    return to;
+}
+
+std::unique_ptr<KDTree> KDTree::buildTree(const std::vector<object_node_t>& nodes, glm::vec3 minbound, glm::vec3 maxbound,
+                                          ThreadPool *pool) {
+    std::unique_ptr<KDTree> tree(new KDTree(nodes, minbound, maxbound));
+    if(pool != nullptr && pool->size() < 2)
+        pool = nullptr;
+    KDEventLists events;
+    for(int axis = 0; axis < 3; axis++) {
+        events.axis[axis].reserve(2 * nodes.size());
+    }
+    for(unsigned long i = 0; i < nodes.size(); i++) {
+        addEvents(events, i, glm::max(nodes[i].minbound, minbound), glm::min(nodes[i].maxbound, maxbound));
+    }
+    if(pool == nullptr) {
+        KDBuilder builder(tree->m_prims, nodes.size(), nullptr, 0);
+        for(int axis = 0; axis < 3; axis++) {
+            std::sort(events.axis[axis].begin(), events.axis[axis].end(), eventLess);
+        }
+        builder.build(events, nodes.size(), 0, minbound, maxbound);
+        tree->m_nodes = std::move(builder.nodes);
+        tree->m_primIndices = std::move(builder.primIndices);
+        return tree;
+    }
+
+    for(int axis = 0; axis < 3; axis++) {
+        parallelSort(events.axis[axis], *pool);
+    }
+    // enough tasks to keep every thread busy even though their sizes vary a lot, but big
+    // enough that each one is worth a job
+    int taskSize = std::max<int>(nodes.size() / (8 * pool->size()), 256);
+    KDBuilder top(tree->m_prims, nodes.size(), pool, taskSize);
+    top.build(events, nodes.size(), 0, minbound, maxbound);
+    // biggest first, so no thread picks up a big subtree just as the others run out of work
+    std::vector<KDBuildTask *> queue;
+    for(auto& task : top.tasks) {
+        queue.push_back(task.get());
+    }
+    std::stable_sort(queue.begin(), queue.end(), [](const KDBuildTask *a, const KDBuildTask *b) {
+        return a->nprims > b->nprims;
+    });
+    const object_node_t *prims = tree->m_prims;
+    size_t numPrims = nodes.size();
+    for(KDBuildTask *task : queue) {
+        pool->addJob([task, prims, numPrims]() {
+            task->subtree = std::unique_ptr<KDBuilder>(new KDBuilder(prims, numPrims, nullptr, 0));
+            task->subtree->build(task->events, task->nprims, task->depth, task->minbound, task->maxbound);
+            task->subtree->finish();
+        });
+    }
+    pool->wait();
+    tree->splice(top, 0);
+    return tree;
+}
+
+bool KDTree::sameTreeAs(const KDTree& other) const {
+    if(m_nodes.size() != other.m_nodes.size() || m_primIndices != other.m_primIndices)
+        return false;
+    for(size_t i = 0; i < m_nodes.size(); i++) {
+        // primOffset covers the split's bits too
+        if(m_nodes[i].flags != other.m_nodes[i].flags || m_nodes[i].primOffset != other.m_nodes[i].primOffset)
+            return false;
+    }
+    return true;
 }
 
 void KDTree::pprint() {
+    pprint(0, 0);
+}
+
+void KDTree::pprint(uint32_t node, int depth) {
     char spaces[MAX_DEPTH + 2];
-    for(int i = 0; i < m_depth; i++) {
+    int indent = std::min(depth, MAX_DEPTH);
+    for(int i = 0; i < indent; i++) {
         spaces[i] = ' ';
     }
-    spaces[m_depth] = 0;
-
-    printf("%sDepth=%d, #nodes = %d, children:\n", spaces, m_depth, m_nodecount);
-    if(m_l != nullptr)
-        m_l->pprint();
-    if(m_r != nullptr)
-        m_r->pprint();
+    spaces[indent] = 0;
 
+    const KDNode& n = m_nodes[node];
+    if(n.isLeaf()) {
+        printf("%sDepth=%d, leaf, #prims = %u\n", spaces, depth, n.primCount());
+        return;
+    }
+    printf("%sDepth=%d, split %c = %f, children:\n", spaces, depth, "xyz"[n.axis()], n.split);
+    pprint(node + 1, depth + 1);
+    pprint(n.aboveChild(), depth + 1);
 }
 
 // NOTE: There are definitely more efficient ways of doing cube intersection, and as it stands,
@@ -216,83 +477,143 @@ double intersectAABB(glm::vec4 P, glm::vec4 d, glm::vec3 minbound, glm::vec3 max
 }
 
 
-struct ixInfo findIntersect(glm::vec4 P, glm::vec4 d, const std::vector<object_node_t>& nodes) {
-    double smallestT = INFINITY;
-    ISPlace isectPlace = UNDEF;
-    const object_node_t *front_obj = NULL;
-    glm::vec4 os_intersect;
-    //printf("itering thru obj, n_objs = %d\n", m_nodes.size());
-    for(unsigned long i = 0; i < nodes.size(); i++) {
-        const object_node_t *obj = &nodes[i];
-        glm::vec4 eye_os = obj->invtrans * P;
-        glm::vec4 v_dir_os = obj->invtrans * d;
-        auto t_p = ImplicitShape::getIntersectT(obj->primitive.type, eye_os, v_dir_os);
-        double t = t_p.t;
-        if(t >= 0 && t < smallestT) {
-            //printf("found new smallest intersection at %f\n", t);
-            isectPlace = t_p.pl;
-            smallestT = t;
-            front_obj = obj;
-            os_intersect = eye_os + glm::vec4(smallestT, smallestT, smallestT, 0) * v_dir_os;
-        }
+// Tests every primitive in leaf, keeping whichever of them and nearest is closest.
+void KDTree::findIntersect(glm::vec4 P, glm::vec4 d, const KDNode& leaf, struct ixInfo& nearest) {
+    const int *prims = &m_primIndices[leaf.primOffset];
+    for(unsigned long i = 0; i < leaf.primCount(); i++) {
+        intersectPrimitive(P, d, &m_prims[prims[i]], nearest);
     }
-    struct ixInfo ixi = {isectPlace, smallestT, front_obj, os_intersect};
-    return ixi;
 }
 
+// Front-to-back walk that only ever looks at the split planes: [tmin, tmax] is the part of
+// the ray inside the current node, so a node is entered only if the ray actually passes
+// through it, and the walk stops as soon as the nearest hit so far is in front of the next
+// node on the stack.
 struct ixInfo KDTree::traverse(glm::vec4 P, glm::vec4 d) {
+    struct ixInfo nearest;
+    nearest.place = UNDEF;
+    nearest.t = INFINITY;
+    nearest.obj = NULL;
+    glm::vec3 invd = 1.f/glm::vec3(d);
+
+    // clip the ray to the root bounds
+    float tmin = 0, tmax = INFINITY;
+    for(int axis = 0; axis < 3; axis++) {
+        float t0 = (m_minbound[axis] - P[axis]) * invd[axis];
+        float t1 = (m_maxbound[axis] - P[axis]) * invd[axis];
+        if(t0 > t1)
+            std::swap(t0, t1);
+        // NaN (origin on a face of a flat axis) compares false and leaves the interval alone
+        if(t0 > tmin)
+            tmin = t0;
+        if(t1 < tmax)
+            tmax = t1;
+        if(tmin > tmax)
+            return nearest;
+    }
+
+    struct {
+        uint32_t node;
+        float tmin, tmax;
+    } stack[MAX_DEPTH + 1];
+    int top = 0;
+    uint32_t node = 0;
+    while(true) {
+        const KDNode& n = m_nodes[node];
+        if(!n.isLeaf()) {
+            int axis = n.axis();
+            float tplane = (n.split - P[axis]) * invd[axis];
+            bool belowFirst = P[axis] < n.split || (P[axis] == n.split && d[axis] <= 0);
+            uint32_t first = belowFirst ? node + 1 : n.aboveChild();
+            uint32_t second = belowFirst ? n.aboveChild() : node + 1;
+            if(tplane > tmax || !(tplane > 0)) { // only crosses the plane outside [tmin, tmax] (or never)
+                node = first;
+            }
+            else if(tplane < tmin) {
+                node = second;
+            }
+            else {
+                stack[top].node = second;
+                stack[top].tmin = tplane;
+                stack[top].tmax = tmax;
+                top++;
+                node = first;
+                tmax = tplane;
+            }
+            continue;
+        }
+        findIntersect(P, d, n, nearest);
+        if(nearest.t <= tmax) // hit inside this node: everything still on the stack is farther
+            break;
+        if(top == 0)
+            break;
+        top--;
+        node = stack[top].node;
+        tmin = stack[top].tmin;
+        tmax = stack[top].tmax;
+        if(nearest.t < tmin) // a straddling primitive already hit in front of this node
+            break;
+    }
+    return nearest;
+}
+
+struct ixInfo KDTree::traverseRecursive(glm::vec4 P, glm::vec4 d) {
     glm::vec4 invd = 1.f/d;
     glm::bvec3 dsigns(invd.x >= 0, invd.y >= 0, invd.z >= 0);
     glm::bvec3 idsigns(!dsigns.x, !dsigns.y, !dsigns.z);
-    return traverse(P, d, invd, dsigns, idsigns);
+    return traverseRecursive(0, m_minbound, m_maxbound, P, d, invd, dsigns, idsigns);
 }
 
-struct ixInfo KDTree::traverse(glm::vec4 P, glm::vec4 d, glm::vec4 invd, glm::bvec3 dsigns, glm::bvec3 idsigns) {
-    if(m_l == nullptr)
-        if(m_r == nullptr){
-            // leaf
-            struct ixInfo i = findIntersect(P, d, m_nodes);
-            return i;
-        }
-        else {
-            return m_r->traverse(P, d, invd, dsigns, idsigns);
-    }
-    else if(m_r == nullptr) {
-        return m_l->traverse(P, d, invd, dsigns, idsigns);
-    }
-    else {
-        struct ixInfo ixi1, ixi2;
-        ixi1.t = INFINITY;
-        ixi2.t = INFINITY;
-        ixi1.place = UNDEF;
-        ixi2.place = UNDEF;
-        ixi1.obj = NULL;
-        ixi2.obj = NULL;
-        double t1 = ImplicitShape::AABBIntersectT(P, d, invd, dsigns, idsigns, m_l->m_minbound, m_l->m_maxbound);
-        double t2 = ImplicitShape::AABBIntersectT(P, d, invd, dsigns, idsigns, m_r->m_minbound, m_r->m_maxbound);
-        if(t1 < t2) { // we hit left first
-            ixi1 = m_l->traverse(P, d, invd, dsigns, idsigns);
-            if(t2 < ixi1.t) // if we hit an object past the bbox of right, we must traverse it too (edge case)
-                ixi2 = m_r->traverse(P, d, invd, dsigns, idsigns);
-        }
-        else if(t1 > t2) { // hit right first
-            ixi2 = m_r->traverse(P, d, invd, dsigns, idsigns);
-            if(t1 < ixi2.t) // similar edge case
-                ixi1 = m_l->traverse(P, d, invd, dsigns, idsigns);
-        }
-        else if(std::isinf(t1)) {
-            return ixi1;
-        }
-        else { // hits both at the same time? weird, but could happen... Check both
-            ixi1 = m_l->traverse(P, d, invd, dsigns, idsigns);
-            ixi2 = m_r->traverse(P, d, invd, dsigns, idsigns);
-        }
+// mib/mxb are the bounds of node. The children's bounds are those cut at the split plane.
+struct ixInfo KDTree::traverseRecursive(uint32_t node, glm::vec3 mib, glm::vec3 mxb, glm::vec4 P, glm::vec4 d, glm::vec4 invd, glm::bvec3 dsigns, glm::bvec3 idsigns) {
+    const KDNode& n = m_nodes[node];
+    if(n.isLeaf()) {
+        struct ixInfo nearest;
+        nearest.place = UNDEF;
+        nearest.t = INFINITY;
+        nearest.obj = NULL;
+        findIntersect(P, d, n, nearest);
+        return nearest;
+    }
+    int splitAxis = n.axis();
+    glm::vec3 leftmax = mxb;
+    leftmax[splitAxis] = n.split;
+    glm::vec3 rightmin = mib;
+    rightmin[splitAxis] = n.split;
+    uint32_t l = node + 1;
+    uint32_t r = n.aboveChild();
 
-        if(ixi1.t < ixi2.t) {
-            return ixi1;
-        }
-        return ixi2;
+    struct ixInfo ixi1, ixi2;
+    ixi1.t = INFINITY;
+    ixi2.t = INFINITY;
+    ixi1.place = UNDEF;
+    ixi2.place = UNDEF;
+    ixi1.obj = NULL;
+    ixi2.obj = NULL;
+    double t1 = ImplicitShape::AABBIntersectT(P, d, invd, dsigns, idsigns, mib, leftmax);
+    double t2 = ImplicitShape::AABBIntersectT(P, d, invd, dsigns, idsigns, rightmin, mxb);
+    if(t1 < t2) { // we hit left first
+        ixi1 = traverseRecursive(l, mib, leftmax, P, d, invd, dsigns, idsigns);
+        if(t2 < ixi1.t) // if we hit an object past the bbox of right, we must traverse it too (edge case)
+            ixi2 = traverseRecursive(r, rightmin, mxb, P, d, invd, dsigns, idsigns);
+    }
+    else if(t1 > t2) { // hit right first
+        ixi2 = traverseRecursive(r, rightmin, mxb, P, d, invd, dsigns, idsigns);
+        if(t1 < ixi2.t) // similar edge case
+            ixi1 = traverseRecursive(l, mib, leftmax, P, d, invd, dsigns, idsigns);
+    }
+    else if(std::isinf(t1)) {
+        return ixi1;
+    }
+    else { // hits both at the same time? weird, but could happen... Check both
+        ixi1 = traverseRecursive(l, mib, leftmax, P, d, invd, dsigns, idsigns);
+        ixi2 = traverseRecursive(r, rightmin, mxb, P, d, invd, dsigns, idsigns);
+    }
+
+    if(ixi1.t < ixi2.t) {
+        return ixi1;
     }
+    return ixi2;
 }
 
 
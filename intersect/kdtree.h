@@ -1,36 +1,63 @@
 #ifndef KDTREE_H
 #define KDTREE_H
-#include "scenegraph/Scene.h"
-#include <memory>
-#include "intersect/implicitshape.h"
+#include "intersect/accelerator.h"
+#include <cstdint>
 #include <thread>
 #include <glm/gtx/transform.hpp>
 #define MAX_DEPTH 36
 
-struct ixInfo {
-    ISPlace place;
-    double t;
-    const object_node_t *obj;
-    glm::vec4 ix;
+// One kd-tree node, 8 bytes. The low 2 bits of flags are the split axis, or KD_LEAF.
+// Interior: the child below the split is the next node in the array, the other child's index
+// is flags >> 2. Leaf: primCount = flags >> 2 primitives starting at primOffset in the
+// tree's primitive index list.
+#define KD_LEAF 3
+struct KDNode {
+    union {
+        float split;
+        uint32_t primOffset;
+    };
+    uint32_t flags;
+
+    bool isLeaf() const { return (flags & 3) == KD_LEAF; }
+    int axis() const { return flags & 3; }
+    uint32_t aboveChild() const { return flags >> 2; }
+    uint32_t primCount() const { return flags >> 2; }
 };
 
+class KDBuilder;
 
-class KDTree
+// Nodes are laid out depth-first in one array and leaves refer to primitives by index, so a
+// primitive that straddles splits costs an int per leaf it lands in instead of a copy of its
+// object_node_t.
+//
+// Given a pool with more than one thread, buildTree() builds the top of the tree with each
+// node's axes handled in parallel and the subtrees below it as separate jobs. The result is
+// the same tree, node for node, as the serial build.
+class KDTree : public Accelerator
 {
 public:
-    KDTree(std::vector<object_node_t> nodes, std::unique_ptr<KDTree> l, std::unique_ptr<KDTree> r, int depth, glm::vec3 mib, glm::vec3 mxb);
-    KDTree(int nodecount, std::unique_ptr<KDTree> l, std::unique_ptr<KDTree> r, int depth, glm::vec3 mib, glm::vec3 mxb);
-    KDTree(){};
-    static std::unique_ptr<KDTree> buildTree(const std::vector<object_node_t>& m_nodes, int depth, glm::vec3 minbound, glm::vec3 maxbound);
+    static std::unique_ptr<KDTree> buildTree(const std::vector<object_node_t>& nodes, glm::vec3 minbound, glm::vec3 maxbound,
+                                             ThreadPool *pool = nullptr);
     void pprint();
-    struct ixInfo traverse(glm::vec4 P, glm::vec4 d);
+    struct ixInfo traverse(glm::vec4 P, glm::vec4 d) override;
+    // same result through the old recursive walk, kept to benchmark traverse() against
+    struct ixInfo traverseRecursive(glm::vec4 P, glm::vec4 d);
+    const char *name() const override { return "kd-tree"; }
+    size_t numNodes() const override { return m_nodes.size(); }
+    size_t numPrimRefs() const override { return m_primIndices.size(); }
+    size_t numBytes() const override { return m_nodes.size() * sizeof(KDNode) + m_primIndices.size() * sizeof(int); }
+    // same nodes in the same order over the same primitives
+    bool sameTreeAs(const KDTree& other) const;
 private:
-    struct ixInfo traverse(glm::vec4 P, glm::vec4 d, glm::vec4 invd, glm::bvec3 dsigns, glm::bvec3 idsigns);
-    int m_nodecount;
-    std::vector<object_node_t> m_nodes;
-    std::unique_ptr<KDTree> m_l, m_r;
+    KDTree(const std::vector<object_node_t>& prims, glm::vec3 mib, glm::vec3 mxb);
+    uint32_t splice(const KDBuilder& from, uint32_t node);
+    void pprint(uint32_t node, int depth);
+    void findIntersect(glm::vec4 P, glm::vec4 d, const KDNode& leaf, struct ixInfo& nearest);
+    struct ixInfo traverseRecursive(uint32_t node, glm::vec3 mib, glm::vec3 mxb, glm::vec4 P, glm::vec4 d, glm::vec4 invd, glm::bvec3 dsigns, glm::bvec3 idsigns);
+    const object_node_t *m_prims;
+    std::vector<KDNode> m_nodes;
+    std::vector<int> m_primIndices;
     glm::vec3 m_minbound, m_maxbound;
-    int m_depth;
 };
 
 #endif // KDTREE_H
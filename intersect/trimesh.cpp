@@ -0,0 +1,314 @@
+#include "trimesh.h"
+#include <algorithm>
+#include <numeric>
+#include <cfloat>
+
+namespace {
+// SAH cost model. A triangle test costs about as much as a box test.
+const float MESH_TRAVERSAL_COST = 1.f;
+const float MESH_INTERSECT_COST = 1.f;
+// centroid bins per axis
+const int MESH_BINS = 16;
+// nodes with more faces than this get split even when the SAH says not to
+const int MESH_MAX_LEAF = 4;
+// deeper nodes become leaves, which bounds the traversal stack
+const int MESH_MAX_DEPTH = 64;
+// 1 + 2 gamma(3), the most rounding can shrink a slab test's far distance by in float (Ize,
+// "Robust BVH Ray Traversal", JCGT 2013)
+const float MESH_BOX_PAD = 1.f + 2.f * (1.5f * FLT_EPSILON) / (1.f - 1.5f * FLT_EPSILON);
+
+float halfArea(glm::vec3 minbound, glm::vec3 maxbound) {
+    glm::vec3 e = maxbound - minbound;
+    return e.x * e.y + e.y * e.z + e.x * e.z;
+}
+
+struct Bin {
+    glm::vec3 minbound, maxbound;
+    int count;
+};
+
+int binOf(float centroid, float cmin, float scale) {
+    return std::min(static_cast<int>((centroid - cmin) * scale), MESH_BINS - 1);
+}
+
+// what the build needs to know about each face
+struct FaceBoxes {
+    std::vector<glm::vec3> minbound, maxbound, centroid;
+};
+
+// Appends the subtree over the count faces at first in order depth-first, reordering them so
+// each leaf's are contiguous, and returns its root. Same binned SAH as the scene's BVH.
+uint32_t buildNodes(const FaceBoxes& faces, std::vector<uint32_t>& order, uint32_t first, uint32_t count,
+                    int depth, std::vector<BVHNode>& nodes) {
+    uint32_t node = nodes.size();
+    nodes.push_back(BVHNode());
+    glm::vec3 minbound(INFINITY), maxbound(-INFINITY);
+    glm::vec3 cmin(INFINITY), cmax(-INFINITY);
+    for(uint32_t i = first; i < first + count; i++) {
+        uint32_t f = order[i];
+        minbound = glm::min(minbound, faces.minbound[f]);
+        maxbound = glm::max(maxbound, faces.maxbound[f]);
+        cmin = glm::min(cmin, faces.centroid[f]);
+        cmax = glm::max(cmax, faces.centroid[f]);
+    }
+    nodes[node].minbound = minbound;
+    nodes[node].maxbound = maxbound;
+
+    int bestAxis = -1, bestBin = 0;
+    float bestCost = INFINITY;
+    float area = halfArea(minbound, maxbound);
+    bool canSplit = depth < MESH_MAX_DEPTH;
+    if(count > 1 && canSplit && area > 0) {
+        for(int axis = 0; axis < 3; axis++) {
+            float extent = cmax[axis] - cmin[axis];
+            if(!(extent > 0))
+                continue;
+            float scale = MESH_BINS / extent;
+            Bin bins[MESH_BINS];
+            for(Bin& bin : bins) {
+                bin = {glm::vec3(INFINITY), glm::vec3(-INFINITY), 0};
+            }
+            for(uint32_t i = first; i < first + count; i++) {
+                uint32_t f = order[i];
+                Bin& bin = bins[binOf(faces.centroid[f][axis], cmin[axis], scale)];
+                bin.minbound = glm::min(bin.minbound, faces.minbound[f]);
+                bin.maxbound = glm::max(bin.maxbound, faces.maxbound[f]);
+                bin.count++;
+            }
+            // rightArea[i] is the area of everything in bins i and up
+            float rightArea[MESH_BINS];
+            glm::vec3 rmin(INFINITY), rmax(-INFINITY);
+            for(int i = MESH_BINS - 1; i > 0; i--) {
+                rmin = glm::min(rmin, bins[i].minbound);
+                rmax = glm::max(rmax, bins[i].maxbound);
+                rightArea[i] = rmin.x <= rmax.x ? halfArea(rmin, rmax) : 0;
+            }
+            glm::vec3 lmin(INFINITY), lmax(-INFINITY);
+            int nl = 0;
+            for(int i = 0; i < MESH_BINS - 1; i++) {
+                lmin = glm::min(lmin, bins[i].minbound);
+                lmax = glm::max(lmax, bins[i].maxbound);
+                nl += bins[i].count;
+                int nr = count - nl;
+                if(nl == 0 || nr == 0)
+                    continue;
+                float cost = MESH_TRAVERSAL_COST +
+                        MESH_INTERSECT_COST * (halfArea(lmin, lmax) * nl + rightArea[i + 1] * nr) / area;
+                if(cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = i;
+                }
+            }
+        }
+    }
+
+    uint32_t mid;
+    if(bestAxis >= 0 && (bestCost < MESH_INTERSECT_COST * count || count > MESH_MAX_LEAF)) {
+        float cminAxis = cmin[bestAxis];
+        float scale = MESH_BINS / (cmax[bestAxis] - cminAxis);
+        auto split = std::partition(order.begin() + first, order.begin() + first + count, [&](uint32_t f) {
+            return binOf(faces.centroid[f][bestAxis], cminAxis, scale) <= bestBin;
+        });
+        mid = split - order.begin();
+    } else if(count > MESH_MAX_LEAF && canSplit) {
+        // all the centroids are in one spot; halve the list instead
+        bestAxis = 0;
+        mid = first + count / 2;
+    } else {
+        nodes[node].offset = first;
+        nodes[node].flags = BVH_LEAF | (count << 2);
+        return node;
+    }
+    buildNodes(faces, order, first, mid - first, depth + 1, nodes); // lands at node + 1
+    uint32_t second = buildNodes(faces, order, mid, first + count - mid, depth + 1, nodes);
+    nodes[node].offset = second;
+    nodes[node].flags = bestAxis;
+    return node;
+}
+
+// The scene BVH's box test, with each far distance pushed out by MESH_BOX_PAD so rounding
+// can't make a ray miss the box around a triangle it hits.
+bool hitBox(glm::vec3 minbound, glm::vec3 maxbound, glm::vec3 o, glm::vec3 invd, float tmax, float& tmin) {
+    float t0 = 0, t1 = tmax;
+    for(int axis = 0; axis < 3; axis++) {
+        float tnear = ((invd[axis] >= 0 ? minbound[axis] : maxbound[axis]) - o[axis]) * invd[axis];
+        float tfar = ((invd[axis] >= 0 ? maxbound[axis] : minbound[axis]) - o[axis]) * invd[axis] * MESH_BOX_PAD;
+        if(tnear > t0)
+            t0 = tnear;
+        if(tfar < t1)
+            t1 = tfar;
+    }
+    tmin = t0;
+    return t0 <= t1;
+}
+
+// A ray set up for the watertight test: kz is the axis d is longest along, and the shear
+// (sx, sy, sz) takes d to (0, 0, 1) in the kx, ky, kz frame.
+struct ShearedRay {
+    glm::vec3 o;
+    int kx, ky, kz;
+    float sx, sy, sz;
+};
+
+ShearedRay shearRay(glm::vec3 o, glm::vec3 d) {
+    glm::vec3 a = glm::abs(d);
+    int kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    // keeps the frame right handed, so the sign of the edge functions means the same thing
+    if(d[kz] < 0)
+        std::swap(kx, ky);
+    return {o, kx, ky, kz, d[kx] / d[kz], d[ky] / d[kz], 1.f / d[kz]};
+}
+
+// Whether the ray crosses triangle abc at some t in [0, tmax). If so, t and the barycentric
+// weights of a, b and c.
+bool hitTriangle(const ShearedRay& r, const glm::vec3 *tri, float tmax, float& t, glm::vec3& bary) {
+    glm::vec3 a = tri[0] - r.o, b = tri[1] - r.o, c = tri[2] - r.o;
+    float ax = a[r.kx] - r.sx * a[r.kz], ay = a[r.ky] - r.sy * a[r.kz];
+    float bx = b[r.kx] - r.sx * b[r.kz], by = b[r.ky] - r.sy * b[r.kz];
+    float cx = c[r.kx] - r.sx * c[r.kz], cy = c[r.ky] - r.sy * c[r.kz];
+    // twice the signed area of the sheared ray's hole and each edge
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    // one that rounds to 0 could be either sign, which decides which neighbor gets an edge hit
+    if(u == 0 || v == 0 || w == 0) {
+        u = (float) ((double) cx * by - (double) cy * bx);
+        v = (float) ((double) ax * cy - (double) ay * cx);
+        w = (float) ((double) bx * ay - (double) by * ax);
+    }
+    if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+    float det = u + v + w;
+    if(det == 0)
+        return false;
+    // t = tscaled / det, range checked before dividing
+    float tscaled = u * r.sz * a[r.kz] + v * r.sz * b[r.kz] + w * r.sz * c[r.kz];
+    if(det > 0 ? (tscaled < 0 || tscaled >= tmax * det) : (tscaled > 0 || tscaled <= tmax * det))
+        return false;
+    float invDet = 1.f / det;
+    t = tscaled * invDet;
+    bary = glm::vec3(u, v, w) * invDet;
+    return true;
+}
+}
+
+TriangleMesh::TriangleMesh(const std::vector<glm::vec3>& points, const std::vector<glm::ivec3>& faces) :
+    m_nodes(),
+    m_tris(),
+    m_faces(),
+    m_norms(points.size()),
+    m_minbound(INFINITY),
+    m_maxbound(-INFINITY) {
+    FaceBoxes boxes;
+    boxes.minbound.resize(faces.size());
+    boxes.maxbound.resize(faces.size());
+    boxes.centroid.resize(faces.size());
+    for(size_t i = 0; i < faces.size(); i++) {
+        glm::vec3 a = points[faces[i].x], b = points[faces[i].y], c = points[faces[i].z];
+        boxes.minbound[i] = glm::min(a, glm::min(b, c));
+        boxes.maxbound[i] = glm::max(a, glm::max(b, c));
+        boxes.centroid[i] = (boxes.minbound[i] + boxes.maxbound[i]) / 2.f;
+        // not normalized, so each face counts by its area
+        glm::vec3 n = glm::cross(b - a, c - a);
+        m_norms[faces[i].x] += n;
+        m_norms[faces[i].y] += n;
+        m_norms[faces[i].z] += n;
+    }
+    std::vector<uint32_t> order(faces.size());
+    std::iota(order.begin(), order.end(), 0);
+    if(faces.empty())
+        return;
+    m_nodes.reserve(2 * faces.size());
+    buildNodes(boxes, order, 0, faces.size(), 0, m_nodes);
+
+    m_tris.resize(3 * faces.size());
+    m_faces.resize(faces.size());
+    for(size_t i = 0; i < faces.size(); i++) {
+        glm::ivec3 f = faces[order[i]];
+        m_faces[i] = f;
+        m_tris[3 * i] = points[f.x];
+        m_tris[3 * i + 1] = points[f.y];
+        m_tris[3 * i + 2] = points[f.z];
+    }
+    glm::vec3 scale = glm::max(glm::abs(m_nodes[0].minbound), glm::abs(m_nodes[0].maxbound));
+    glm::vec3 pad(1e-5f * std::max(scale.x, std::max(scale.y, scale.z)));
+    m_minbound = m_nodes[0].minbound - pad;
+    m_maxbound = m_nodes[0].maxbound + pad;
+}
+
+struct tAndPlace TriangleMesh::intersect(glm::vec4 P, glm::vec4 d) const {
+    struct tAndPlace hit = {INFINITY, UNDEF};
+    glm::vec3 o(P);
+    glm::vec3 invd = 1.f/glm::vec3(d);
+    float tmin;
+    if(m_nodes.empty() || !hitBox(m_nodes[0].minbound, m_nodes[0].maxbound, o, invd, INFINITY, tmin))
+        return hit;
+    ShearedRay ray = shearRay(o, glm::vec3(d));
+    float nearest = INFINITY;
+    uint32_t nearestFace = BVH_NONE;
+    glm::vec3 nearestBary;
+
+    // the farther child of each node on the way down, with where the ray enters it
+    struct {
+        uint32_t node;
+        float tmin;
+    } stack[MESH_MAX_DEPTH + 1];
+    int top = 0;
+    uint32_t node = 0;
+    while(true) {
+        const BVHNode& n = m_nodes[node];
+        if(n.isLeaf()) {
+            for(uint32_t i = n.offset; i < n.offset + n.primCount(); i++) {
+                float t;
+                glm::vec3 bary;
+                if(hitTriangle(ray, &m_tris[3 * i], nearest, t, bary)) {
+                    nearest = t;
+                    nearestFace = i;
+                    nearestBary = bary;
+                }
+            }
+        } else {
+            uint32_t a = node + 1, b = n.offset;
+            float ta, tb;
+            bool hitA = hitBox(m_nodes[a].minbound, m_nodes[a].maxbound, o, invd, nearest, ta);
+            bool hitB = hitBox(m_nodes[b].minbound, m_nodes[b].maxbound, o, invd, nearest, tb);
+            if(hitA && hitB) {
+                if(tb < ta) {
+                    std::swap(a, b);
+                    std::swap(ta, tb);
+                }
+                stack[top++] = {b, tb};
+                node = a;
+                continue;
+            } else if(hitA) {
+                node = a;
+                continue;
+            } else if(hitB) {
+                node = b;
+                continue;
+            }
+        }
+        // skip anything the ray only reaches past the nearest hit so far
+        while(top > 0 && stack[top - 1].tmin > nearest) {
+            top--;
+        }
+        if(top == 0)
+            break;
+        node = stack[--top].node;
+    }
+    if(nearestFace == BVH_NONE)
+        return hit;
+    glm::ivec3 f = m_faces[nearestFace];
+    hit.t = nearest;
+    hit.pl = MESH;
+    hit.normal = nearestBary.x * m_norms[f.x] + nearestBary.y * m_norms[f.y] + nearestBary.z * m_norms[f.z];
+    if(hit.normal == glm::vec3(0)) {
+        // a point whose faces' normals cancel out
+        const glm::vec3 *tri = &m_tris[3 * nearestFace];
+        hit.normal = glm::cross(tri[1] - tri[0], tri[2] - tri[0]);
+    }
+    return hit;
+}
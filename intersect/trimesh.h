@@ -0,0 +1,44 @@
+#ifndef TRIMESH_H
+#define TRIMESH_H
+#include "intersect/bvh.h"
+
+// A closed triangle surface, like a TetMesh's boundary faces, with its own BVH in the mesh's
+// coordinates. A PRIMITIVE_MESH scene node points at one of these and places it with its
+// transform, so the scene's accelerator only sees one box per mesh instance and the triangles
+// are walked here: a two-level hierarchy, with one TriangleMesh shared by every instance of a
+// mesh file.
+//
+// The triangle test is watertight (Woop, Benthin and Wald, "Watertight Ray/Triangle
+// Intersection", JCGT 2013). The ray is sheared onto +z and the edge functions are evaluated
+// there, so a ray through a shared edge or vertex hits at least one of the triangles around it
+// instead of slipping through a crack rounding leaves between them. The box tests on the way
+// down are widened by the slab test's rounding error to match.
+class TriangleMesh
+{
+public:
+    // faces index points and are wound counterclockwise seen from outside
+    TriangleMesh(const std::vector<glm::vec3>& points, const std::vector<glm::ivec3>& faces);
+    // Nearest hit along P + t d, t >= 0. The place is MESH and the normal is the vertex normals
+    // interpolated there, in the mesh's coordinates and not normalized.
+    struct tAndPlace intersect(glm::vec4 P, glm::vec4 d) const;
+    // box around every face, grown by a hair so box tests further up can't clip the silhouette
+    glm::vec3 minbound() const { return m_minbound; }
+    glm::vec3 maxbound() const { return m_maxbound; }
+    size_t numTriangles() const { return m_faces.size(); }
+    size_t numNodes() const { return m_nodes.size(); }
+    size_t numBytes() const {
+        return m_nodes.size() * sizeof(BVHNode) + m_tris.size() * sizeof(glm::vec3) +
+                m_faces.size() * sizeof(glm::ivec3) + m_norms.size() * sizeof(glm::vec3);
+    }
+private:
+    std::vector<BVHNode> m_nodes;
+    // three corners per face, in the order the leaves list them
+    std::vector<glm::vec3> m_tris;
+    // the faces in the same order, for the normals at a hit
+    std::vector<glm::ivec3> m_faces;
+    // per point, area weighted like TetMesh's
+    std::vector<glm::vec3> m_norms;
+    glm::vec3 m_minbound, m_maxbound;
+};
+
+#endif // TRIMESH_H
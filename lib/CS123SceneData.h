@@ -9,6 +9,7 @@
 
 #include <vector>
 #include <string>
+#include <memory>
 
 #include "glm/glm.hpp"
 
@@ -163,5 +164,18 @@ struct CS123SceneNode {
    std::vector<CS123SceneNode*> children;
 };
 
+class TriangleMesh;
+
+// A primitive flattened out of the scene graph with its cumulative transform (see Scene::parse)
+typedef struct ObjectNode {
+    CS123ScenePrimitive primitive;
+    glm::mat4x4 trans;
+    glm::mat4x4 invtrans;
+    glm::vec3 minbound, maxbound;
+    bool disablePhysics = false;
+    // surface of a PRIMITIVE_MESH in its object space, for the ray tracer (see RayScene)
+    std::shared_ptr<const TriangleMesh> mesh;
+} object_node_t;
+
 #endif
 
@@ -0,0 +1,492 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <thread>
+#include <QImage>
+#include "Settings.h"
+#include "Scene.h"
+#include "RayScene.h"
+#include "intersect/kdtree.h"
+#include "intersect/accelerator.h"
+#include "intersect/bvh.h"
+#include "CamtransCamera.h"
+#include "CS123XmlSceneParser.h"
+#include "shapes/timing.h"
+#include "shapes/tetmesh.h"
+#include "scenegraph/ThreadPool.h"
+
+// Ray traces a scene file straight to an image with no window, for batch renders on
+// machines without a display. Ray features come from the same saved settings as the GUI
+// unless overridden on the command line.
+
+namespace {
+void usage() {
+    printf("usage: raytrace [--size WxH] [--samples N] [--serial] [--no-kdtree] [--accel kdtree|bvh|bvh4]\n"
+           "                [--all-features] [--tile-map map.png] [--simulate N [--fracture]]\n"
+           "                scene.xml out.png|out.ppm\n"
+           "       --samples N renders N x N samples per pixel\n"
+           "       --simulate N steps the scene's meshes N times first and renders them as they end up\n"
+           "       --tile-map writes the render time of each tile as a grayscale image\n"
+           "       raytrace --bench-traversal scene.xml [nrays]\n"
+           "       raytrace --bench-build scene.xml [maxthreads]\n"
+           "       raytrace --bench-accel scene.xml [nrays]\n"
+           "       raytrace --bench-refit scene.xml [frames]\n");
+}
+
+void sceneBounds(const std::vector<object_node_t>& nodes, glm::vec3& minbound, glm::vec3& maxbound) {
+    minbound = glm::vec3(INFINITY);
+    maxbound = glm::vec3(-INFINITY);
+    for(const object_node_t& node : nodes) {
+        minbound = glm::min(minbound, node.minbound);
+        maxbound = glm::max(maxbound, node.maxbound);
+    }
+}
+
+// Half the rays start on a sphere around the scene and aim at a random point inside it, like
+// camera rays; the other half start inside the scene in a random direction, like shadow and
+// reflection rays.
+void randomRays(glm::vec3 minbound, glm::vec3 maxbound, int nrays, std::vector<glm::vec4>& origins,
+                std::vector<glm::vec4>& dirs) {
+    glm::vec3 center = (minbound + maxbound) / 2.f;
+    float radius = glm::length(maxbound - minbound);
+    origins.resize(nrays);
+    dirs.resize(nrays);
+    srand(1);
+    for(int i = 0; i < nrays; i++) {
+        glm::vec3 onSphere;
+        do {
+            onSphere = glm::vec3(rand(), rand(), rand()) / (float) RAND_MAX * 2.f - 1.f;
+        } while(glm::length(onSphere) > 1 || glm::length(onSphere) < 0.01f);
+        glm::vec3 inside = minbound + glm::vec3(rand(), rand(), rand()) / (float) RAND_MAX * (maxbound - minbound);
+        if(i % 2 == 0) {
+            glm::vec3 origin = center + glm::normalize(onSphere) * radius;
+            origins[i] = glm::vec4(origin, 1);
+            dirs[i] = glm::vec4(glm::normalize(inside - origin), 0);
+        } else {
+            origins[i] = glm::vec4(inside, 1);
+            dirs[i] = glm::vec4(glm::normalize(onSphere), 0);
+        }
+    }
+}
+
+// Casts the same random rays through the iterative and the recursive kd-tree walks, checks
+// they agree and reports rays/s for each.
+void benchTraversal(const std::vector<object_node_t>& nodes, int nrays) {
+    glm::vec3 minbound, maxbound;
+    sceneBounds(nodes, minbound, maxbound);
+    double start = get_time();
+    std::unique_ptr<KDTree> tree = KDTree::buildTree(nodes, minbound, maxbound);
+    printf("%lu primitives, kd-tree built in %.3f s, %lu nodes, %lu primitive refs\n", nodes.size(),
+           get_time() - start, tree->numNodes(), tree->numPrimRefs());
+
+    std::vector<glm::vec4> origins, dirs;
+    randomRays(minbound, maxbound, nrays, origins, dirs);
+
+    std::vector<ixInfo> iterative(nrays), recursive(nrays);
+    start = get_time();
+    for(int i = 0; i < nrays; i++) {
+        iterative[i] = tree->traverse(origins[i], dirs[i]);
+    }
+    double iterativeSecs = get_time() - start;
+    start = get_time();
+    for(int i = 0; i < nrays; i++) {
+        recursive[i] = tree->traverseRecursive(origins[i], dirs[i]);
+    }
+    double recursiveSecs = get_time() - start;
+
+    int hits = 0, mismatches = 0;
+    for(int i = 0; i < nrays; i++) {
+        hits += iterative[i].place != UNDEF;
+        // the same primitive, or a different one at the same distance
+        if(iterative[i].obj != recursive[i].obj && iterative[i].t != recursive[i].t)
+            mismatches++;
+    }
+    printf("%d rays, %d hit, %d different hits\n", nrays, hits, mismatches);
+    printf("recursive: %.3f s, %.3f Mrays/s\n", recursiveSecs, nrays / recursiveSecs * 1e-6);
+    printf("iterative: %.3f s, %.3f Mrays/s (%.1fx)\n", iterativeSecs, nrays / iterativeSecs * 1e-6,
+           recursiveSecs / iterativeSecs);
+}
+
+// Builds the kd-tree serially and then on pools of 1, 2, 4... threads up to maxthreads, best
+// of a few runs each, and checks every parallel build gives the serial build's tree.
+void benchBuild(const std::vector<object_node_t>& nodes, int maxthreads) {
+    glm::vec3 minbound, maxbound;
+    sceneBounds(nodes, minbound, maxbound);
+    const int runs = 3;
+    auto timeBuild = [&](ThreadPool *pool, std::unique_ptr<KDTree>& tree) {
+        double best = INFINITY;
+        for(int i = 0; i < runs; i++) {
+            double start = get_time();
+            tree = KDTree::buildTree(nodes, minbound, maxbound, pool);
+            best = std::min(best, get_time() - start);
+        }
+        return best;
+    };
+    std::unique_ptr<KDTree> serial;
+    double serialSecs = timeBuild(nullptr, serial);
+    printf("%lu primitives, %lu nodes, %lu primitive refs, %u hardware threads\n", nodes.size(),
+           serial->numNodes(), serial->numPrimRefs(), std::thread::hardware_concurrency());
+    printf("  serial:     %8.3f s\n", serialSecs);
+    for(int threads = 1; ; threads = std::min(threads * 2, maxthreads)) {
+        ThreadPool pool(threads);
+        std::unique_ptr<KDTree> tree;
+        double secs = timeBuild(&pool, tree);
+        printf("  %3d threads: %8.3f s, %5.2fx%s\n", threads, secs, serialSecs / secs,
+               tree->sameTreeAs(*serial) ? "" : ", DIFFERENT TREE");
+        if(threads == maxthreads)
+            break;
+    }
+}
+
+// Whether hit and reference, two traversals of the same ray, disagree: one hit something and
+// the other missed, or they hit different primitives at distances more than 1e-4 (relative to
+// the reference's) apart.
+bool differentHit(const ixInfo& hit, const ixInfo& reference) {
+    bool hitSomething = hit.place != UNDEF;
+    if(hitSomething != (reference.place != UNDEF))
+        return true;
+    return hitSomething && hit.obj != reference.obj && std::abs(hit.t - reference.t) > 1e-4 * reference.t;
+}
+
+// Builds every kind of acceleration structure over the scene and casts the same random rays
+// through each, single-threaded, to pick one per workload. Hits are checked against the
+// kd-tree's.
+void benchAccelerators(const std::vector<object_node_t>& nodes, int nrays) {
+    glm::vec3 minbound, maxbound;
+    sceneBounds(nodes, minbound, maxbound);
+    std::vector<glm::vec4> origins, dirs;
+    randomRays(minbound, maxbound, nrays, origins, dirs);
+
+    printf("%lu primitives, %d rays\n", nodes.size(), nrays);
+    printf("%-8s %9s %9s %9s %9s %9s %10s %s\n", "", "build s", "nodes", "prim refs", "KB", "trace s", "Mrays/s", "different hits");
+    std::vector<ixInfo> reference;
+    for(int type : {RAY_ACCEL_KDTREE, RAY_ACCEL_BVH, RAY_ACCEL_BVH4}) {
+        double start = get_time();
+        std::unique_ptr<Accelerator> accel = Accelerator::build(type, nodes, minbound, maxbound);
+        double buildSecs = get_time() - start;
+
+        std::vector<ixInfo> hits(nrays);
+        start = get_time();
+        for(int i = 0; i < nrays; i++) {
+            hits[i] = accel->traverse(origins[i], dirs[i]);
+        }
+        double traceSecs = get_time() - start;
+        if(reference.empty())
+            reference = hits;
+        int mismatches = 0;
+        for(int i = 0; i < nrays; i++) {
+            if(differentHit(hits[i], reference[i]))
+                mismatches++;
+        }
+        printf("%-8s %9.3f %9lu %9lu %9lu %9.3f %10.3f %d\n", accel->name(), buildSecs, accel->numNodes(),
+               accel->numPrimRefs(), accel->numBytes() / 1024, traceSecs, nrays / traceSecs * 1e-6, mismatches);
+    }
+}
+
+// Animates 1%, 10% and then all of the scene's primitives, each drifting its own way by 2% of
+// the scene's size per frame, and keeps a BVH up to date through refit() with and without
+// partial rebuilds. Each frame's refit is timed against building a new BVH, and at the end
+// the refit tree's SAH cost and rays/s are compared to a new one's and its hits checked
+// against it.
+void benchRefit(const std::vector<object_node_t>& original, int frames, int nrays) {
+    glm::vec3 minbound, maxbound;
+    sceneBounds(original, minbound, maxbound);
+    float step = 0.02f * glm::length(maxbound - minbound);
+    std::vector<glm::vec4> origins, dirs;
+    randomRays(minbound, maxbound, nrays, origins, dirs);
+    auto trace = [&](Accelerator& accel, std::vector<ixInfo>& hits) {
+        hits.resize(nrays);
+        double start = get_time();
+        for(int i = 0; i < nrays; i++) {
+            hits[i] = accel.traverse(origins[i], dirs[i]);
+        }
+        return nrays / (get_time() - start) * 1e-6;
+    };
+
+    printf("%lu primitives, %d frames, %d rays\n", original.size(), frames, nrays);
+    printf("%-6s %8s %-8s %10s %10s %10s %8s %10s %10s %s\n", "width", "moving", "rebuild", "refit ms", "build ms",
+           "prims/fr", "SAH", "Mrays/s", "new Mrays/s", "different hits");
+    for(int width : {2, 4}) {
+        for(int percent : {1, 10, 100}) {
+            for(bool rebuild : {false, true}) {
+                std::vector<object_node_t> nodes(original);
+                std::vector<int> moving;
+                std::vector<glm::vec3> drift;
+                srand(2);
+                for(size_t i = 0; i < nodes.size(); i++) {
+                    if(rand() % 100 < percent) {
+                        moving.push_back(i);
+                        glm::vec3 dir(rand(), rand(), rand());
+                        drift.push_back(glm::normalize(dir / (float) RAND_MAX - 0.5f) * step);
+                    }
+                }
+                std::unique_ptr<BVH> bvh = BVH::buildTree(nodes, width);
+                if(!rebuild)
+                    bvh->setRebuildRatio(INFINITY);
+                double refitSecs = 0, buildSecs = 0;
+                size_t rebuiltPrims = 0;
+                for(int f = 0; f < frames; f++) {
+                    for(size_t m = 0; m < moving.size(); m++) {
+                        object_node_t& node = nodes[moving[m]];
+                        node.trans = glm::translate(drift[m]) * node.trans;
+                        node.invtrans = glm::inverse(node.trans);
+                        Scene::primitiveBounds(node.trans, node.minbound, node.maxbound);
+                    }
+                    double start = get_time();
+                    bvh->refit(moving);
+                    refitSecs += get_time() - start;
+                    rebuiltPrims += bvh->lastRebuiltPrims();
+                    start = get_time();
+                    std::unique_ptr<BVH> fresh = BVH::buildTree(nodes, width);
+                    buildSecs += get_time() - start;
+                }
+                std::unique_ptr<BVH> fresh = BVH::buildTree(nodes, width);
+                std::vector<ixInfo> hits, freshHits;
+                double mrays = trace(*bvh, hits);
+                double freshMrays = trace(*fresh, freshHits);
+                int mismatches = 0;
+                for(int i = 0; i < nrays; i++) {
+                    if(differentHit(hits[i], freshHits[i]))
+                        mismatches++;
+                }
+                printf("%-6d %7d%% %-8s %10.3f %10.3f %10lu %4.2fx %10.3f %10.3f %d\n", width, percent,
+                       rebuild ? "partial" : "none", refitSecs / frames * 1e3, buildSecs / frames * 1e3,
+                       rebuiltPrims / frames, bvh->sahCost() / fresh->sahCost(), mrays, freshMrays, mismatches);
+            }
+        }
+    }
+}
+
+// each tile shaded by its render time, white being the slowest tile
+bool saveTileMap(const RenderStats& stats, int width, int height, const std::string& filename) {
+    double slowest = *std::max_element(stats.tileSecs.begin(), stats.tileSecs.end());
+    std::vector<BGRA> pixels(width * height);
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            int tile = (y / RENDER_TILE_SIZE) * stats.tilesX + x / RENDER_TILE_SIZE;
+            unsigned char v = slowest > 0 ? 255 * stats.tileSecs[tile] / slowest : 0;
+            pixels[y * width + x] = BGRA(v, v, v, 255);
+        }
+    }
+    QImage image(reinterpret_cast<uchar *>(pixels.data()), width, height, QImage::Format_RGB32);
+    return image.save(QString::fromStdString(filename));
+}
+
+// Steps the meshes of the scene the way the GUI would and returns them as they end up, with
+// any pieces that broke off.
+std::vector<std::unique_ptr<TetMesh>> simulate(const std::vector<object_node_t>& nodes, int steps) {
+    std::unordered_map<std::string, std::unique_ptr<TetMesh>> templates;
+    std::vector<std::unique_ptr<TetMesh>> meshes;
+    std::vector<object_node_t> meshNodes = tetMeshNodes(nodes);
+    loadTetMeshTemplates(meshNodes, templates);
+    for(const object_node_t& node : meshNodes) {
+        meshes.push_back(std::make_unique<TetMesh>(node, templates));
+    }
+    int perFrame = settings.femIntegrator == FEM_INTEGRATOR_BACKWARD_EULER
+            ? settings.femImplicitStepsPerFrame : settings.femStepsPerFrame;
+    float dt = settings.femTimeStep / perFrame;
+    for(int s = 0; s < steps; s++) {
+        std::vector<std::unique_ptr<TetMesh>> alive;
+        for(auto& mesh : meshes) {
+            if(mesh->update(dt))
+                continue;
+            for(auto& piece : mesh->splitComponents()) {
+                alive.push_back(std::move(piece));
+            }
+            alive.push_back(std::move(mesh));
+        }
+        meshes = std::move(alive);
+    }
+    return meshes;
+}
+
+// same switches as the "check all" button on the Ray dock
+void enableAllRayFeatures() {
+    settings.useSuperSampling = true;
+    settings.useAntiAliasing = false;
+    settings.useShadows = true;
+    settings.useTextureMapping = true;
+    settings.useReflection = true;
+    settings.useRefraction = true;
+    settings.useMultiThreading = true;
+}
+}
+
+int main(int argc, char *argv[]) {
+    settings.loadSettingsOrDefaults();
+
+    if((argc == 3 || argc == 4) && strcmp(argv[1], "--bench-traversal") == 0) {
+        CS123XmlSceneParser parser(argv[2]);
+        if(!parser.parse()) {
+            printf("Could not parse scene %s.\n", argv[2]);
+            return 1;
+        }
+        Scene scene;
+        Scene::parse(&scene, &parser);
+        benchTraversal(scene.m_nodes, argc == 4 ? atoi(argv[3]) : 100000);
+        return 0;
+    }
+
+    if((argc == 3 || argc == 4) && strcmp(argv[1], "--bench-accel") == 0) {
+        CS123XmlSceneParser parser(argv[2]);
+        if(!parser.parse()) {
+            printf("Could not parse scene %s.\n", argv[2]);
+            return 1;
+        }
+        Scene scene;
+        Scene::parse(&scene, &parser);
+        benchAccelerators(scene.m_nodes, argc == 4 ? atoi(argv[3]) : 100000);
+        return 0;
+    }
+
+    if((argc == 3 || argc == 4) && strcmp(argv[1], "--bench-refit") == 0) {
+        CS123XmlSceneParser parser(argv[2]);
+        if(!parser.parse()) {
+            printf("Could not parse scene %s.\n", argv[2]);
+            return 1;
+        }
+        Scene scene;
+        Scene::parse(&scene, &parser);
+        benchRefit(scene.m_nodes, argc == 4 ? std::max(atoi(argv[3]), 1) : 10, 100000);
+        return 0;
+    }
+
+    if((argc == 3 || argc == 4) && strcmp(argv[1], "--bench-build") == 0) {
+        CS123XmlSceneParser parser(argv[2]);
+        if(!parser.parse()) {
+            printf("Could not parse scene %s.\n", argv[2]);
+            return 1;
+        }
+        Scene scene;
+        Scene::parse(&scene, &parser);
+        int hardware = std::max<int>(std::thread::hardware_concurrency(), 1);
+        benchBuild(scene.m_nodes, argc == 4 ? std::max(atoi(argv[3]), 1) : std::max(hardware, 8));
+        return 0;
+    }
+
+    int width = 512, height = 512;
+    int simulateSteps = 0;
+    std::string tileMap;
+    std::vector<std::string> inputs;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--size" && i + 1 < argc) {
+            if(sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                usage();
+                return 1;
+            }
+        } else if(arg == "--samples" && i + 1 < argc) {
+            settings.numSuperSamples = std::max(1, atoi(argv[++i]));
+            settings.useSuperSampling = settings.numSuperSamples > 1;
+            settings.useAntiAliasing = false;
+        } else if(arg == "--serial") {
+            settings.useMultiThreading = false;
+        } else if(arg == "--no-kdtree") {
+            settings.useKDTree = false;
+        } else if(arg == "--accel" && i + 1 < argc) {
+            std::string accel = argv[++i];
+            if(accel == "kdtree") {
+                settings.rayAccelerator = RAY_ACCEL_KDTREE;
+            } else if(accel == "bvh") {
+                settings.rayAccelerator = RAY_ACCEL_BVH;
+            } else if(accel == "bvh4") {
+                settings.rayAccelerator = RAY_ACCEL_BVH4;
+            } else {
+                usage();
+                return 1;
+            }
+            settings.useKDTree = true;
+        } else if(arg == "--all-features") {
+            enableAllRayFeatures();
+        } else if(arg == "--tile-map" && i + 1 < argc) {
+            tileMap = argv[++i];
+        } else if(arg == "--simulate" && i + 1 < argc) {
+            simulateSteps = std::max(0, atoi(argv[++i]));
+        } else if(arg == "--fracture") {
+            settings.femFracture = true;
+        } else if(arg.compare(0, 2, "--") == 0) {
+            usage();
+            return 1;
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if(inputs.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    double loadStart = get_time();
+    CS123XmlSceneParser parser(inputs[0]);
+    if(!parser.parse()) {
+        printf("Could not parse scene %s.\n", inputs[0].data());
+        return 1;
+    }
+    Scene scene;
+    Scene::parse(&scene, &parser);
+    double loadSecs = get_time() - loadStart;
+    std::vector<std::unique_ptr<TetMesh>> meshes;
+    double simSecs = 0;
+    if(simulateSteps > 0) {
+        double simStart = get_time();
+        meshes = simulate(scene.m_nodes, simulateSteps);
+        simSecs = get_time() - simStart;
+    }
+
+    // set up the camera the same way MainWindow::fileOpen does
+    CamtransCamera camera;
+    CS123SceneCameraData cameraData;
+    if(parser.getCameraData(cameraData)) {
+        cameraData.pos[3] = 1;
+        cameraData.look[3] = 0;
+        cameraData.up[3] = 0;
+        camera.orientLook(cameraData.pos, cameraData.look, cameraData.up);
+        camera.setHeightAngle(cameraData.heightAngle);
+    }
+    camera.setAspectRatio(static_cast<float>(width) / height);
+
+    std::unique_ptr<RayScene> ownedScene = simulateSteps > 0 ? std::make_unique<RayScene>(scene, meshes)
+                                                             : std::make_unique<RayScene>(scene);
+    RayScene& rayScene = *ownedScene;
+    rayScene.setDrawParams(&camera, width, height);
+    std::vector<BGRA> pixels(width * height);
+    RenderStats stats = rayScene.render(pixels.data());
+
+    // BGRA is laid out as QImage::Format_RGB32, same as the 2D canvas
+    QImage image(reinterpret_cast<uchar *>(pixels.data()), width, height, QImage::Format_RGB32);
+    if(!image.save(QString::fromStdString(inputs[1]))) {
+        printf("Could not write %s.\n", inputs[1].data());
+        return 1;
+    }
+    if(!tileMap.empty() && !saveTileMap(stats, width, height, tileMap)) {
+        printf("Could not write %s.\n", tileMap.data());
+        return 1;
+    }
+
+    int nsamps = settings.useSuperSampling ? settings.numSuperSamples : 1;
+    printf("\n");
+    printf("%lu primitives, %dx%d, %dx%d samples/pixel\n", rayScene.m_nodes.size(), width, height, nsamps, nsamps);
+    printf("loaded in %.3f s\n", loadSecs);
+    if(simulateSteps > 0)
+        printf("%d simulation steps in %.3f s, %lu meshes\n", simulateSteps, simSecs, meshes.size());
+    if(settings.useKDTree)
+        printf("%s built in %.3f s\n", rayScene.accelerator()->name(), rayScene.buildSecs());
+    printf("rendered in %.3f s, %llu rays, %.2f Mrays/s\n", stats.secs, stats.rays, stats.rays / stats.secs * 1e-6);
+    // CPU time over wall time, so with more threads than cores they can't all reach 100%
+    printf("%lu render threads on %u hardware threads:\n", stats.threadSecs.size(), std::thread::hardware_concurrency());
+    for(size_t i = 0; i < stats.threadSecs.size(); i++) {
+        printf("  thread %2lu: %6.1f%% busy, %llu rays\n", i, 100 * stats.threadSecs[i] / stats.secs, stats.threadRays[i]);
+    }
+    // a tile much slower than the median is what one thread is left finishing alone at the end
+    std::vector<double> tileSecs(stats.tileSecs);
+    std::sort(tileSecs.begin(), tileSecs.end());
+    printf("%lu tiles of %dx%d: min %.2f ms, median %.2f ms, p99 %.2f ms, max %.2f ms\n", tileSecs.size(),
+           RENDER_TILE_SIZE, RENDER_TILE_SIZE, tileSecs.front() * 1e3, tileSecs[tileSecs.size() / 2] * 1e3,
+           tileSecs[tileSecs.size() * 99 / 100] * 1e3, tileSecs.back() * 1e3);
+    return 0;
+}
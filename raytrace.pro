@@ -0,0 +1,76 @@
+# -------------------------------------------------
+# Headless ray tracer (raytrace.cpp). Renders a scene file to an image with no window or
+# OpenGL, so it runs as a batch job on machines with no GPU or display:
+#     qmake raytrace.pro -o Makefile.raytrace && make -f Makefile.raytrace
+# -------------------------------------------------
+QT += xml
+QT -= opengl widgets
+TARGET = raytrace
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= app_bundle
+
+QMAKE_CXXFLAGS += -Ofast -std=c++14
+
+# keep objects apart from CS123.pro's, several sources are shared
+OBJECTS_DIR = raytrace-build
+MOC_DIR = raytrace-build
+
+# mesh primitives are loaded through TetMesh
+LIBS += tetgen/libtet.a
+libtet.target = tetgen/libtet.a
+libtet.commands = cd tetgen && make -f makefile
+QMAKE_EXTRA_TARGETS += libtet
+OBJECTS += tetgen/libtet.a
+SOURCES += \
+    raytrace.cpp \
+    camera/CamtransCamera.cpp \
+    scenegraph/Scene.cpp \
+    scenegraph/RayScene.cpp \
+    ui/Settings.cpp \
+    lib/BGRA.cpp \
+    lib/CS123XmlSceneParser.cpp \
+    intersect/implicitshape.cpp \
+    intersect/kdtree.cpp \
+    intersect/accelerator.cpp \
+    intersect/bvh.cpp \
+    intersect/trimesh.cpp \
+    shapes/tetmesh.cpp \
+    shapes/tetkernel.cpp \
+    shapes/surfacebuffer.cpp \
+    shapes/tetmeshparser.cpp \
+    shapes/tetmeshbinary.cpp \
+    shapes/timing.cpp
+
+HEADERS += \
+    camera/Camera.h \
+    camera/CamtransCamera.h \
+    scenegraph/Scene.h \
+    scenegraph/RayScene.h \
+    scenegraph/ThreadPool.h \
+    ui/Settings.h \
+    lib/BGRA.h \
+    lib/CS123SceneData.h \
+    lib/CS123ISceneParser.h \
+    lib/CS123XmlSceneParser.h \
+    intersect/implicitshape.h \
+    intersect/kdtree.h \
+    intersect/accelerator.h \
+    intersect/bvh.h \
+    intersect/trimesh.h \
+    shapes/tetmesh.h \
+    shapes/tetkernel.h \
+    shapes/surfacebuffer.h \
+    shapes/tetmeshparser.h \
+    shapes/tetmeshbinary.h \
+    shapes/timing.h \
+    tetgen/tetgen.h
+
+INCLUDEPATH += glm camera lib scenegraph ui tetgen Eigen
+DEPENDPATH += glm camera lib scenegraph ui tetgen
+DEFINES += _USE_MATH_DEFINES
+DEFINES += GLM_SWIZZLE GLM_FORCE_RADIANS
+
+QMAKE_CXXFLAGS_RELEASE -= -O2
+QMAKE_CXXFLAGS_RELEASE += -O3
+QMAKE_CXXFLAGS += -g
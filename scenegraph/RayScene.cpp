@@ -5,24 +5,104 @@
 #include "camera/Camera.h"
 #include <iostream>
 #include <thread>
-#include "intersect/kdtree.h"
-#include <sys/time.h>
+#include "intersect/accelerator.h"
+#include "intersect/trimesh.h"
+#include "shapes/tetmesh.h"
+#include "shapes/timing.h"
 #include <functional>
+#include <cstring>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include "ThreadPool.h"
+
+namespace {
+// rays cast by the calling thread so far, read by render() for its per-thread stats
+thread_local unsigned long long t_raysCast = 0;
+
+// CPU time used by the calling thread, so a thread that was waiting for a core doesn't
+// count as busy
+double threadCpuTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Interleaves the bits of x and y. Tiles are handed out in this (Z-curve) order so the tiles
+// in flight at any moment are near each other on screen and walk the same kd-tree nodes.
+unsigned int mortonCode(unsigned int x, unsigned int y) {
+    unsigned int code = 0;
+    for(int b = 0; b < 16; b++) {
+        code |= ((x >> b) & 1) << (2 * b);
+        code |= ((y >> b) & 1) << (2 * b + 1);
+    }
+    return code;
+}
 
+ThreadPool& renderThreadPool() {
+    static ThreadPool pool;
+    return pool;
+}
 
-inline double get_time(void) {
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  return (t.tv_usec * 0.000001 + t.tv_sec);
+// world-space box of node under its transform
+void nodeBounds(object_node_t& node) {
+    if(node.mesh != nullptr)
+        Scene::primitiveBounds(node.trans, node.minbound, node.maxbound, node.mesh->minbound(), node.mesh->maxbound());
+    else
+        Scene::primitiveBounds(node.trans, node.minbound, node.maxbound);
+}
+
+// nodes, with the ones tetMeshNodes() simulates swapped for meshes' surfaces as they are now.
+// Mesh points are already in world space, so those nodes aren't transformed.
+std::vector<object_node_t> withLiveMeshes(const std::vector<object_node_t>& nodes,
+                                          const std::vector<std::unique_ptr<TetMesh>>& meshes) {
+    std::vector<object_node_t> out;
+    for(const object_node_t& node : nodes) {
+        switch(node.primitive.type) {
+        case PrimitiveType::PRIMITIVE_MESH:
+        case PrimitiveType::PRIMITIVE_SPHERE:
+        case PrimitiveType::PRIMITIVE_CUBE:
+        case PrimitiveType::PRIMITIVE_CONE:
+            break;
+        default:
+            out.push_back(node);
+        }
+    }
+    for(const std::unique_ptr<TetMesh>& mesh : meshes) {
+        if(mesh->faces().empty())
+            continue;
+        object_node_t node = mesh->getONode();
+        node.primitive.type = PrimitiveType::PRIMITIVE_MESH;
+        node.trans = glm::mat4x4();
+        node.invtrans = glm::mat4x4();
+        node.mesh = std::make_shared<TriangleMesh>(mesh->points(), mesh->faces());
+        nodeBounds(node);
+        out.push_back(node);
+    }
+    return out;
+}
 }
 
 RayScene::RayScene(Scene &scene) :
+    RayScene(scene, scene.m_nodes)
+{
+}
+
+RayScene::RayScene(Scene &scene, const std::vector<std::unique_ptr<TetMesh>>& meshes) :
+    RayScene(scene, withLiveMeshes(scene.m_nodes, meshes))
+{
+}
+
+RayScene::RayScene(Scene &scene, const std::vector<object_node_t>& nodes) :
     Scene(scene),
     m_camTransform(),
     m_invTransform(),
-    m_eye()
+    m_eye(),
+    m_buildSecs(0)
 {
-    m_nodes = std::vector<object_node_t>(scene.m_nodes);
+    m_nodes = nodes;
+    loadMeshes();
 
     m_lights = std::vector<CS123SceneLightData>(scene.m_lights);
     m_global = scene.m_global;
@@ -38,7 +118,43 @@ RayScene::RayScene(Scene &scene) :
         m_textures[it->first] = std::make_unique<QImage>(*(it->second.get())); //std::make_shared<QImage>(*(it->second));
     }
     //printf("Forceloading: image = %p, width = %d\n", m_textures["image/marsTexture.png"].get(), m_textures["image/marsTexture.png"]->width());
-        // get bounds of scene first
+    if(settings.useKDTree) {
+        buildAccelerator();
+    }
+    //m_kdtree->pprint();
+    //printf("my father has %d objs but i have %d objs\n", scene.m_nodes.size(), m_nodes.size());
+    // TODO [INTERSECT]
+    // Remember that any pointers or OpenGL objects (e.g. texture IDs) will
+    // be deleted when the old scene is deleted (assuming you are managing
+    // all your memory properly to prevent memory leaks).  As a result, you
+    // may need to re-allocate some things here.
+}
+
+void RayScene::loadMeshes() {
+    std::map<std::string, std::shared_ptr<const TriangleMesh>> loaded;
+    for(object_node_t& node : m_nodes) {
+        if(node.primitive.type != PrimitiveType::PRIMITIVE_MESH || node.mesh != nullptr)
+            continue;
+        std::shared_ptr<const TriangleMesh>& mesh = loaded[node.primitive.meshfile];
+        if(mesh == nullptr) {
+            double start = get_time();
+            TetMesh tets(node.primitive.meshfile);
+            mesh = std::make_shared<TriangleMesh>(tets.points(), tets.faces());
+            printf("%s: %lu triangles, %lu BVH nodes, %lu KB, took %f secs\n", node.primitive.meshfile.c_str(),
+                   mesh->numTriangles(), mesh->numNodes(), mesh->numBytes() / 1024, get_time() - start);
+            if(mesh->numTriangles() == 0)
+                printf("Warning: %s has no surface to trace, leaving it out.\n", node.primitive.meshfile.c_str());
+            fflush(stdout);
+        }
+        if(mesh->numTriangles() == 0)
+            continue;
+        node.mesh = mesh;
+        nodeBounds(node);
+    }
+}
+
+void RayScene::buildAccelerator() {
+    // get bounds of scene first
     glm::vec3 minbound(INFINITY, INFINITY, INFINITY);
     glm::vec3 maxbound(-INFINITY, -INFINITY, -INFINITY);
     for(unsigned long i = 0; i < m_nodes.size(); i++) {
@@ -49,24 +165,36 @@ RayScene::RayScene(Scene &scene) :
         maxbound.y = glm::max(maxbound.y, m_nodes[i].maxbound.y);
         maxbound.z = glm::max(maxbound.z, m_nodes[i].maxbound.z);
     }
-    if(settings.useKDTree) {
-        printf("kd-tree enabled, building now\n");
-        fflush(stdout);
-        // NOTE: clock() doesn't work with multithreading b/c it counts clocks over all cores
-        // so it looked like multithreading was running slower than normal non-multithreading
-        //std::clock_t start = clock();
-        double start = get_time();
-        m_kdtree = KDTree::buildTree(m_nodes, 0, minbound, maxbound);
-        printf("kd-tree finished building, took %f secs\n", get_time() - start);
-        fflush(stdout);
+    printf("acceleration structure enabled, building now\n");
+    fflush(stdout);
+    // NOTE: clock() doesn't work with multithreading b/c it counts clocks over all cores
+    // so it looked like multithreading was running slower than normal non-multithreading
+    //std::clock_t start = clock();
+    double start = get_time();
+    m_accel = Accelerator::build(settings.rayAccelerator, m_nodes, minbound, maxbound,
+                                 settings.useMultiThreading ? &renderThreadPool() : nullptr);
+    m_buildSecs = get_time() - start;
+    printf("%s finished building, took %f secs, %lu nodes, %lu primitive refs\n", m_accel->name(), m_buildSecs,
+           m_accel->numNodes(), m_accel->numPrimRefs());
+    fflush(stdout);
+}
+
+void RayScene::setNodeTransform(size_t i, const glm::mat4x4 &trans) {
+    m_nodes[i].trans = trans;
+    m_nodes[i].invtrans = glm::inverse(trans);
+    nodeBounds(m_nodes[i]);
+    m_movedNodes.push_back(i);
+}
+
+double RayScene::updateAccelerator() {
+    if(m_movedNodes.empty())
+        return 0;
+    double start = get_time();
+    if(m_accel != nullptr && !m_accel->refit(m_movedNodes)) {
+        buildAccelerator();
     }
-    //m_kdtree->pprint();
-    //printf("my father has %d objs but i have %d objs\n", scene.m_nodes.size(), m_nodes.size());
-    // TODO [INTERSECT]
-    // Remember that any pointers or OpenGL objects (e.g. texture IDs) will
-    // be deleted when the old scene is deleted (assuming you are managing
-    // all your memory properly to prevent memory leaks).  As a result, you
-    // may need to re-allocate some things here.
+    m_movedNodes.clear();
+    return get_time() - start;
 }
 
 /*void RayScene::fill(CS123ISceneParser *parser) {
@@ -106,6 +234,13 @@ glm::vec3 gouraudIlluminate(glm::vec4 point, glm::vec4 normal, CS123SceneMateria
     return (255.f * glm::clamp(rgba, 0.f, 1.f)).xyz();
 }
 
+// object-space normal at a hit, not normalized
+inline glm::vec4 objectNormal(ISPlace place, glm::vec3 meshNormal, glm::vec4 os_intersect) {
+    if(place == MESH)
+        return glm::vec4(meshNormal, 0.f);
+    return ImplicitShape::getNormal(place, os_intersect);
+}
+
 bool isSignificant(glm::vec4 v) {
     const double epsilon = 0.000001;
     return v.x > epsilon && v.y > epsilon && v.z > epsilon;
@@ -396,15 +531,15 @@ glm::vec3 fullIlluminate(glm::vec4 point, glm::vec4 normal, glm::vec3 tangent, g
 }
 
 glm::vec3 colorFromRaySingleObj(RayScene *scene, const object_node_t *obj, glm::vec4 P_ws, glm::vec4 d_ws, int recurseLevel, float recurseWeight) {
+    t_raysCast++;
     glm::vec4 eye_os = obj->invtrans * P_ws;
     glm::vec4 v_dir_os = obj->invtrans * d_ws;
-    auto t_p = ImplicitShape::getIntersectT(
-                obj->primitive.type, eye_os, v_dir_os);
+    auto t_p = ImplicitShape::getIntersectT(*obj, eye_os, v_dir_os);
     if(t_p.pl == UNDEF || std::isinf(t_p.t) || std::isnan(t_p.t))
         return glm::vec3(0.f, 0.f, 0.f);
     glm::vec4 os_intersect = eye_os + (float)t_p.t * v_dir_os;
     glm::vec4 ws_intersect = P_ws + (float)t_p.t * d_ws;
-    glm::vec4 os_N = glm::normalize(ImplicitShape::getNormal(t_p.pl, os_intersect));
+    glm::vec4 os_N = glm::normalize(objectNormal(t_p.pl, t_p.normal, os_intersect));
     glm::vec4 ws_N = glm::normalize(glm::vec4((glm::transpose(obj->invtrans) * os_N).xyz(), 0.f));
     glm::vec2 texcor;
     glm::vec4 os_T;
@@ -420,17 +555,19 @@ glm::vec3 colorFromRaySingleObj(RayScene *scene, const object_node_t *obj, glm::
 }
 
 glm::vec3 RayScene::colorFromRay(RayScene *scene, glm::vec4 P_ws, glm::vec4 d_ws, int recurseLevel, float recurseWeight) {
+    t_raysCast++;
     double smallestT = INFINITY;
     ISPlace isectPlace = UNDEF;
     const object_node_t *front_obj = NULL;
     glm::vec4 os_intersect;
+    glm::vec3 meshNormal;
     if(!settings.useKDTree) {
         //printf("itering thru obj, n_objs = %d\n", m_nodes.size());
         for(unsigned long i = 0; i < scene->m_nodes.size(); i++) {
             const object_node_t *obj = &scene->m_nodes[i];
             glm::vec4 eye_os = obj->invtrans * P_ws;
             glm::vec4 v_dir_os = obj->invtrans * d_ws;
-            auto t_p = ImplicitShape::getIntersectT(obj->primitive.type, eye_os, v_dir_os);
+            auto t_p = ImplicitShape::getIntersectT(*obj, eye_os, v_dir_os);
             double t = t_p.t;
             if(t >= 0 && t < smallestT) {
                 //printf("found new smallest intersection at %f\n", t);
@@ -438,21 +575,23 @@ glm::vec3 RayScene::colorFromRay(RayScene *scene, glm::vec4 P_ws, glm::vec4 d_ws
                 smallestT = t;
                 front_obj = obj;
                 os_intersect = eye_os + glm::vec4(smallestT, smallestT, smallestT, 0) * v_dir_os;
+                meshNormal = t_p.normal;
             }
         }
     }
     else {
-        assert(scene->m_kdtree != nullptr);
-        struct ixInfo res = scene->m_kdtree->traverse(P_ws, d_ws);
+        assert(scene->m_accel != nullptr);
+        struct ixInfo res = scene->m_accel->traverse(P_ws, d_ws);
         isectPlace = res.place;
         smallestT = res.t;
         front_obj = res.obj;
         os_intersect = res.ix;
+        meshNormal = res.normal;
     }
     if(isectPlace == UNDEF || std::isinf(smallestT) || std::isnan(smallestT))
         return glm::vec3(0.f, 0.f, 0.f);
     glm::vec4 ws_intersect = P_ws + glm::vec4(smallestT, smallestT, smallestT, 0) * d_ws;
-    glm::vec4 os_N = glm::normalize(ImplicitShape::getNormal(isectPlace, os_intersect));
+    glm::vec4 os_N = glm::normalize(objectNormal(isectPlace, meshNormal, os_intersect));
     glm::vec4 ws_N = glm::normalize(glm::vec4((glm::transpose(front_obj->invtrans) * os_N).xyz(), 0.f));
     glm::vec2 texcor;
     glm::vec4 os_T;
@@ -468,13 +607,14 @@ glm::vec3 RayScene::colorFromRay(RayScene *scene, glm::vec4 P_ws, glm::vec4 d_ws
 }
 
 double RayScene::rayIntersect(RayScene *scene, glm::vec4 P_ws, glm::vec4 d_ws) {
+    t_raysCast++;
     double smallestT = INFINITY;
     if(!settings.useKDTree) {
         for(unsigned long i = 0; i < scene->m_nodes.size(); i++) {
             const object_node_t *obj = &scene->m_nodes[i];
             glm::vec4 eye_os = obj->invtrans * P_ws;
             glm::vec4 v_dir_os = obj->invtrans * d_ws;
-            auto t_p = ImplicitShape::getIntersectT(obj->primitive.type, eye_os, v_dir_os);
+            auto t_p = ImplicitShape::getIntersectT(*obj, eye_os, v_dir_os);
             double t = t_p.t;
             if(t >= 0 && t < smallestT) {
                 smallestT = t;
@@ -482,20 +622,20 @@ double RayScene::rayIntersect(RayScene *scene, glm::vec4 P_ws, glm::vec4 d_ws) {
         }
     }
     else {
-        struct ixInfo res = scene->m_kdtree->traverse(P_ws, d_ws);
+        struct ixInfo res = scene->m_accel->traverse(P_ws, d_ws);
         if(res.place != UNDEF)
             smallestT = res.t;
     }
     return smallestT;
 }
 
-void RayScene::renderWithParams(RayScene *scene, BGRA *target, int ystart, int nrows, int nsamples, std::function<bool(int, int)> renderCondition) {
+void RayScene::renderWithParams(RayScene *scene, BGRA *target, int xstart, int ystart, int ncols, int nrows, int nsamples, std::function<bool(int, int)> renderCondition) {
     int skipped = 0, notSkipped = 0;
     double samp_inc = 1./nsamples;
     double samp_off = samp_inc/2;
     double weight = samp_inc * samp_inc;
     for(int ypix = ystart; ypix < ystart + nrows; ypix++) {
-        for(int xpix = 0; xpix < scene->m_width; xpix++) {
+        for(int xpix = xstart; xpix < xstart + ncols; xpix++) {
             if(renderCondition != nullptr && !renderCondition(xpix, ypix)) {
                 skipped++;
                 continue;
@@ -524,43 +664,71 @@ void RayScene::renderWithParams(RayScene *scene, BGRA *target, int ystart, int n
     }
 }
 
-void RayScene::draw(Canvas2D *canvas) {
+RenderStats RayScene::render(BGRA *target) {
+    updateAccelerator();
     int maxSamp = settings.numSuperSamples;
-    //printf("drawing\n");
-    canvas->resize(m_width, m_height);
-    BGRA *data = canvas->data();
-    memset(data, 0, m_width*m_height*sizeof(BGRA));
-    //assert(canvas->height() == m_height && canvas->width() == m_width);
-    // turns out multithreading this is pretty easy
+    memset(static_cast<void *>(target), 0, m_width*m_height*sizeof(BGRA));
 
     int nsamps = 1;
     if(settings.useSuperSampling && !settings.useAntiAliasing) // SS uses max num every time
         nsamps = maxSamp;
-    int nthreads = settings.useMultiThreading ? 16 : 1;
-    int rows_per = m_height / nthreads;
-    int extra_rows = m_height % nthreads;
-    int cur_row = 0;
-    std::thread threads[nthreads];
-    // launch all the threads
-    printf("Starting rendering with %d threads\n", nthreads);
+    // Fixed bands of rows per thread left most cores idle whenever the expensive part of the
+    // image (reflections, refractions) sat in one band. Instead every worker pulls the next
+    // small tile off a shared counter until there are none left.
+    int tilesX = (m_width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    int tilesY = (m_height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    int ntiles = tilesX * tilesY;
+    if(ntiles == 0) {
+        // a canvas resized to nothing; there are no tiles to time
+        return RenderStats{0, 0, {}, {}, tilesX, tilesY, {}};
+    }
+    std::vector<int> order(ntiles);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [tilesX](int a, int b) {
+        return mortonCode(a % tilesX, a / tilesX) < mortonCode(b % tilesX, b / tilesX);
+    });
+    int nthreads = settings.useMultiThreading ? renderThreadPool().size() : 1;
+    RenderStats stats = {0, 0, std::vector<double>(nthreads), std::vector<unsigned long long>(nthreads),
+                         tilesX, tilesY, std::vector<double>(ntiles)};
+    std::atomic<int> nextTile(0);
+    auto worker = [this, target, nsamps, ntiles, tilesX, &order, &nextTile, &stats](int w) {
+        double threadStart = threadCpuTime();
+        unsigned long long raysBefore = t_raysCast;
+        for(int i = nextTile++; i < ntiles; i = nextTile++) {
+            int tile = order[i];
+            int x0 = (tile % tilesX) * RENDER_TILE_SIZE;
+            int y0 = (tile / tilesX) * RENDER_TILE_SIZE;
+            double tileStart = threadCpuTime();
+            renderWithParams(this, target, x0, y0, std::min(RENDER_TILE_SIZE, m_width - x0),
+                             std::min(RENDER_TILE_SIZE, m_height - y0), nsamps, nullptr);
+            stats.tileSecs[tile] = threadCpuTime() - tileStart;
+        }
+        stats.threadSecs[w] = threadCpuTime() - threadStart;
+        stats.threadRays[w] = t_raysCast - raysBefore;
+    };
+    printf("Starting rendering with %d threads, %d tiles\n", nthreads, ntiles);
     fflush(stdout);
     double start = get_time();
-    for(int i = 0; i < nthreads; i++) {
-        int nrows = rows_per + (i < extra_rows ? 1 : 0);
-        threads[i] = std::thread(renderWithParams, this, data, cur_row, nrows, nsamps, nullptr);
-        cur_row += nrows;
-    }
-    assert(cur_row == m_height);
-    // now wait for all to finish
-    for(int i = 0; i < nthreads; i++) {
-        threads[i].join();
+    if(nthreads == 1) {
+        worker(0);
+    } else {
+        for(int w = 0; w < nthreads; w++) {
+            renderThreadPool().addJob([&worker, w]() {
+                worker(w);
+            });
+        }
+        renderThreadPool().wait();
     }
-    if(settings.useAntiAliasing) {
+    stats.secs = get_time() - start;
+    for(int w = 0; w < nthreads; w++) {
+        stats.rays += stats.threadRays[w];
     }
-    printf("Rendering done, took %f secs\n", get_time() - start);
+    std::vector<double> sorted(stats.tileSecs);
+    std::sort(sorted.begin(), sorted.end());
+    printf("Rendering done, took %f secs. Per %dx%d tile: median %.2f ms, max %.2f ms\n", stats.secs,
+           RENDER_TILE_SIZE, RENDER_TILE_SIZE, sorted[ntiles / 2] * 1e3, sorted.back() * 1e3);
     fflush(stdout);
-
-    canvas->update();
+    return stats;
 }
 
 RayScene::~RayScene()
@@ -2,16 +2,36 @@
 #define RAYSCENE_H
 
 #include "Scene.h"
-#include "ui/Canvas2D.h"
+#include "BGRA.h"
 #include <vector>
-#include "intersect/kdtree.h"
+#include "intersect/accelerator.h"
 #include <functional>
 
+class Camera;
+class Canvas2D;
+class TetMesh;
+
 // max number of bounces. = 0 means no bounces.
 const int maxRecursion = 20;
 // min weight of recursion. When weight < this, recursion does not happen.
 const float minWeight = 0.00001;
 
+// width and height of the tiles RayScene::render hands to its worker threads
+const int RENDER_TILE_SIZE = 16;
+
+// What one RayScene::render call cost. rays counts every ray cast (camera, shadow, reflection
+// and refraction). threadSecs is the CPU time each render thread used, so threadSecs[i] / secs
+// is how busy thread i kept its core. tileSecs is the CPU time spent on each tile, row-major
+// over the tilesX x tilesY grid, to show where the expensive parts of the image are.
+struct RenderStats {
+    double secs;
+    unsigned long long rays;
+    std::vector<double> threadSecs;
+    std::vector<unsigned long long> threadRays;
+    int tilesX, tilesY;
+    std::vector<double> tileSecs;
+};
+
 /**
  * @class RayScene
  *
@@ -20,19 +40,43 @@ const float minWeight = 0.00001;
 class RayScene : public Scene {
 public:
     RayScene(Scene &scene);
+    // The scene with the nodes that get simulated (see tetMeshNodes) replaced by meshes as they
+    // are now, e.g. to render the pieces of a shattered mesh.
+    RayScene(Scene &scene, const std::vector<std::unique_ptr<TetMesh>>& meshes);
     void setDrawParams(Camera *camera, int width, int height);
     void draw(Canvas2D *canvas);
+    // Renders the whole m_width x m_height image into target. No GUI involved, so this is
+    // what the headless raytrace tool calls; draw() is a wrapper around it.
+    RenderStats render(BGRA *target);
+    double buildSecs() const { return m_buildSecs; }
+    // Moves node i to trans for the next render(), e.g. for the next frame of an animation.
+    // The acceleration structure catches up then, refitting only above the nodes that moved
+    // where it can. Only rigid moves of whole nodes; a deforming mesh's triangle BVH isn't
+    // refit, so its surface needs a new RayScene.
+    void setNodeTransform(size_t i, const glm::mat4x4 &trans);
+    // brings the acceleration structure up to date with setNodeTransform(), which render()
+    // does first anyway. Returns how long that took.
+    double updateAccelerator();
+    // null unless settings.useKDTree
+    const Accelerator *accelerator() const { return m_accel.get(); }
     virtual ~RayScene();
     // static for ease of use with multithreading
-    static void renderWithParams(RayScene *scene, BGRA *target, int ystart, int nrows, int nsamples, std::function<bool(int, int)> renderCondition);
+    static void renderWithParams(RayScene *scene, BGRA *target, int xstart, int ystart, int ncols, int nrows, int nsamples, std::function<bool(int, int)> renderCondition);
     static glm::vec3 colorFromRay(RayScene *scene, glm::vec4 P_ws, glm::vec4 d_ws, int recurseLevel, float recurseWeight);
     static double rayIntersect(RayScene *scene, glm::vec4 P_ws, glm::vec4 d_ws);
 
 private:
+    RayScene(Scene &scene, const std::vector<object_node_t>& nodes);
+    // Gives every PRIMITIVE_MESH node its surface, reading each mesh file once and sharing
+    // the TriangleMesh between all the nodes that use it.
+    void loadMeshes();
+    void buildAccelerator();
     glm::mat4x4 m_camTransform, m_invTransform;
     glm::vec4 m_eye;
     int m_width, m_height;
-    std::unique_ptr<KDTree> m_kdtree;
+    std::unique_ptr<Accelerator> m_accel;
+    double m_buildSecs;
+    std::vector<int> m_movedNodes;
 };
 
 
@@ -0,0 +1,10 @@
+#include "RayScene.h"
+#include "ui/Canvas2D.h"
+
+// Kept out of RayScene.cpp so the ray tracer itself builds without the GUI (see raytrace.pro).
+
+void RayScene::draw(Canvas2D *canvas) {
+    canvas->resize(m_width, m_height);
+    render(canvas->data());
+    canvas->update();
+}
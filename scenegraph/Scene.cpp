@@ -107,25 +107,28 @@ void Scene::addPrimitive(const CS123ScenePrimitive &scenePrimitive, const glm::m
     prim.material.cSpecular *= m_global.ks;
     prim.material.cReflective *= m_global.ks;
     prim.material.cTransparent *= m_global.kt;
+    glm::vec3 minbound, maxbound;
+    primitiveBounds(matrix, minbound, maxbound);
+    object_node_t node = {prim, matrix, glm::inverse(matrix), minbound, maxbound};
+    m_nodes.push_back(node);
+}
+
+void Scene::primitiveBounds(const glm::mat4x4 &matrix, glm::vec3 &minbound, glm::vec3 &maxbound,
+                            glm::vec3 objMin, glm::vec3 objMax) {
     // to get aabb, take bounding box and transform(yes this is lazy)
     std::vector<double> xs, ys, zs;
     xs.reserve(8);
     ys.reserve(8);
     zs.reserve(8);
-    for(float x = -0.5; x < 1; x++) {
-        for(float y = -0.5; y < 1; y++) {
-            for(float z = -0.5; z < 1; z++) {
-                glm::vec4 tr = matrix * glm::vec4(x, y, z, 1);
-                xs.push_back(tr.x);
-                ys.push_back(tr.y);
-                zs.push_back(tr.z);
-            }
-        }
+    for(int corner = 0; corner < 8; corner++) {
+        glm::vec4 tr = matrix * glm::vec4(corner & 1 ? objMax.x : objMin.x, corner & 2 ? objMax.y : objMin.y,
+                                          corner & 4 ? objMax.z : objMin.z, 1);
+        xs.push_back(tr.x);
+        ys.push_back(tr.y);
+        zs.push_back(tr.z);
     }
-    glm::vec3 minbound = glm::vec3(*std::min_element(xs.begin(), xs.end()), *std::min_element(ys.begin(), ys.end()), *std::min_element(zs.begin(), zs.end()));
-    glm::vec3 maxbound = glm::vec3(*std::max_element(xs.begin(), xs.end()), *std::max_element(ys.begin(), ys.end()), *std::max_element(zs.begin(), zs.end()));
-    object_node_t node = {prim, matrix, glm::inverse(matrix), minbound, maxbound};
-    m_nodes.push_back(node);
+    minbound = glm::vec3(*std::min_element(xs.begin(), xs.end()), *std::min_element(ys.begin(), ys.end()), *std::min_element(zs.begin(), zs.end()));
+    maxbound = glm::vec3(*std::max_element(xs.begin(), xs.end()), *std::max_element(ys.begin(), ys.end()), *std::max_element(zs.begin(), zs.end()));
 }
 
 // we use copy constructors for the other 2
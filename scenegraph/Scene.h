@@ -17,14 +17,6 @@ class CS123ISceneParser;
  * common functionality to all your scenes.
  */
 
-typedef struct ObjectNode {
-    CS123ScenePrimitive primitive;
-    glm::mat4x4 trans;
-    glm::mat4x4 invtrans;
-    glm::vec3 minbound, maxbound;
-    bool disablePhysics = false;
-} object_node_t;
-
 class Scene {
 public:
     Scene();
@@ -46,6 +38,11 @@ public:
     // Sets the global data for the scene.
     virtual void setGlobal(const CS123SceneGlobalData &global);
 
+    // World-space bounding box of the object-space box objMin..objMax under matrix. The
+    // default box fits every unit primitive.
+    static void primitiveBounds(const glm::mat4x4 &matrix, glm::vec3 &minbound, glm::vec3 &maxbound,
+                                glm::vec3 objMin = glm::vec3(-0.5f), glm::vec3 objMax = glm::vec3(0.5f));
+
     std::vector<object_node_t> m_nodes;
     std::vector<CS123SceneLightData> m_lights;
     CS123SceneGlobalData m_global;
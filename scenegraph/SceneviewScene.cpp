@@ -14,6 +14,7 @@ using namespace CS123::GL;
 #include "shapes/tetmesh.h"
 #include "shapes/timing.h"
 #include <glm/gtx/transform.hpp>
+#include <algorithm>
 
 SceneviewScene::SceneviewScene()
 {
@@ -46,33 +47,10 @@ void SceneviewScene::parsingDone() {
     // Setup for after we finish parsing.
     printf("mnodes size is %lu\n\n\n\n", m_nodes.size());
     fflush(stdout);
-    for(unsigned long i = 0; i < m_nodes.size(); i++) {
-        CS123ScenePrimitive prim = m_nodes[i].primitive;
-        fflush(stdout);
-        if(prim.type == PrimitiveType::PRIMITIVE_MESH) {
-            printf("Mesh found: %s\n", prim.meshfile.c_str());
-            fflush(stdout);
-            m_meshes.push_back(std::make_unique<TetMesh>(m_nodes[i], m_meshTemplateCache));
-        }
-        else if(prim.type == PrimitiveType::PRIMITIVE_SPHERE) {
-            object_node_t node = m_nodes[i];
-            node.primitive.meshfile = "example-meshes/sphere.mesh";
-            m_meshes.push_back(std::make_unique<TetMesh>(node, m_meshTemplateCache));
-        }
-        else if(prim.type == PrimitiveType::PRIMITIVE_CUBE) {
-            object_node_t node = m_nodes[i];
-            // if it's a cube and is first element, turn off physics
-            if (i == 0) node.disablePhysics = true;
-            node.primitive.meshfile = "example-meshes/cube.mesh";
-            m_meshes.push_back(std::make_unique<TetMesh>(node, m_meshTemplateCache));
-        }
-        else if(prim.type == PrimitiveType::PRIMITIVE_CONE) {
-            object_node_t node = m_nodes[i];
-            node.primitive.meshfile = "example-meshes/cone.mesh";
-            m_meshes.push_back(std::make_unique<TetMesh>(node, m_meshTemplateCache));
-        }
-        //mesh.buildShape();
-        //m_mesh[prim.meshfile] = std::move(mesh.getOpenGLShape());
+    std::vector<object_node_t> meshNodes = tetMeshNodes(m_nodes);
+    loadTetMeshTemplates(meshNodes, m_meshTemplateCache);
+    for(const object_node_t& node : meshNodes) {
+        m_meshes.push_back(std::make_unique<TetMesh>(node, m_meshTemplateCache));
     }
     m_ready = 1;
 
@@ -264,89 +242,93 @@ void SceneviewScene::setLights()
     }
 }
 
-/*void SceneviewScene::renderGeometry() {
-    //while(!m_ready);
-    printf("mnodes size is %d\n\n\n\n", m_nodes.size());
-    fflush(stdout);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-#define SWMAP(type, inst) \
-    case PrimitiveType::PRIMITIVE_ ## type : \
-        inst->draw(); \
-        break;
-
-    for(int i = 0; i < m_nodes.size(); i++) {
-        CS123ScenePrimitive prim = m_nodes[i].primitive;
-        //printf("Drawing primitive of type %d\n", prim.type);
-        glm::mat4x4 trans = m_nodes[i].trans;
-        m_phongShader->setUniform("m", trans);
-        m_phongShader->applyMaterial(prim.material);
-
-
-        switch(prim.type) {
-            SWMAP(CUBE, m_cube)
-            SWMAP(SPHERE, m_sphere)
-            SWMAP(CYLINDER, m_cylinder)
-            SWMAP(CONE, m_cone)
-            case PrimitiveType::PRIMITIVE_MESH:
-                //assert(m_meshes.count(prim.meshfile) != 0);
-                //m_meshes[prim.meshfile]->update(1);
-                //m_meshes[prim.meshfile]->draw();
-                break;
-            default:
-                break;
-        }
-    }
-
-#undef SWMAP
-
-    // TODO: [SCENEVIEW] Fill this in...
-    // You shouldn't need to write *any* OpenGL in this class!
-    //
-    //
-    // This is where you should render the geometry of the scene. Use what you
-    // know about OpenGL and leverage your Shapes classes to get the job done.
-
-}*/
-
 void SceneviewScene::renderGeometry(CS123::GL::Shader* shader) {
-    //while(!m_ready);
-
+    // for the shadow passes, which run before renderGeometry() steps the meshes
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     for(auto&& tetmesh : m_meshes) {
-        auto onode = tetmesh->getONode();
         shader->setUniform("m", glm::mat4(1.0f));
-        //shader->applyMaterial(onode.primitive.material);
         tetmesh->draw();
     }
 }
 
 void SceneviewScene::renderGeometry() {
     //while(!m_ready);
+    if(m_running) {
+        stepMeshes();
+    }
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    for(auto&& tetmesh = m_meshes.begin(); tetmesh != m_meshes.end();) {
-        bool dead = false;
-        auto onode = (*tetmesh)->getONode();
+    for(auto&& tetmesh : m_meshes) {
+        auto onode = tetmesh->getONode();
         m_phongShader->setUniform("doEnvMap", !onode.disablePhysics && settings.metalBalls);
         m_phongShader->setUniform("m", glm::mat4(1.0f));
         m_phongShader->applyMaterial(onode.primitive.material);
-        if(m_running) {
-            float timePerStep = settings.femTimeStep / settings.femStepsPerFrame;
-            for(int j = 0; j < settings.femStepsPerFrame; j++) {
-                if((*tetmesh)->update(timePerStep)) {
-                    // mesh has to die
-                    tetmesh = m_meshes.erase(tetmesh);
-                    //toDie.push_back(i);
-                    dead = true;
+        tetmesh->draw();
+    }
+}
+
+void SceneviewScene::stepMeshes() {
+    if(m_meshes.empty())
+        return;
+    int steps = settings.femIntegrator == FEM_INTEGRATOR_BACKWARD_EULER
+            ? settings.femImplicitStepsPerFrame : settings.femStepsPerFrame;
+    float timePerStep = settings.femTimeStep / steps;
+
+    // Bodies only touch the floor, never each other, so each one steps independently. Split
+    // them into one bin per worker by tet count, biggest body first into the lightest bin.
+    int nbins = settings.femMultiThreading ? std::min(m_simPool.size(), m_meshes.size()) : 1;
+    std::vector<int> order(m_meshes.size());
+    for(unsigned long i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+        return m_meshes[a]->numTets() > m_meshes[b]->numTets();
+    });
+    std::vector<std::vector<int>> bins(nbins);
+    std::vector<size_t> load(nbins, 0);
+    for(int i : order) {
+        int b = std::min_element(load.begin(), load.end()) - load.begin();
+        bins[b].push_back(i);
+        load[b] += m_meshes[i]->numTets() + 1;
+    }
+
+    std::vector<char> dead(m_meshes.size(), false); // not vector<bool>, bins write it concurrently
+    auto stepBin = [this, &dead, steps, timePerStep](const std::vector<int>& bin) {
+        for(int i : bin) {
+            for(int j = 0; j < steps; j++) {
+                if(m_meshes[i]->update(timePerStep)) {
+                    dead[i] = true;
                     break;
                 }
             }
         }
-        if(!dead) {
-            (*tetmesh)->draw();
-            tetmesh++;
+    };
+    if(nbins == 1) {
+        stepBin(bins[0]);
+    }
+    else {
+        for(auto&& bin : bins) {
+            m_simPool.addJob([&stepBin, &bin]() {
+                stepBin(bin);
+            });
+        }
+        m_simPool.wait();
+    }
+
+    // drop dead meshes and add any pieces that broke off, keeping the order of the rest
+    std::vector<std::unique_ptr<TetMesh>> alive;
+    alive.reserve(m_meshes.size());
+    for(unsigned long i = 0; i < m_meshes.size(); i++) {
+        if(dead[i])
+            continue;
+        auto pieces = m_meshes[i]->splitComponents();
+        alive.push_back(std::move(m_meshes[i]));
+        for(auto&& piece : pieces) {
+            alive.push_back(std::move(piece));
         }
     }
+    m_meshes.swap(alive);
 }
+
 void SceneviewScene::settingsChanged() {
     // TODO: [SCENEVIEW] Fill this in if applicable.
 }
@@ -11,6 +11,7 @@
 #include "CubeMap.h"
 #include "ShadowMap.h"
 #include "shapes/tetmesh.h"
+#include "ThreadPool.h"
 #include "gl/util/FullScreenQuad.h"
 #include "gl/datatype/FBO.h"
 
@@ -92,6 +93,7 @@ private:
     void setMatrixUniforms(CS123::GL::Shader *shader, SupportCanvas3D *context);
     void setLights();
     void renderGeometry();
+    void stepMeshes();
 
     std::unique_ptr<CS123::GL::CS123Shader> m_phongShader;
     std::unique_ptr<CS123::GL::Shader> m_wireframeShader;
@@ -112,6 +114,8 @@ private:
 
     std::unordered_map<std::string, std::unique_ptr<TetMesh>> m_meshTemplateCache;
     std::vector<std::unique_ptr<TetMesh>> m_meshes;
+    // steps meshes in parallel, one bin of bodies per job (see stepMeshes)
+    ThreadPool m_simPool;
     bool m_running;
     bool m_ready;
     std::mutex initializationMutex;
@@ -8,7 +8,8 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
-#include <thread>
+#include <algorithm>
+#include <memory>
 
 typedef std::function<void()> Job;
 
@@ -28,6 +29,7 @@ public:
         }
 
         m_runningJobs = 0;
+        m_stopped = false;
 
         for(size_t i = 0; i < threads; i++)
         {
@@ -35,13 +37,14 @@ public:
                 this->jobHandler();
             }));
         }
-
-        m_stopped = false;
     }
 
     ~ThreadPool()
     {
-        m_stopped = true;
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_stopped = true;
+        }
         m_cond.notify_all();
 
         for(size_t i = 0; i < m_threads.size(); i++)
@@ -60,11 +63,91 @@ public:
         m_cond.notify_one();
     }
 
+    // Blocks until the queue is empty and no job is running. Checked under the lock
+    // so a wait() that starts after the last job finished returns immediately.
     void wait()
     {
         std::unique_lock<std::mutex> lock(m_mtx);
 
-        m_done.wait(lock);
+        m_done.wait(lock, [this]() {
+            return m_jobs.empty() && m_runningJobs == 0;
+        });
+    }
+
+    // Splits [begin, end) into one contiguous range per worker and blocks until all
+    // of them are done. Each call waits only on its own ranges, not on the whole pool, and
+    // the calling thread works through them too, so concurrent calls don't hold each other
+    // up and a call from inside one of this pool's jobs can't deadlock: if every worker is
+    // busy the caller just runs all the ranges itself.
+    void parallelFor(int begin, int end, std::function<void(int, int)> fn)
+    {
+        int n = end - begin;
+        if (n <= 0)
+        {
+            return;
+        }
+        int nchunks = std::min<int>(m_threads.size(), n);
+        if (nchunks == 1)
+        {
+            fn(begin, end);
+            return;
+        }
+
+        // shared with the helper jobs, which can outlive this call if they start after
+        // the caller and the other helpers have claimed every range
+        struct ForState {
+            std::function<void(int, int)> fn;
+            int begin, n, nchunks;
+            std::atomic<int> next;
+            int finished;
+            std::mutex mtx;
+            std::condition_variable done;
+
+            // claims and runs ranges until none are left
+            void work()
+            {
+                int ran = 0;
+                for(int i = next++; i < nchunks; i = next++)
+                {
+                    fn(begin + (long) n * i / nchunks, begin + (long) n * (i + 1) / nchunks);
+                    ran++;
+                }
+                if (ran > 0)
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    finished += ran;
+                    if (finished == nchunks)
+                    {
+                        done.notify_all();
+                    }
+                }
+            }
+        };
+        auto state = std::make_shared<ForState>();
+        state->fn = std::move(fn);
+        state->begin = begin;
+        state->n = n;
+        state->nchunks = nchunks;
+        state->next = 0;
+        state->finished = 0;
+
+        for(int i = 1; i < nchunks; i++)
+        {
+            addJob([state]() {
+                state->work();
+            });
+        }
+        state->work();
+
+        std::unique_lock<std::mutex> lock(state->mtx);
+        state->done.wait(lock, [&state]() {
+            return state->finished == state->nchunks;
+        });
+    }
+
+    size_t size() const
+    {
+        return m_threads.size();
     }
 
 private:
@@ -98,7 +181,13 @@ private:
             lock.unlock();
 
             j();
+
+            lock.lock();
             m_runningJobs--;
+            if (m_jobs.size() == 0 && m_runningJobs == 0)
+            {
+                m_done.notify_all();
+            }
         }
     }
 
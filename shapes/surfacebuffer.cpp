@@ -0,0 +1,36 @@
+#include "surfacebuffer.h"
+
+void SurfaceBuffer::setFaces(const std::vector<glm::ivec3>& faces, int numPoints) {
+    // number the surface nodes in order of first use, so interior nodes are never uploaded
+    std::vector<int> vertexOf(numPoints, -1);
+    m_vertexNodes.clear();
+    m_indices.clear();
+    m_indices.reserve(faces.size() * 3);
+    for(const glm::ivec3& f : faces) {
+        for(int k = 0; k < 3; k++) {
+            int node = f[k];
+            if(vertexOf[node] < 0) {
+                vertexOf[node] = m_vertexNodes.size();
+                m_vertexNodes.push_back(node);
+            }
+            m_indices.push_back(vertexOf[node]);
+        }
+    }
+    m_vertexData.resize(m_vertexNodes.size() * FLOATS_PER_VERTEX);
+}
+
+size_t SurfaceBuffer::pack(const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& norms) {
+    float *out = m_vertexData.data();
+    for(int node : m_vertexNodes) {
+        const glm::vec3& p = points[node];
+        const glm::vec3& n = norms[node];
+        out[0] = p.x;
+        out[1] = p.y;
+        out[2] = p.z;
+        out[3] = n.x;
+        out[4] = n.y;
+        out[5] = n.z;
+        out += FLOATS_PER_VERTEX;
+    }
+    return m_vertexData.size() * sizeof(float);
+}
@@ -0,0 +1,31 @@
+#ifndef SURFACEBUFFER_H
+#define SURFACEBUFFER_H
+#include <vector>
+#include "glm/glm.hpp"
+
+// CPU side of a TetMesh's surface geometry. setFaces builds an indexed triangle list over just
+// the nodes that are on the surface (only needed when the surface changes, i.e. on fracture);
+// pack then rewrites interleaved position/normal data for those nodes in place every frame.
+// No GL in here so it can be exercised without a context.
+class SurfaceBuffer
+{
+public:
+    // floats per vertex: position xyz, normal xyz
+    static const int FLOATS_PER_VERTEX = 6;
+
+    void setFaces(const std::vector<glm::ivec3>& faces, int numPoints);
+    // Refreshes vertexData() from the nodes' current positions/normals. Returns the number of
+    // bytes that need uploading this frame.
+    size_t pack(const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& norms);
+
+    const std::vector<int>& indices() const { return m_indices; }
+    const std::vector<float>& vertexData() const { return m_vertexData; }
+    int numVertices() const { return m_vertexNodes.size(); }
+
+private:
+    std::vector<int> m_vertexNodes;     // mesh node behind each vertex
+    std::vector<int> m_indices;         // 3 per surface triangle, into m_vertexNodes
+    std::vector<float> m_vertexData;
+};
+
+#endif // SURFACEBUFFER_H
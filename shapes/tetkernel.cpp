@@ -0,0 +1,406 @@
+#include "tetkernel.h"
+#include <algorithm>
+#include <cmath>
+
+// The per-tet math is written once, templated on the number type. The Jacobian runs it in
+// double and computeTetStress in float. computeStressBatch runs it on Lanes, which holds one
+// value for each of SIMD_WIDTH tets; every Lanes operator is one fixed-length loop that the
+// compiler turns into a single SSE instruction, so each step of the math covers a group of
+// tets at once. A batch is gathered in full, run one group at a time (skipping groups past
+// its last tet), then scattered; only the gather and scatter touch the node arrays.
+//
+// Math is the same as the old per-tet path in TetMesh::computeStressForces:
+// F = P * bary, G = V * bary (P, V are node 1..3 minus node 4, as columns)
+// strain = F F^T - I, strain rate = F G^T + G F^T
+// stress = 2 rigidity (strain - tr/3 I) + incompressibility tr I
+//        + 2 viscosity (rate - tr/3 I) + incompressibility tr(rate) I
+// force on node k = F^T * stress * (area-weighted normal of the face opposite k)
+
+namespace {
+// floats per SSE register
+const int SIMD_WIDTH = 4;
+static_assert(TET_BATCH % SIMD_WIDTH == 0, "a batch should split into whole SIMD groups");
+
+// One float per tet of a group, with elementwise arithmetic. Scalars mix in as if broadcast
+// to every lane.
+struct Lanes {
+    alignas(16) float v[SIMD_WIDTH];
+};
+
+inline Lanes operator+(const Lanes& a, const Lanes& b) {
+    Lanes out;
+    for(int l = 0; l < SIMD_WIDTH; l++) out.v[l] = a.v[l] + b.v[l];
+    return out;
+}
+
+inline Lanes operator-(const Lanes& a, const Lanes& b) {
+    Lanes out;
+    for(int l = 0; l < SIMD_WIDTH; l++) out.v[l] = a.v[l] - b.v[l];
+    return out;
+}
+
+inline Lanes operator*(const Lanes& a, const Lanes& b) {
+    Lanes out;
+    for(int l = 0; l < SIMD_WIDTH; l++) out.v[l] = a.v[l] * b.v[l];
+    return out;
+}
+
+inline Lanes operator*(const Lanes& a, float s) {
+    Lanes out;
+    for(int l = 0; l < SIMD_WIDTH; l++) out.v[l] = a.v[l] * s;
+    return out;
+}
+
+inline Lanes operator*(float s, const Lanes& a) {
+    return a * s;
+}
+
+inline Lanes operator-(const Lanes& a, float s) {
+    Lanes out;
+    for(int l = 0; l < SIMD_WIDTH; l++) out.v[l] = a.v[l] - s;
+    return out;
+}
+
+inline Lanes operator-(const Lanes& a) {
+    Lanes out;
+    for(int l = 0; l < SIMD_WIDTH; l++) out.v[l] = -a.v[l];
+    return out;
+}
+
+template <typename T>
+inline void cross3(const T a[3], const T b[3], T out[3]) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+inline bool isIdentity(const float m[9]) {
+    for(int i = 0; i < 9; i++) {
+        if(m[i] != (i % 4 == 0 ? 1.f : 0.f))
+            return false;
+    }
+    return true;
+}
+
+// bary * frame for column-major 3x3s; moves a shared rest-state bary transform into the
+// instance's own rest frame (see StressParams::restFrameInv)
+template <typename B>
+inline void applyRestFrame(const B bary[9], const float frame[9], B out[9]) {
+    for(int c = 0; c < 3; c++) {
+        for(int r = 0; r < 3; r++) {
+            out[c * 3 + r] = bary[r] * frame[c * 3] + bary[3 + r] * frame[c * 3 + 1] + bary[6 + r] * frame[c * 3 + 2];
+        }
+    }
+}
+
+// blk's bary transform in the instance's rest frame: blk.bary itself when the frame is the
+// identity, otherwise the product, written to scratch
+inline const float *framedBary(const TetBlock& blk, const StressParams& params, float scratch[9]) {
+    if(isIdentity(params.restFrameInv))
+        return blk.bary;
+    applyRestFrame(blk.bary, params.restFrameInv, scratch);
+    return scratch;
+}
+
+// Deformation gradient F (F[c][r] is column c, row r, same as glm) and total stress S of one
+// tet given node positions p and velocities v. B is float, or Lanes for a batch; C is the
+// scalar type of the material constants.
+template <typename T, typename B, typename C>
+inline void tetStress(const T p[4][3], const T v[4][3], const B bary[9],
+                      C mu2, C nu2, C lambda, T F[3][3], T S[3][3]) {
+    T e[3][3], ev[3][3];
+    for(int k = 0; k < 3; k++) {
+        for(int r = 0; r < 3; r++) {
+            e[k][r] = p[k][r] - p[3][r];
+            ev[k][r] = v[k][r] - v[3][r];
+        }
+    }
+    T G[3][3];
+    for(int c = 0; c < 3; c++) {
+        for(int r = 0; r < 3; r++) {
+            F[c][r] = e[0][r] * bary[c * 3] + e[1][r] * bary[c * 3 + 1] + e[2][r] * bary[c * 3 + 2];
+            G[c][r] = ev[0][r] * bary[c * 3] + ev[1][r] * bary[c * 3 + 1] + ev[2][r] * bary[c * 3 + 2];
+        }
+    }
+    // strain, rate and so S are symmetric; only the upper triangle is computed
+    T strain[3][3], rate[3][3];
+    for(int r = 0; r < 3; r++) {
+        for(int c = r; c < 3; c++) {
+            strain[r][c] = F[0][r] * F[0][c] + F[1][r] * F[1][c] + F[2][r] * F[2][c];
+            rate[r][c] = F[0][r] * G[0][c] + F[1][r] * G[1][c] + F[2][r] * G[2][c]
+                    + G[0][r] * F[0][c] + G[1][r] * F[1][c] + G[2][r] * F[2][c];
+        }
+        strain[r][r] = strain[r][r] - C(1);
+    }
+    T trS = strain[0][0] + strain[1][1] + strain[2][2];
+    T trR = rate[0][0] + rate[1][1] + rate[2][2];
+    T diag = (lambda - mu2 / 3) * trS + (lambda - nu2 / 3) * trR;
+    for(int r = 0; r < 3; r++) {
+        for(int c = r; c < 3; c++) {
+            S[r][c] = mu2 * strain[r][c] + nu2 * rate[r][c];
+            S[c][r] = S[r][c];
+        }
+        S[r][r] = S[r][r] + diag;
+    }
+}
+
+// Area-weighted normals of the face opposite each node, same windings as before. Normal k is
+// cross(p[a] - p[c], p[b] - p[c]) for {a, b, c} = FACE_NODES[k]. Returns the orientation
+// determinant; the tet is inverted if it's < 0.
+const int FACE_NODES[4][3] = {{3, 2, 1}, {3, 0, 2}, {3, 1, 0}, {1, 2, 0}};
+
+template <typename T>
+inline T faceNormals(const T p[4][3], T nrm[4][3]) {
+    T d42[3], d32[3], d43[3], d13[3], d41[3], d21[3], d31[3];
+    for(int r = 0; r < 3; r++) {
+        d42[r] = p[3][r] - p[1][r];
+        d32[r] = p[2][r] - p[1][r];
+        d43[r] = p[3][r] - p[2][r];
+        d13[r] = p[0][r] - p[2][r];
+        d41[r] = p[3][r] - p[0][r];
+        d21[r] = p[1][r] - p[0][r];
+        d31[r] = p[2][r] - p[0][r];
+    }
+    cross3(d42, d32, nrm[0]);
+    cross3(d43, d13, nrm[1]);
+    cross3(d41, d21, nrm[2]);
+    cross3(d21, d31, nrm[3]);
+    return nrm[3][0] * d41[0] + nrm[3][1] * d41[1] + nrm[3][2] * d41[2];
+}
+
+// Forces on the 4 nodes of one tet given node positions p and velocities v, and its total
+// stress S. Returns the orientation determinant; the tet is inverted (and its forces
+// meaningless) if it's < 0.
+template <typename T, typename B, typename C>
+inline T tetForces(const T p[4][3], const T v[4][3], const B bary[9],
+                   C mu2, C nu2, C lambda, T S[3][3], T out[4][3]) {
+    T F[3][3];
+    tetStress(p, v, bary, mu2, nu2, lambda, F, S);
+
+    T nrm[4][3];
+    T det = faceNormals(p, nrm);
+
+    // force on node k is -F^T S nrm[k]; F^T S is shared by all four
+    T FS[3][3];
+    for(int r = 0; r < 3; r++) {
+        for(int c = 0; c < 3; c++) {
+            FS[r][c] = F[r][0] * S[0][c] + F[r][1] * S[1][c] + F[r][2] * S[2][c];
+        }
+    }
+    for(int k = 0; k < 3; k++) {
+        for(int r = 0; r < 3; r++) {
+            out[k][r] = -(FS[r][0] * nrm[k][0] + FS[r][1] * nrm[k][1] + FS[r][2] * nrm[k][2]);
+        }
+    }
+    // a closed surface's area-weighted normals sum to zero, and so do the forces
+    for(int r = 0; r < 3; r++) {
+        out[3][r] = -(out[0][r] + out[1][r] + out[2][r]);
+    }
+    return det;
+}
+
+// Adds the derivative of a symmetric stress term, coef * (X + X^T) for X = e_s u^T (the outer
+// product of the s'th unit vector and u), plus its trace times tr * I, into dS.
+inline void addStressDerivative(double dS[3][3], int s, const double u[3], double coef, double tr) {
+    for(int r = 0; r < 3; r++) {
+        dS[s][r] += coef * u[r];
+        dS[r][s] += coef * u[r];
+        dS[r][r] += 2 * tr * u[s];
+    }
+}
+
+// Exact Jacobians of tetForces with respect to p and v: dfdx[i][j] is the derivative of
+// out[i / 3][i % 3] with respect to p[j / 3][j % 3], and dfdv likewise for v.
+//
+// Moving coordinate s of node a changes the edge matrix P (or V) by e_s in column a, or by
+// -e_s in every column for node 4, so dF = e_s w^T with w = bary^T of that column (or minus
+// the sum of all three). Then
+//     d strain = e_s (F w)^T + (F w) e_s^T      d rate = e_s (G w)^T + (G w) e_s^T
+// for a position (a velocity only moves G, giving d rate = e_s (F w)^T + (F w) e_s^T), dS
+// follows linearly from those, and the force on node k, -F^T S n_k, picks up
+//     -(d(F^T S) n_k + F^T S d n_k),   d(F^T S) = w (S e_s)^T + F^T dS
+// where d n_k = e_s x (the other two corners' difference) if node a is a corner of face k.
+void tetForceJacobians(const double p[4][3], const double v[4][3], const float bary[9],
+                       double mu2, double nu2, double lambda, double dfdx[12][12], double dfdv[12][12]) {
+    double F[3][3], S[3][3], G[3][3], nrm[4][3], FS[3][3];
+    tetStress(p, v, bary, mu2, nu2, lambda, F, S);
+    for(int c = 0; c < 3; c++) {
+        for(int r = 0; r < 3; r++) {
+            G[c][r] = 0;
+            for(int k = 0; k < 3; k++) {
+                G[c][r] += (v[k][r] - v[3][r]) * bary[c * 3 + k];
+            }
+        }
+    }
+    faceNormals(p, nrm);
+    for(int r = 0; r < 3; r++) {
+        for(int c = 0; c < 3; c++) {
+            FS[r][c] = F[r][0] * S[0][c] + F[r][1] * S[1][c] + F[r][2] * S[2][c];
+        }
+    }
+
+    for(int a = 0; a < 4; a++) {
+        double w[3], Fw[3], Gw[3];
+        for(int c = 0; c < 3; c++) {
+            w[c] = a < 3 ? bary[c * 3 + a] : -((double)bary[c * 3] + bary[c * 3 + 1] + bary[c * 3 + 2]);
+        }
+        for(int r = 0; r < 3; r++) {
+            Fw[r] = F[0][r] * w[0] + F[1][r] * w[1] + F[2][r] * w[2];
+            Gw[r] = G[0][r] * w[0] + G[1][r] * w[1] + G[2][r] * w[2];
+        }
+        for(int s = 0; s < 3; s++) {
+            int j = a * 3 + s;
+            double unit[3] = {0, 0, 0};
+            unit[s] = 1;
+
+            // position: F, G's partner in the rate, and the face normals all move
+            double dS[3][3] = {}, dFS[3][3];
+            addStressDerivative(dS, s, Fw, mu2, lambda - mu2 / 3);
+            addStressDerivative(dS, s, Gw, nu2, lambda - nu2 / 3);
+            for(int r = 0; r < 3; r++) {
+                for(int c = 0; c < 3; c++) {
+                    dFS[r][c] = w[r] * S[s][c] + F[r][0] * dS[0][c] + F[r][1] * dS[1][c] + F[r][2] * dS[2][c];
+                }
+            }
+            for(int k = 0; k < 3; k++) {
+                double dn[3] = {0, 0, 0};
+                const int *face = FACE_NODES[k];
+                for(int corner = 0; corner < 3; corner++) {
+                    if(face[corner] != a)
+                        continue;
+                    // d/dp_a of p_a x p_b + p_b x p_c + p_c x p_a, with (a, b, c) rotated
+                    // so node a comes first
+                    double diff[3];
+                    for(int r = 0; r < 3; r++) {
+                        diff[r] = p[face[(corner + 1) % 3]][r] - p[face[(corner + 2) % 3]][r];
+                    }
+                    cross3(unit, diff, dn);
+                }
+                for(int r = 0; r < 3; r++) {
+                    dfdx[k * 3 + r][j] = -(dFS[r][0] * nrm[k][0] + dFS[r][1] * nrm[k][1] + dFS[r][2] * nrm[k][2]
+                                         + FS[r][0] * dn[0] + FS[r][1] * dn[1] + FS[r][2] * dn[2]);
+                }
+            }
+
+            // velocity: only G moves
+            double dSv[3][3] = {};
+            addStressDerivative(dSv, s, Fw, nu2, lambda - nu2 / 3);
+            for(int r = 0; r < 3; r++) {
+                for(int c = 0; c < 3; c++) {
+                    dFS[r][c] = F[r][0] * dSv[0][c] + F[r][1] * dSv[1][c] + F[r][2] * dSv[2][c];
+                }
+            }
+            for(int k = 0; k < 3; k++) {
+                for(int r = 0; r < 3; r++) {
+                    dfdv[k * 3 + r][j] = -(dFS[r][0] * nrm[k][0] + dFS[r][1] * nrm[k][1] + dFS[r][2] * nrm[k][2]);
+                }
+            }
+            // node 4's force is minus the sum of the others'
+            for(int r = 0; r < 3; r++) {
+                dfdx[9 + r][j] = -(dfdx[r][j] + dfdx[3 + r][j] + dfdx[6 + r][j]);
+                dfdv[9 + r][j] = -(dfdv[r][j] + dfdv[3 + r][j] + dfdv[6 + r][j]);
+            }
+        }
+    }
+}
+}
+
+void computeStressBatch(const TetBlock *blocks, const int *ids, int n,
+                        const glm::vec3 *points, const glm::vec3 *vels,
+                        const StressParams& params, glm::vec3 *forces, float *stressBound) {
+    const int GROUPS = TET_BATCH / SIMD_WIDTH;
+    int groups = (n + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    Lanes p[GROUPS][4][3], v[GROUPS][4][3], bary[GROUPS][9];
+
+    // gather. Lanes past n repeat the first tet so the last group runs full width.
+    for(int l = 0; l < groups * SIMD_WIDTH; l++) {
+        const TetBlock& blk = blocks[ids[l < n ? l : 0]];
+        int g = l / SIMD_WIDTH, gl = l % SIMD_WIDTH;
+        for(int k = 0; k < 4; k++) {
+            const glm::vec3& pk = points[blk.node[k]];
+            const glm::vec3& vk = vels[blk.node[k]];
+            for(int r = 0; r < 3; r++) {
+                p[g][k][r].v[gl] = pk[r];
+                v[g][k][r].v[gl] = vk[r];
+            }
+        }
+        for(int j = 0; j < 9; j++) {
+            bary[g][j].v[gl] = blk.bary[j];
+        }
+    }
+
+    bool framed = !isIdentity(params.restFrameInv);
+    Lanes S[GROUPS][3][3], out[GROUPS][4][3], det[GROUPS];
+    for(int g = 0; g < groups; g++) {
+        if(framed) {
+            Lanes shared[9];
+            std::copy(bary[g], bary[g] + 9, shared);
+            applyRestFrame(shared, params.restFrameInv, bary[g]);
+        }
+        det[g] = tetForces(p[g], v[g], bary[g], 2 * params.rigidity, 2 * params.shearViscosity,
+                           params.incompressibility, S[g], out[g]);
+    }
+
+    // scatter
+    for(int l = 0; l < n; l++) {
+        int g = l / SIMD_WIDTH, gl = l % SIMD_WIDTH;
+        if(stressBound) {
+            // Gershgorin bound on the largest eigenvalue of S
+            float bound = -INFINITY;
+            for(int r = 0; r < 3 && det[g].v[gl] >= 0; r++) {
+                bound = std::max(bound, S[g][r][r].v[gl] + std::abs(S[g][r][(r + 1) % 3].v[gl])
+                                 + std::abs(S[g][r][(r + 2) % 3].v[gl]));
+            }
+            stressBound[ids[l]] = bound;
+        }
+        if(det[g].v[gl] < 0)
+            continue; // inverted
+        const TetBlock& blk = blocks[ids[l]];
+        for(int k = 0; k < 4; k++) {
+            forces[blk.node[k]] += glm::vec3(out[g][k][0].v[gl], out[g][k][1].v[gl], out[g][k][2].v[gl]);
+        }
+    }
+}
+
+bool computeTetJacobians(const TetBlock& blk, const glm::vec3 *points, const glm::vec3 *vels,
+                         const StressParams& params, double dfdx[12][12], double dfdv[12][12]) {
+    double p[4][3], v[4][3];
+    for(int k = 0; k < 4; k++) {
+        for(int r = 0; r < 3; r++) {
+            p[k][r] = points[blk.node[k]][r];
+            v[k][r] = vels[blk.node[k]][r];
+        }
+    }
+    float scratch[9];
+    const float *bary = framedBary(blk, params, scratch);
+    double nrm[4][3];
+    if(faceNormals(p, nrm) < 0)
+        return false;
+    tetForceJacobians(p, v, bary, 2.0 * params.rigidity, 2.0 * params.shearViscosity, params.incompressibility,
+                      dfdx, dfdv);
+    return true;
+}
+
+bool computeTetStress(const TetBlock& blk, const glm::vec3 *points, const glm::vec3 *vels,
+                      const StressParams& params, glm::mat3x3& stress) {
+    float p[4][3], v[4][3], F[3][3], S[3][3];
+    for(int k = 0; k < 4; k++) {
+        for(int r = 0; r < 3; r++) {
+            p[k][r] = points[blk.node[k]][r];
+            v[k][r] = vels[blk.node[k]][r];
+        }
+    }
+    glm::vec3 p1 = points[blk.node[0]];
+    float det = glm::dot(glm::cross(points[blk.node[1]] - p1, points[blk.node[2]] - p1), points[blk.node[3]] - p1);
+    if(det < 0)
+        return false;
+    float scratch[9];
+    const float *bary = framedBary(blk, params, scratch);
+    tetStress(p, v, bary, 2 * params.rigidity, 2 * params.shearViscosity, params.incompressibility, F, S);
+    for(int r = 0; r < 3; r++) {
+        for(int c = 0; c < 3; c++) {
+            stress[c][r] = S[r][c];
+        }
+    }
+    return true;
+}
@@ -0,0 +1,84 @@
+#ifndef TETKERNEL_H
+#define TETKERNEL_H
+#include <cstdlib>
+#include <new>
+#include "glm/glm.hpp"
+
+// number of tets computeStressBatch evaluates together, one per lane
+const int TET_BATCH = 8;
+
+// Everything the stress kernel needs to know about a tet that stays fixed while simulating,
+// packed into one cache line so a tet costs one line fetch plus its node gathers.
+struct alignas(64) TetBlock {
+    float bary[9];      // rest-state barycentric transform, column-major like glm::mat3x3
+    int node[4];
+    float restVolume;
+};
+
+static_assert(sizeof(TetBlock) == 64, "TetBlock should fill exactly one cache line");
+
+// std::allocator only guarantees alignof(max_align_t) before C++17, which isn't enough
+// for a vector of cache-line aligned records.
+template <typename T, std::size_t Align = alignof(T)>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    template <typename U>
+    struct rebind {
+        typedef AlignedAllocator<U, Align> other;
+    };
+
+    T *allocate(std::size_t n) {
+        void *p = nullptr;
+        if(posix_memalign(&p, Align, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t) {
+        free(p);
+    }
+};
+
+template <typename T, typename U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return true; }
+template <typename T, typename U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return false; }
+
+struct StressParams {
+    float rigidity;
+    float incompressibility;
+    float shearViscosity;
+    // Column-major matrix every tet's bary transform is multiplied by (bary * restFrameInv)
+    // before use. Lets instances with differently scaled/rotated rest shapes share one set of
+    // TetBlocks; identity when the blocks are already in the mesh's own rest frame.
+    float restFrameInv[9];
+};
+
+// Evaluates elastic + viscous stress for the n <= TET_BATCH tets blocks[ids[0]] ..
+// blocks[ids[n - 1]] and adds the resulting node forces into forces. Inverted tets add
+// nothing. Forces are added one tet after another, so batches running concurrently
+// must not share nodes (callers pass tets of one color). If stressBound isn't null,
+// stressBound[ids[i]] is set to an upper bound on tet ids[i]'s largest principal stress
+// (-INFINITY if it's inverted), which fracture checks use to skip tets far from failing.
+void computeStressBatch(const TetBlock *blocks, const int *ids, int n,
+                        const glm::vec3 *points, const glm::vec3 *vels,
+                        const StressParams& params, glm::vec3 *forces, float *stressBound = nullptr);
+
+// Jacobians of one tet's node forces with respect to its node positions and velocities,
+// dfdx[i][j] = d force_i / d x_j over the 12 coordinates (node-major). Computed exactly, in
+// double precision, by differentiating the stress and force formulas. Returns false if the
+// tet is inverted, in which case it contributes no force and the matrices are left untouched.
+bool computeTetJacobians(const TetBlock& blk, const glm::vec3 *points, const glm::vec3 *vels,
+                         const StressParams& params, double dfdx[12][12], double dfdv[12][12]);
+
+// Total (elastic + viscous) stress of one tet in world space. Returns false if the tet is
+// inverted, in which case stress is left untouched.
+bool computeTetStress(const TetBlock& blk, const glm::vec3 *points, const glm::vec3 *vels,
+                      const StressParams& params, glm::mat3x3& stress);
+
+#endif // TETKERNEL_H
@@ -7,14 +7,19 @@
 #include <sstream>
 #include <sys/time.h>
 #include <functional>
+#include <algorithm>
+#include <cstring>
 #include <glm/gtx/random.hpp>
 #include <unordered_set>
 #include "Settings.h"
 #include <Eigen/Dense>
 #include <mutex>
 #include <Eigen/Eigenvalues>
+#include <Eigen/Sparse>
+#include <Eigen/IterativeLinearSolvers>
 #include "timing.h"
 #include "tetmeshparser.h"
+#include "tetmeshbinary.h"
 #include "ThreadPool.h"
 
 //const int FLOOR_Y = -8;
@@ -61,14 +66,26 @@ std::vector<glm::vec3> getPoints(const tetgenio& t) {
     return ret;
 }
 
-std::vector<std::vector<int>> tetsTouchingPoint(const std::vector<tet_t>& tets, int psize) {
-    std::vector<std::vector<int>> pToTMap;
-    pToTMap.resize(psize);
+std::shared_ptr<const NodeTetAdjacency> tetsTouchingPoint(const std::vector<tet_t>& tets, int psize) {
+    // two passes: count tets per node, then prefix-sum the counts into offsets and fill
+    auto pToTMap = std::make_shared<NodeTetAdjacency>();
+    std::vector<int>& offsets = pToTMap->offsets;
+    offsets.assign(psize + 1, 0);
     for(long unsigned int i = 0;i < tets.size(); i++) {
         tet_t tet = tets[i];
         for(int j = 0; j < 4; j++) {
-            int pidx = tet[j];
-            pToTMap[pidx].push_back(i);
+            offsets[tet[j] + 1]++;
+        }
+    }
+    for(int p = 0; p < psize; p++) {
+        offsets[p + 1] += offsets[p];
+    }
+    pToTMap->tets.resize(offsets[psize]);
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for(long unsigned int i = 0;i < tets.size(); i++) {
+        tet_t tet = tets[i];
+        for(int j = 0; j < 4; j++) {
+            pToTMap->tets[fill[tet[j]]++] = i;
         }
     }
     return pToTMap;
@@ -79,25 +96,42 @@ std::vector<std::vector<int>> tetsTouchingPoint(const std::vector<tet_t>& tets,
 TetMesh::TetMesh(std::string filename, glm::mat4x4 trans, std::string nodefile) {
     // material unused for now
     // m_material = {0.16, 0.003, 0.16, 0.003};
-    tetgenio out;
-    TetmeshParser::parse(filename, &out);
-    m_tets = getTets(out);
-    m_baryTransforms.resize(m_tets.size());
-    m_points = getPoints(out);
+    TetRestState& rest = mutableRest();
+    // a .tmb can carry its faces, bary transforms and masses precomputed, but only in file
+    // space, so anything moved by trans recomputes them
+    uint32_t precomputed = 0;
+    if(TetmeshBinary::isBinaryFile(filename)) {
+        precomputed = loadBinary(filename);
+        if(trans != glm::mat4x4())
+            precomputed = 0;
+    } else {
+        tetgenio out;
+        TetmeshParser::parse(filename, &out);
+        rest.tets = getTets(out);
+        m_points = getPoints(out);
+    }
     for(int i = 0; i < m_points.size(); i++) {
         m_points[i] = glm::vec3(trans * glm::vec4(m_points[i], 1.f));
     }
     m_isCrackTip.resize(m_points.size());
     m_norms.resize(m_points.size());
     m_vels.resize(m_points.size());
-    m_pointMasses.resize(m_points.size());
-    m_pToTMap = tetsTouchingPoint(m_tets, m_points.size());
-    calcFacesAndNorms();
-
-    printf("Tets loaded: %lu\n", m_tets.size());
-    printf("m_faces size is now %lu\n", m_faces.size());
-    calcBaryTransforms();
-    calcPointMasses();
+    m_pToTMap = tetsTouchingPoint(rest.tets, m_points.size());
+    calcTetColors();
+    if(!(precomputed & TetmeshBinary::HAS_FACES))
+        calcFacesAndNorms();
+
+    printf("Tets loaded: %lu\n", rest.tets.size());
+    printf("m_faces size is now %lu\n", rest.faces.size());
+    if(!(precomputed & TetmeshBinary::HAS_BARY)) {
+        rest.baryTransforms.resize(rest.tets.size());
+        calcBaryTransforms();
+    }
+    if(!(precomputed & TetmeshBinary::HAS_MASSES)) {
+        m_pointMasses.resize(m_points.size());
+        calcPointMasses();
+    }
+    calcTetBlocks();
     std::fill(m_isCrackTip.begin(), m_isCrackTip.end(), false);
     srand(time(NULL));
 
@@ -106,24 +140,86 @@ TetMesh::TetMesh(std::string filename, glm::mat4x4 trans, std::string nodefile)
         //m_points[i] *= 1.2;
     }
     calcNorms();
-    printf("N surface faces: %lu\n", m_faces.size());
+    printf("N surface faces: %lu\n", rest.faces.size());
+}
+
+uint32_t TetMesh::loadBinary(const std::string& filename) {
+    TetRestState& rest = mutableRest();
+    TetmeshBinary::MappedFile file(filename);
+    if(!file.ok())
+        return 0; // warned already; leaves an empty mesh
+    const TetmeshBinary::Header& h = file.header();
+    // the blocks are laid out exactly like these vectors' elements, so loading is a copy
+    static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "vec3 must be packed");
+    static_assert(sizeof(tet_t) == 4 * sizeof(int32_t), "tet_t must be 4 ints");
+    static_assert(sizeof(glm::ivec3) == 3 * sizeof(int32_t), "ivec3 must be packed");
+    static_assert(sizeof(glm::mat3x3) == 9 * sizeof(float), "mat3x3 must be packed");
+    m_points.resize(h.numPoints);
+    std::memcpy(static_cast<void *>(m_points.data()), file.points(), h.numPoints * sizeof(glm::vec3));
+    rest.tets.resize(h.numTets);
+    std::memcpy(static_cast<void *>(rest.tets.data()), file.tets(), h.numTets * sizeof(tet_t));
+    if(file.faces()) {
+        rest.faces.resize(h.numFaces);
+        std::memcpy(static_cast<void *>(rest.faces.data()), file.faces(), h.numFaces * sizeof(glm::ivec3));
+        m_surfaceDirty = true;
+    }
+    if(file.bary()) {
+        rest.baryTransforms.resize(h.numTets);
+        std::memcpy(static_cast<void *>(rest.baryTransforms.data()), file.bary(), h.numTets * sizeof(glm::mat3x3));
+    }
+    if(file.masses()) {
+        m_pointMasses.assign(file.masses(), file.masses() + h.numPoints);
+    }
+    return h.flags;
+}
+
+bool TetMesh::saveBinary(const std::string& filename) const {
+    const TetRestState& rest = *m_rest;
+    // bake this mesh's rest frame into the bary transforms so the file stands on its own
+    std::vector<glm::mat3x3> bary(rest.baryTransforms.size());
+    for(long unsigned int i = 0; i < bary.size(); i++) {
+        bary[i] = rest.baryTransforms[i] * m_restFrameInv;
+    }
+    return TetmeshBinary::write(filename,
+                                m_points.size(), &m_points.data()->x,
+                                rest.tets.size(), reinterpret_cast<const int32_t *>(rest.tets.data()),
+                                rest.faces.size(), &rest.faces.data()->x,
+                                &bary.data()[0][0][0], m_pointMasses.data());
 }
 
 TetMesh::TetMesh(object_node_t node, std::unordered_map<std::string, std::unique_ptr<TetMesh>>& map) {
     m_onode = node;
-    if(true) {
-        map[node.primitive.meshfile] = std::make_unique<TetMesh>(node.primitive.meshfile, node.trans);
-    }
-    TetMesh* copyFrom = map[node.primitive.meshfile].get();
-    // copy everything from the template except the node
-    m_faces = copyFrom->m_faces;
-    m_points = copyFrom->m_points;
-    m_norms = copyFrom->m_norms;
-    m_tets = copyFrom->m_tets;
+    // Templates are parsed once per file, in the file's own coordinates, and every instance
+    // shares the template's rest state. An instance only owns its nodes' state, moved into
+    // place by node.trans.
+    std::unique_ptr<TetMesh>& templ = map[node.primitive.meshfile];
+    if(!templ) {
+        templ = std::make_unique<TetMesh>(node.primitive.meshfile);
+    }
+    const TetMesh* copyFrom = templ.get();
+    m_rest = copyFrom->m_rest;
     m_pToTMap = copyFrom->m_pToTMap;
-    m_baryTransforms = copyFrom->m_baryTransforms;
-    m_pointMasses = copyFrom->m_pointMasses;
+    m_pToTFractured = copyFrom->m_pToTFractured;
+    m_isCrackTip = copyFrom->m_isCrackTip;
     m_vels = copyFrom->m_vels;
+
+    // The shared rest shape is in file space; this instance's rest shape is trans applied
+    // to it. A rest edge matrix P becomes A P (A the linear part of trans), so every bary
+    // transform becomes bary A^-1, which the stress kernel applies on the fly (see
+    // stressParams), and every volume, and so every mass, scales by |det A|.
+    glm::mat3x3 linear(node.trans);
+    m_restFrameInv = glm::inverse(linear) * copyFrom->m_restFrameInv;
+    m_restScale = std::abs(glm::determinant(linear)) * copyFrom->m_restScale;
+    m_points.resize(copyFrom->m_points.size());
+    for(long unsigned int i = 0; i < m_points.size(); i++) {
+        m_points[i] = glm::vec3(node.trans * glm::vec4(copyFrom->m_points[i], 1.f));
+    }
+    m_pointMasses.resize(copyFrom->m_pointMasses.size());
+    for(long unsigned int i = 0; i < m_pointMasses.size(); i++) {
+        m_pointMasses[i] = copyFrom->m_pointMasses[i] * std::abs(glm::determinant(linear));
+    }
+    m_norms.resize(m_points.size());
+    calcNorms();
 }
 
 namespace {
@@ -152,10 +248,110 @@ glm::vec3 getCenter(const std::vector<glm::vec3> &points, tet_t tet) {
     return (points[tet.p1] + points[tet.p2] + points[tet.p3] + points[tet.p4]) / 4.f;
 }
 
+// the 4 faces of a tet, wound so their normals point out of the tet
+inline void getTetFaces(tet_t tet, glm::ivec3 faces[4]) {
+    faces[0] = glm::ivec3(tet.p1, tet.p2, tet.p4);
+    faces[1] = glm::ivec3(tet.p2, tet.p3, tet.p4);
+    faces[2] = glm::ivec3(tet.p3, tet.p1, tet.p4);
+    faces[3] = glm::ivec3(tet.p1, tet.p3, tet.p2);
+}
+
+inline bool faceHas(glm::ivec3 f, int p) {
+    return f.x == p || f.y == p || f.z == p;
+}
+
+// same key for every winding/rotation of a face
+inline glm::ivec3 sortedFace(glm::ivec3 f) {
+    if(f.x > f.y) std::swap(f.x, f.y);
+    if(f.y > f.z) std::swap(f.y, f.z);
+    if(f.x > f.y) std::swap(f.x, f.y);
+    return f;
+}
+
 bool hasFace(tet_t tet, int p1, int p2, int p3) {
     std::unordered_set<int> s = {tet.p1, tet.p2, tet.p3, tet.p4};
     return s.count(p1) && s.count(p2) && s.count(p3);
 }
+
+// workers femThreadPool() is made with, 0 for one per core (see setFemThreads)
+unsigned femThreads = 0;
+
+// shared by every mesh; one pool per TetMesh would spawn a full set of threads per object
+ThreadPool& femThreadPool() {
+    static ThreadPool pool(femThreads ? femThreads : std::thread::hardware_concurrency());
+    return pool;
+}
+}
+
+void setFemThreads(unsigned threads) {
+    femThreads = threads;
+}
+
+void TetMesh::calcTetColors() {
+    TetRestState& rest = mutableRest();
+    // greedy coloring: each node remembers which colors already touch it, and a tet
+    // takes the lowest color none of its 4 nodes has seen yet
+    std::vector<uint64_t> nodeColors(m_points.size(), 0);
+    std::vector<int> tetColor(rest.tets.size());
+    std::vector<int> colorCounts(FEM_MAX_TET_COLORS + 1, 0);
+    int ncolors = 0;
+    for(long unsigned int i = 0; i < rest.tets.size(); i++) {
+        tet_t tet = rest.tets[i];
+        uint64_t used = nodeColors[tet.p1] | nodeColors[tet.p2] | nodeColors[tet.p3] | nodeColors[tet.p4];
+        int color = FEM_MAX_TET_COLORS;
+        if(~used != 0) {
+            color = __builtin_ctzll(~used);
+            uint64_t bit = 1ull << color;
+            nodeColors[tet.p1] |= bit;
+            nodeColors[tet.p2] |= bit;
+            nodeColors[tet.p3] |= bit;
+            nodeColors[tet.p4] |= bit;
+        }
+        tetColor[i] = color;
+        colorCounts[color]++;
+        ncolors = std::max(ncolors, color + 1);
+    }
+    // counting sort by color; within a color tets stay in index order, so the order
+    // forces are summed into each node never depends on the thread count
+    rest.colorOffsets.assign(ncolors + 1, 0);
+    for(int c = 0; c < ncolors; c++) {
+        rest.colorOffsets[c + 1] = rest.colorOffsets[c] + colorCounts[c];
+    }
+    rest.colorOrder.resize(rest.tets.size());
+    std::vector<int> fill(rest.colorOffsets.begin(), rest.colorOffsets.end() - 1);
+    for(long unsigned int i = 0; i < rest.tets.size(); i++) {
+        rest.colorOrder[fill[tetColor[i]]++] = i;
+    }
+    printf("Tets split into %d colors\n", ncolors);
+}
+
+std::vector<int> TetMesh::tetsTouching(int node) const {
+    if(!m_pToTFractured.empty()) {
+        auto it = m_pToTFractured.find(node);
+        if(it != m_pToTFractured.end())
+            return it->second;
+    }
+    if(node + 1 >= (int)m_pToTMap->offsets.size())
+        return std::vector<int>(); // added after the adjacency was built
+    const int *tets = m_pToTMap->tets.data();
+    return std::vector<int>(tets + m_pToTMap->offsets[node], tets + m_pToTMap->offsets[node + 1]);
+}
+
+TetRestState& TetMesh::mutableRest() {
+    // the first change to a rest state that other meshes share takes a private copy
+    if(m_rest.use_count() > 1)
+        m_rest = std::make_shared<TetRestState>(*m_rest);
+    return const_cast<TetRestState&>(*m_rest);
+}
+
+StressParams TetMesh::stressParams() const {
+    StressParams params = {settings.femRigidity, settings.femIncompressibility, settings.femShearViscosity};
+    for(int c = 0; c < 3; c++) {
+        for(int r = 0; r < 3; r++) {
+            params.restFrameInv[c * 3 + r] = m_restFrameInv[c][r];
+        }
+    }
+    return params;
 }
 
 int TetMesh::addNewPoint() {
@@ -163,12 +359,43 @@ int TetMesh::addNewPoint() {
     m_norms.push_back(glm::vec3());
     m_isCrackTip.push_back(false);
     m_vels.push_back(glm::vec3());
-    m_pToTMap.push_back(std::vector<int>());
     m_pointMasses.push_back(0);
+    if(!m_nodeFaces.empty())
+        m_nodeFaces.emplace_back();
     return m_points.size() - 1;
 }
 
-void TetMesh::computeStressForces(std::vector<glm::vec3>& forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels) {
+void TetMesh::removeSurfaceFace(int face) {
+    // swaps the last face into the hole, so only the faces around 6 nodes are touched
+    TetRestState& rest = mutableRest();
+    glm::ivec3 f = rest.faces[face];
+    for(int k = 0; k < 3; k++) {
+        std::vector<int>& list = m_nodeFaces[f[k]];
+        list.erase(std::find(list.begin(), list.end(), face));
+    }
+    int last = rest.faces.size() - 1;
+    if(face != last) {
+        glm::ivec3 moved = rest.faces[last];
+        rest.faces[face] = moved;
+        for(int k = 0; k < 3; k++) {
+            std::vector<int>& list = m_nodeFaces[moved[k]];
+            *std::find(list.begin(), list.end(), last) = face;
+        }
+    }
+    rest.faces.pop_back();
+}
+
+void TetMesh::addSurfaceFace(glm::ivec3 face) {
+    TetRestState& rest = mutableRest();
+    for(int k = 0; k < 3; k++) {
+        m_nodeFaces[face[k]].push_back(rest.faces.size());
+    }
+    rest.faces.push_back(face);
+}
+
+void TetMesh::computeStressForces(std::vector<glm::vec3>& forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels,
+                                  float *stressBound) {
+    const TetRestState& rest = *m_rest;
     // total force = gravity/other global forces + stress per element
     // stress = elastic stress + viscous stress
     // elastic stress = incompressibility * trace(strain) * ID_3x3 + 2*rigidity * strain
@@ -176,94 +403,35 @@ void TetMesh::computeStressForces(std::vector<glm::vec3>& forcePerNode, const st
     // strain = Ftrans*F - I = dx/du - I, where dx/du = P*barytrans, where P is [p1 - p4, p2 - p4, p3 - p4]
     // strain rate = (dx/du)T * (dv/du) + (dv/du)T * (dx/du), where dv/du = V*barytrans, where V is [v1 - v4, v2 - v4, v3 - v4], v velocities
     // so by computing that, we can get force for each node
-    glm::mat3x3 id = glm::mat3x3(1, 0, 0, 0, 1, 0, 0, 0, 1);
-    std::mutex forcesMutex;
-    //for(long unsigned int i = 0;i < m_tets.size(); i++) {
-    auto calc_forces_i = [&](int i) {
-        auto tet = m_tets[i];
-        if(tetInverted(points, tet)) {
-            //printf("Inverted tet (#%d) found!\n", i);
-            //fflush(stdout);
-            //m_faces.clear();
-
-            return;
-        }
-
-        auto p1 = points[tet.p1];
-        auto p2 = points[tet.p2];
-        auto p3 = points[tet.p3];
-        auto p4 = points[tet.p4];
-
-        glm::mat3x3 P(p1 - p4, p2 - p4, p3 - p4);
-        glm::mat3x3 dxT = P * m_baryTransforms[i];
-        glm::mat3x3 dx = glm::transpose(dxT);
-
-        glm::mat3x3 strain = dxT * dx - id; //- id;
-        glm::mat3x3 trace_matrix = (strain[0][0] + strain[1][1] + strain[2][2]) * id;
-
-        glm::mat3x3 stress_elastic = 2 * settings.femRigidity * (strain - 1/3.f * trace_matrix)
-                + settings.femIncompressibility * trace_matrix;
-
-        auto v1 = vels[tet.p1];
-        auto v2 = vels[tet.p2];
-        auto v3 = vels[tet.p3];
-        auto v4 = vels[tet.p4];
-
-        glm::mat3x3 V(v1 - v4, v2 - v4, v3 - v4);
-        glm::mat3x3 dvT = V * m_baryTransforms[i];
-        glm::mat3x3 dv = glm::transpose(dvT);
-
-        glm::mat3x3 strain_rate = dxT * dv + dvT * dx;
-        glm::mat3x3 sr_trace_matrix = (strain_rate[0][0] + strain_rate[1][1] + strain_rate[2][2]) * id;
-
-        glm::mat3x3 stress_viscous = 2 * settings.femShearViscosity * (strain_rate - 1/3.f * sr_trace_matrix)
-                + settings.femIncompressibility * sr_trace_matrix;
-
-        glm::mat3x3 stress_total = stress_elastic + stress_viscous;
-        //computeFracture(tet, stress_total);
-        glm::mat3x3 stress_t_ws = dx * stress_total;
-        glm::vec3 p1force = stress_t_ws * -glm::cross(p4 - p2, p3 - p2);
-        glm::vec3 p2force = stress_t_ws * -glm::cross(p4 - p3, p1 - p3);
-        glm::vec3 p3force = stress_t_ws * -glm::cross(p4 - p1, p2 - p1);
-        glm::vec3 p4force = stress_t_ws * -glm::cross(p2 - p1, p3 - p1);
-
-        forcesMutex.lock();
-        forcePerNode[tet.p1] += p1force;
-        forcePerNode[tet.p2] += p2force;
-        forcePerNode[tet.p3] += p3force;
-        forcePerNode[tet.p4] += p4force;
-        forcesMutex.unlock();
+    // Tets are visited color by color (see calcTetColors). No two tets of a color share
+    // a node, so a color's tets can write into forcePerNode from any thread without a
+    // lock, and the serial path walks the same order so both give identical sums.
+    // The per-tet math lives in computeStressBatch (tetkernel.cpp), which evaluates
+    // TET_BATCH tets at once out of the packed rest.tetBlocks records.
+    StressParams params = stressParams();
+    auto calc_forces_range = [&](int lo, int hi) {
+        for(int j = lo; j < hi; j += TET_BATCH) {
+            computeStressBatch(rest.tetBlocks.data(), &rest.colorOrder[j], std::min(TET_BATCH, hi - j),
+                               points.data(), vels.data(), params, forcePerNode.data(), stressBound);
+        }
     };
 
-    if(true) {
-        for(long unsigned int i = 0;i < m_tets.size(); i++) {
-            calc_forces_i(i);
-        }
-    }
-    else {
-        int nthreads = 1;
-        std::thread threads[nthreads];
-        float ninc = m_tets.size() / nthreads;
-        float tlast = 0;
-
-        for(int i = 0; i < nthreads - 1; i++) {
-            float tlcopy = tlast;
-            threads[i] = std::thread([calc_forces_i, tlcopy, ninc]{
-                for(int j = std::round(tlcopy); j < std::round(tlcopy + ninc); j++) {
-                    calc_forces_i(j);
-                }
-            });
-            tlast = tlast + ninc;
-        }
-        threads[nthreads - 1] = std::thread([&]{
-            for(int j = std::round(tlast); j < m_tets.size(); j++) {
-                calc_forces_i(j);
-            }
-        });
-        for(int i = 0; i < nthreads; i++) {
-            threads[i].join();
-        }
+    bool parallel = settings.femMultiThreading && (int)rest.tets.size() >= FEM_PARALLEL_MIN_TETS;
+    // Colors that run serially are walked as one range, so a small color doesn't leave a
+    // part-empty batch behind. A batch adds its forces one tet after another, so tets of
+    // different colors can share one as long as no other thread is writing.
+    int ncolors = (int)rest.colorOffsets.size() - 1;
+    int serialStart = 0;
+    for(int c = 0; c < ncolors; c++) {
+        int start = rest.colorOffsets[c];
+        int end = rest.colorOffsets[c + 1];
+        if(!parallel || c == FEM_MAX_TET_COLORS || end - start < FEM_PARALLEL_MIN_BATCH)
+            continue;
+        calc_forces_range(serialStart, start);
+        femThreadPool().parallelFor(start, end, calc_forces_range);
+        serialStart = end;
     }
+    calc_forces_range(serialStart, rest.colorOffsets[ncolors]);
 }
 
 // number of newtons to apply when penetrated 1  meter^2
@@ -297,101 +465,279 @@ void TetMesh::computeAllForces(std::vector<glm::vec3> &forcePerNode) {
     std::fill(forcePerNode.begin(), forcePerNode.end(), glm::vec3());
     // first add grav
     for(long unsigned int i = 0;i < m_points.size(); i++) {
-        forcePerNode[i] += glm::vec3(0, -0.1, 0) * m_pointMasses[i];
+        forcePerNode[i] += glm::vec3(0, -FEM_GRAVITY, 0) * m_pointMasses[i];
     }
     computeStressForces(forcePerNode, m_points, m_vels);
     computeCollisionForces(forcePerNode, m_points, m_vels, FLOOR_Y);
 }
 
-void TetMesh::computeAllForcesFrom(std::vector<glm::vec3> &forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels) {
+void TetMesh::computeAllForcesFrom(std::vector<glm::vec3> &forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels,
+                                   float *stressBound) {
     std::fill(forcePerNode.begin(), forcePerNode.end(), glm::vec3());
     // first add grav
     for(long unsigned int i = 0;i < points.size(); i++) {
-        forcePerNode[i] += glm::vec3(0, -0.1, 0) * m_pointMasses[i];
+        forcePerNode[i] += glm::vec3(0, -FEM_GRAVITY, 0) * m_pointMasses[i];
     }
-    computeStressForces(forcePerNode, points, vels);
+    computeStressForces(forcePerNode, points, vels, stressBound);
     computeCollisionForces(forcePerNode, points, vels, FLOOR_Y);
 }
 
 bool TetMesh::checkBad() {
+    const TetRestState& rest = *m_rest;
     for(int i = 0; i < m_points.size(); i++) {
-        if(m_points[i].y < KILL_FLOOR_Y)
+        // (also catches NaN, which a blown-up step leaves behind)
+        if(!(m_points[i].y >= KILL_FLOOR_Y))
             return true;
     }
-    for(int i = 0; i < m_tets.size(); i++) {
-        if(tetInverted(m_points, m_tets[i]))
+    for(int i = 0; i < rest.tets.size(); i++) {
+        if(tetInverted(m_points, rest.tets[i]))
             return true;
     }
     return false;
 }
 
+namespace {
+// The vec3 arrays below are tightly packed floats, so each RK4 stage runs as one flat
+// loop over 3 * npoints floats with a per-component inverse mass. No gathers or
+// per-node divides, so the compiler vectorizes these with whatever SSE/AVX it targets.
+
+// Folds one stage's derivatives (dx = vnext, dv = force / mass) into the weighted sums,
+// then moves xnext/vnext to the next sample point, x + stepToNext * (dx, dv).
+void rk4Stage(int n, float weight, float stepToNext,
+              const float *__restrict x, const float *__restrict v,
+              const float *__restrict force, const float *__restrict invMass,
+              float *__restrict xnext, float *__restrict vnext,
+              float *__restrict sumX, float *__restrict sumV) {
+    for(int k = 0; k < n; k++) {
+        float dx = vnext[k];
+        float dv = force[k] * invMass[k];
+        sumX[k] += weight * dx;
+        sumV[k] += weight * dv;
+        xnext[k] = x[k] + stepToNext * dx;
+        vnext[k] = v[k] + stepToNext * dv;
+    }
+}
+
+// Last stage: fold in k4 and take the full step, x += h/6 * (k1 + 2k2 + 2k3 + k4).
+void rk4Finish(int n, float timestep,
+               float *__restrict x, float *__restrict v,
+               const float *__restrict force, const float *__restrict invMass,
+               const float *__restrict vnext,
+               const float *__restrict sumX, const float *__restrict sumV) {
+    float h6 = timestep / 6.f;
+    for(int k = 0; k < n; k++) {
+        x[k] += h6 * (sumX[k] + vnext[k]);
+        v[k] += h6 * (sumV[k] + force[k] * invMass[k]);
+    }
+}
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "rk4 kernels assume packed vec3s");
+
+inline float *flat(std::vector<glm::vec3>& v) {
+    return &v[0].x;
+}
+
+inline const float *flat(const std::vector<glm::vec3>& v) {
+    return &v[0].x;
+}
+}
+
+void TetMesh::prepareScratch() {
+    // a tet not yet seen by a force pass might be failing
+    m_stressBound.resize(m_rest->tets.size(), INFINITY);
+    // only reallocates when the node count changes (i.e. after a fracture adds points)
+    unsigned long n = m_points.size();
+    if(m_invMass3.size() == n * 3)
+        return;
+    m_forces.resize(n);
+    m_xnext.resize(n);
+    m_vnext.resize(n);
+    m_sumX.resize(n);
+    m_sumV.resize(n);
+    m_invMass3.resize(n * 3);
+    for(unsigned long i = 0; i < n; i++) {
+        float inv = 1.f / m_pointMasses[i];
+        m_invMass3[i * 3] = inv;
+        m_invMass3[i * 3 + 1] = inv;
+        m_invMass3[i * 3 + 2] = inv;
+    }
+}
+
 // the bool is true if this object has to die; i.e. it inverts or goes below floor.
 bool TetMesh::update(float timestep) {
     if(m_onode.disablePhysics)
         return false;
-    // step 1: get all forces.
-    std::vector<glm::vec3> forces(m_points.size()),
-            dxk1(m_points.size()),
-            dxk2(m_points.size()),
-            dxk3(m_points.size()),
-            dxk4(m_points.size()),
-            xnext(m_points.size()),
-            dvk1(m_points.size()),
-            dvk2(m_points.size()),
-            dvk3(m_points.size()),
-            dvk4(m_points.size()),
-            vnext(m_points.size());
+    if(m_points.empty())
+        return true;
+    prepareScratch();
+    if(settings.femIntegrator == FEM_INTEGRATOR_BACKWARD_EULER)
+        stepBackwardEuler(timestep);
+    else
+        stepRK4(timestep);
+    if(settings.femFracture)
+        computeFracture();
+    calcNorms();
+    return checkBad();
+}
+
+void TetMesh::stepRK4(float timestep) {
+    int n = m_points.size() * 3;
+    const float *x = flat(m_points);
+    const float *v = flat(m_vels);
+    const float *im = m_invMass3.data();
     // We use RK4, which is an advanced explicit integration technique in which we find derivatives
     // at multiple sample points and average them to get the final derivative we use to move the
-    // simulation forward one timestep.
+    // simulation forward one timestep. Rather than keeping all four derivatives around, each stage
+    // adds its weighted derivative into m_sumX/m_sumV.
+    std::fill(m_sumX.begin(), m_sumX.end(), glm::vec3());
+    std::fill(m_sumV.begin(), m_sumV.end(), glm::vec3());
+    std::copy(m_points.begin(), m_points.end(), m_xnext.begin());
+    std::copy(m_vels.begin(), m_vels.end(), m_vnext.begin());
 
-    // P1: Start by calculating derivatives at current pos+velocity
-    computeAllForcesFrom(forces, m_points, m_vels);
-    for(long unsigned int i = 0;i < m_points.size(); i++) {
-        glm::vec3 accel = forces[i] / m_pointMasses[i];
-        dxk1[i] = m_vels[i];
-        dvk1[i] = accel; // compute k1 + p
-        //vtemp[i] = m_vels[i] + velIncrement
-        xnext[i] = m_points[i] + dxk1[i] * 0.5f * timestep;
-        vnext[i] = m_vels[i] + dvk1[i] * 0.5f * timestep;
-    }
-    // P2: Move pos+velocity half of a timestep from orig using derivatives from P1, calculate derivatives
-    computeAllForcesFrom(forces, xnext, vnext);
-    for(long unsigned int i = 0;i < m_points.size(); i++) {
-        glm::vec3 accel = forces[i] / m_pointMasses[i];
-        dxk2[i] = vnext[i];
-        dvk2[i] = accel;
-        xnext[i] = m_points[i] + dxk2[i] * 0.5f * timestep;
-        vnext[i] = m_vels[i] + dvk2[i] * 0.5f * timestep;
-    }
-    // P3: Move pos+velocity half of a timestep from orig using derivatives from P2, calculate derivatives
-    computeAllForcesFrom(forces, xnext, vnext);
-    for(long unsigned int i = 0;i < m_points.size(); i++) {
-        glm::vec3 accel = forces[i] / m_pointMasses[i];
-        dxk3[i] = vnext[i];
-        dvk3[i] = accel;
-        xnext[i] = m_points[i] + dxk3[i] * 1.0f * timestep;
-        vnext[i] = m_vels[i] + dvk3[i] * 1.0f * timestep;
-    }
-    // P4: Move pos+velocity a full timestep from orig using derivatives from P3, calculate derivatives
-    computeAllForcesFrom(forces, xnext, vnext);
-    for(long unsigned int i = 0;i < m_points.size(); i++) {
-        glm::vec3 accel = forces[i] / m_pointMasses[i];
-        dxk4[i] = vnext[i];
-        dvk4[i] = accel;
-    }
+    // P1: Start by calculating derivatives at current pos+velocity, then move half a timestep
+    computeAllForcesFrom(m_forces, m_xnext, m_vnext, settings.femFracture ? m_stressBound.data() : nullptr);
+    rk4Stage(n, 1.f, 0.5f * timestep, x, v, flat(m_forces), im, flat(m_xnext), flat(m_vnext), flat(m_sumX), flat(m_sumV));
+    // P2: derivatives at the half step from P1, move half a timestep from orig using them
+    computeAllForcesFrom(m_forces, m_xnext, m_vnext);
+    rk4Stage(n, 2.f, 0.5f * timestep, x, v, flat(m_forces), im, flat(m_xnext), flat(m_vnext), flat(m_sumX), flat(m_sumV));
+    // P3: derivatives at the half step from P2, move a full timestep from orig using them
+    computeAllForcesFrom(m_forces, m_xnext, m_vnext);
+    rk4Stage(n, 2.f, timestep, x, v, flat(m_forces), im, flat(m_xnext), flat(m_vnext), flat(m_sumX), flat(m_sumV));
+    // P4: derivatives at the full step from P3.
     // Take final derivatives to be (derivs(P1) + 2*derivs(P2) + 2*derivs(P3) + derivs(P4))/6, i.e.
     // a weighted average, then move pos+velocity a full timestep from the orig using those derivatives
-    for(long unsigned int i = 0;i < m_points.size(); i++) {
-        m_points[i] += timestep * (dxk1[i] + dxk4[i] + 2.f*(dxk2[i] + dxk3[i])) / 6.f;
-        m_vels[i] += timestep * (dvk1[i] + dvk4[i] + 2.f*(dvk2[i] + dvk3[i])) / 6.f;
+    computeAllForcesFrom(m_forces, m_xnext, m_vnext);
+    rk4Finish(n, timestep, flat(m_points), flat(m_vels), flat(m_forces), im, flat(m_vnext), flat(m_sumX), flat(m_sumV));
+}
+
+namespace {
+typedef Eigen::Matrix<double, 12, 12> Matrix12d;
+
+// Replaces an element Jacobian J with the nearest symmetric J' for which -J' is positive
+// semi-definite, by clamping the negative eigenvalues of -(J + J^T)/2 to zero (Teran et al.,
+// "Robust Quasistatic Finite Elements and Flesh Simulation", 2005). Most tets already pass a
+// Cholesky test and skip the eigensolve. Returns whether anything was clamped.
+bool projectJacobian(double jac[12][12]) {
+    Matrix12d m;
+    for(int i = 0; i < 12; i++) {
+        for(int j = 0; j < 12; j++) {
+            m(i, j) = -0.5 * (jac[i][j] + jac[j][i]);
+        }
+    }
+    // -J is only semi-definite (rigid motions are in its null space), so test it with a
+    // little added to the diagonal; what gets through has no eigenvalue below -shift
+    double shift = 1e-6 * m.diagonal().cwiseAbs().maxCoeff() + 1e-30;
+    bool clamped = Eigen::LLT<Matrix12d>(m + shift * Matrix12d::Identity()).info() != Eigen::Success;
+    if(clamped) {
+        Eigen::SelfAdjointEigenSolver<Matrix12d> es(m);
+        m = es.eigenvectors() * es.eigenvalues().cwiseMax(0.0).asDiagonal() * es.eigenvectors().transpose();
+    }
+    for(int i = 0; i < 12; i++) {
+        for(int j = 0; j < 12; j++) {
+            jac[i][j] = -m(i, j);
+        }
     }
+    return clamped;
+}
+}
 
-    calcNorms();
-    return checkBad();
+void TetMesh::stepBackwardEuler(float h) {
+    const TetRestState& rest = *m_rest;
+    // Linearized backward Euler (Baraff & Witkin '98). With K = df/dx and D = df/dv at the
+    // current state, the velocity change solves
+    //     (M - h D - h^2 K) dv = h (f + h K v)
+    // and then v += dv, x += h v. -D is positive semi-definite for the viscous model, but -K
+    // isn't for St.Venant-Kirchhoff under compression, so each tet's K and D are projected
+    // onto the nearest such matrices first (see projectJacobian). That keeps the system
+    // symmetric positive definite for Jacobi-preconditioned CG. This stays stable at
+    // timesteps far past where RK4 blows up, at the cost of one sparse solve per step. If CG
+    // still doesn't converge, the step is taken with RK4 substeps instead.
+    int n = m_points.size();
+    computeAllForcesFrom(m_forces, m_points, m_vels, settings.femFracture ? m_stressBound.data() : nullptr);
+
+    // Each tet writes its 144 entries into its own slot of triplets, so tets can be assembled
+    // from any thread in a fixed order. Kv is summed into per node, so like the stress forces
+    // (see computeStressForces) it goes color by color; no two tets of a color share a node.
+    StressParams params = stressParams();
+    std::vector<Eigen::Triplet<float>> triplets(rest.tets.size() * 144);
+    triplets.reserve(rest.tets.size() * 144 + n * 3);
+    Eigen::VectorXf Kv = Eigen::VectorXf::Zero(n * 3);
+    auto assemble_range = [&](int lo, int hi) {
+        double dfdx[12][12], dfdv[12][12];
+        for(int k = lo; k < hi; k++) {
+            const TetBlock& blk = rest.tetBlocks[rest.colorOrder[k]];
+            Eigen::Triplet<float> *out = &triplets[k * 144];
+            bool inverted = !computeTetJacobians(blk, m_points.data(), m_vels.data(), params, dfdx, dfdv);
+            if(!inverted) {
+                projectJacobian(dfdx);
+                projectJacobian(dfdv);
+            }
+            for(int i = 0; i < 12; i++) {
+                int row = blk.node[i / 3] * 3 + i % 3;
+                for(int j = 0; j < 12; j++) {
+                    int col = blk.node[j / 3] * 3 + j % 3;
+                    // an inverted tet adds no force, so its slot holds zeros
+                    if(inverted) {
+                        *out++ = Eigen::Triplet<float>(row, col, 0.f);
+                        continue;
+                    }
+                    *out++ = Eigen::Triplet<float>(row, col, -h * dfdv[i][j] - h * h * dfdx[i][j]);
+                    Kv[row] += dfdx[i][j] * m_vels[blk.node[j / 3]][j % 3];
+                }
+            }
+        }
+    };
+    bool parallel = settings.femMultiThreading && (int)rest.tets.size() >= FEM_PARALLEL_MIN_TETS;
+    int ncolors = (int)rest.colorOffsets.size() - 1;
+    for(int c = 0; c < ncolors; c++) {
+        int start = rest.colorOffsets[c];
+        int end = rest.colorOffsets[c + 1];
+        if(parallel && c != FEM_MAX_TET_COLORS)
+            femThreadPool().parallelFor(start, end, assemble_range);
+        else
+            assemble_range(start, end);
+    }
+    for(int i = 0; i < n; i++) {
+        for(int c = 0; c < 3; c++) {
+            triplets.push_back(Eigen::Triplet<float>(i * 3 + c, i * 3 + c, m_pointMasses[i]));
+        }
+        // the floor penalty is linear in depth, so it adds -m * k to K along y
+        const glm::vec3& p = m_points[i];
+        if(p.y < FLOOR_Y && std::abs(p.x) < FLOOR_RADIUS && std::abs(p.z) < FLOOR_RADIUS) {
+            float k = m_pointMasses[i] * PENALTY_ACCEL_K;
+            triplets.push_back(Eigen::Triplet<float>(i * 3 + 1, i * 3 + 1, h * h * k));
+            Kv[i * 3 + 1] -= k * m_vels[i].y;
+        }
+    }
+    Eigen::SparseMatrix<float> A(n * 3, n * 3);
+    A.setFromTriplets(triplets.begin(), triplets.end());
+
+    Eigen::Map<const Eigen::VectorXf> f(flat(m_forces), n * 3);
+    Eigen::VectorXf rhs = h * (f + h * Kv);
+    Eigen::ConjugateGradient<Eigen::SparseMatrix<float>, Eigen::Lower | Eigen::Upper> cg;
+    cg.setTolerance(FEM_CG_TOLERANCE);
+    cg.setMaxIterations(FEM_CG_MAX_ITERATIONS);
+    cg.compute(A);
+    Eigen::VectorXf dv = cg.solve(rhs);
+    if(cg.info() != Eigen::Success || !dv.allFinite()) {
+        // an unconverged dv can throw the mesh apart; nothing has moved yet, so redo the step
+        // explicitly at the RK4 substep size
+        int substeps = std::max(1, (int)std::ceil(h * settings.femStepsPerFrame / settings.femTimeStep));
+        printf("Implicit step: CG stopped after %ld iterations, error %f; taking %d RK4 substeps\n",
+               (long)cg.iterations(), cg.error(), substeps);
+        for(int i = 0; i < substeps; i++) {
+            stepRK4(h / substeps);
+        }
+        return;
+    }
+
+    for(int i = 0; i < n; i++) {
+        m_vels[i] += glm::vec3(dv[i * 3], dv[i * 3 + 1], dv[i * 3 + 2]);
+        m_points[i] += h * m_vels[i];
+    }
 }
 
-void getNormalsFromFaces(const std::unordered_map<glm::ivec3, bool, ivec3_hash>& faces, const std::vector<glm::vec3>& points, std::vector<glm::vec3>& norms) {
+void getNormalsFromFaces(const std::vector<glm::ivec3>& faces, const std::vector<glm::vec3>& points, std::vector<glm::vec3>& norms) {
     std::fill(norms.begin(), norms.end(), glm::vec3());
     for(auto it = faces.begin(); it != faces.end(); it++) {
         // tris (oriented s.t. pointing outwards) are:
@@ -399,9 +745,9 @@ void getNormalsFromFaces(const std::unordered_map<glm::ivec3, bool, ivec3_hash>&
         // to get cross of tri XYZ, we do Z-Y x Y-X
         // by crossing w/o normalizing, we weight by SA
 
-        int p1idx = it->first.x;
-        int p2idx = it->first.y;
-        int p3idx = it->first.z;
+        int p1idx = it->x;
+        int p2idx = it->y;
+        int p3idx = it->z;
 
         auto p1 = points[p1idx];
         auto p2 = points[p2idx];
@@ -417,28 +763,50 @@ void getNormalsFromFaces(const std::unordered_map<glm::ivec3, bool, ivec3_hash>&
 }
 
 void TetMesh::calcBaryTransforms() {
+    TetRestState& rest = mutableRest();
     // calculate the barycentric coordinate transform (from point in mat space to point in tetra's bary coordinate space)
-    assert(m_baryTransforms.size() == m_tets.size());
-    for(long unsigned int i = 0;i < m_tets.size(); i++) {
-        auto tet = m_tets[i];
+    assert(rest.baryTransforms.size() == rest.tets.size());
+    for(long unsigned int i = 0;i < rest.tets.size(); i++) {
+        auto tet = rest.tets[i];
         auto v1 = m_points[tet.p1];
         auto v2 = m_points[tet.p2];
         auto v3 = m_points[tet.p3];
         auto v4 = m_points[tet.p4];
-        m_baryTransforms[i] = glm::inverse(glm::mat3x3(v1 - v4, v2 - v4, v3 - v4));
+        rest.baryTransforms[i] = glm::inverse(glm::mat3x3(v1 - v4, v2 - v4, v3 - v4));
+    }
+}
+
+void TetMesh::calcTetBlocks() {
+    TetRestState& rest = mutableRest();
+    // pack the rest-state data the stress kernel reads into one cache line per tet
+    rest.tetBlocks.resize(rest.tets.size());
+    for(long unsigned int i = 0;i < rest.tets.size(); i++) {
+        tet_t tet = rest.tets[i];
+        TetBlock& blk = rest.tetBlocks[i];
+        for(int c = 0; c < 3; c++) {
+            for(int r = 0; r < 3; r++) {
+                blk.bary[c * 3 + r] = rest.baryTransforms[i][c][r];
+            }
+        }
+        for(int k = 0; k < 4; k++) {
+            blk.node[k] = tet[k];
+        }
+        // |det(inverse)| = 1 / |det(P)|, and a tet's volume is |det(P)| / 6
+        blk.restVolume = 1.f / (6.f * std::abs(glm::determinant(rest.baryTransforms[i])));
     }
 }
 
 #define MAT_DENSITY 600
 
 void TetMesh::calcPointMasses() {
+    const TetRestState& rest = *m_rest;
     // calculate masses for each point based on tet volumes
     assert(m_pointMasses.size() == m_points.size());
     std::fill(m_pointMasses.begin(), m_pointMasses.end(), 0);
     float maxvol = -1, minvol = INFINITY;
-    for(long unsigned int i = 0;i < m_tets.size(); i++) {
+    for(long unsigned int i = 0;i < rest.tets.size(); i++) {
         // let density = 4000 (i.e. water*4), then we can add tet vol to each node mass
-        tet_t tet = m_tets[i];
+        tet_t tet = rest.tets[i];
         auto p1 = m_points[tet.p1];
         auto p2 = m_points[tet.p2];
         auto p3 = m_points[tet.p3];
@@ -446,11 +814,8 @@ void TetMesh::calcPointMasses() {
         float volume = MAT_DENSITY*glm::length(glm::dot(p1 - p2, glm::cross(p4 - p2, p3 - p2)))/4;
         if(volume > maxvol)
             maxvol = volume;
-        if(volume < minvol) {
+        if(volume < minvol)
             minvol = volume;
-            printf("at min:\np1: %f,%f,%f\np2: %f,%f,%f\np3: %f,%f,%f\np4: %f,%f,%f\n",
-                   p1.x, p1.y, p1.z, p2.x, p2.y, p2.z, p3.x, p3.y, p3.z, p4.x, p4.y, p4.z);
-        }
         m_pointMasses[tet.p1] += volume;
         m_pointMasses[tet.p2] += volume;
         m_pointMasses[tet.p3] += volume;
@@ -464,6 +829,7 @@ void TetMesh::calcPointMasses() {
             minm = m_pointMasses[i];
 
     }
+    m_invMass3.clear(); // rebuilt by prepareScratch
     printf("Total mass is %f, smallest mass is %f w/ inverse %f\nMax volume is %f, min volume is %f", sum, minm, 1.f/minm, maxvol, minvol);
     /*float min_allowed_mass = sum / m_points.size() / 100;
     for(long unsigned int i = 0;i < m_pointMasses.size(); i++) {
@@ -475,86 +841,415 @@ void TetMesh::calcPointMasses() {
     printf("After culling low masses, new total mass is %f\n", sum);*/
 }
 
-bool setIfContains(std::unordered_map<glm::ivec3, bool, ivec3_hash>& map, glm::ivec3 vec) {
-    bool good = true;
-#define V(a, b, c) glm::ivec3(vec[a], vec[b], vec[c])
-    if(map.count(vec))
-        map[vec] = good = false;
-    if(map.count(V(0, 2, 1)))
-        map[V(0, 2, 1)] = good = false;
-    if(map.count(V(1, 0, 2)))
-        map[V(1, 0, 2)] = good = false;
-    if(map.count(V(1, 2, 0)))
-        map[V(1, 2, 0)] = good = false;
-    if(map.count(V(2, 0, 1)))
-        map[V(2, 0, 1)] = good = false;
-    if(map.count(V(2, 1, 0)))
-        map[V(2, 1, 0)] = good = false;
-    if(good)
-        map[vec] = true;
-#undef V
-    return good;
+namespace {
+// Sorts (key, value) pairs by key, least significant 16 bits first. Only as many passes as
+// maxKey needs, so small meshes get away with 2 or 3.
+void radixSortKeys(std::vector<std::pair<uint64_t, int>>& items, uint64_t maxKey) {
+    std::vector<std::pair<uint64_t, int>> tmp(items.size());
+    std::vector<size_t> counts(1 << 16);
+    for(int shift = 0; shift < 64 && (maxKey >> shift) != 0; shift += 16) {
+        std::fill(counts.begin(), counts.end(), 0);
+        for(auto& item : items) {
+            counts[(item.first >> shift) & 0xffff]++;
+        }
+        size_t sum = 0;
+        for(auto& c : counts) {
+            size_t n = c;
+            c = sum;
+            sum += n;
+        }
+        for(auto& item : items) {
+            tmp[counts[(item.first >> shift) & 0xffff]++] = item;
+        }
+        items.swap(tmp);
+    }
 }
 
-void TetMesh::calcFacesAndNorms() {
-    m_faces.clear();
-    // we will extract the surface mesh by looking at every face and finding which are occluded
-    for(long unsigned int i = 0;i < m_tets.size(); i++) {
-        tet_t tet = m_tets[i];
-        glm::ivec3 f1(tet.p1, tet.p2, tet.p4),
-                f2(tet.p2, tet.p3, tet.p4),
-                f3(tet.p3, tet.p1, tet.p4),
-                f4(tet.p1, tet.p3, tet.p2);
-        setIfContains(m_faces, f1);
-        setIfContains(m_faces, f2);
-        setIfContains(m_faces, f3);
-        setIfContains(m_faces, f4);
-    }
-    for(auto it = m_faces.begin(); it != m_faces.end();) {
-        if(it->second)
-            it++;
-        else {
-            it = m_faces.erase(it); // kill non-outward faces
+// bits per node index in a face key; 3 of them have to fit in 64 bits
+const int FACE_KEY_BITS = 21;
+
+// Every outward-wound tet face that no other tet shares. Each face gets a key made of its
+// sorted node indices, the keys get radix sorted, and faces whose key shows up once are the
+// boundary. Output is in key order, so it's the same on every run. Meshes with too many
+// nodes for the key are comparison sorted into the same order instead.
+std::vector<glm::ivec3> extractBoundaryFaces(const std::vector<tet_t>& tets, int numPoints) {
+    std::vector<glm::ivec3> faces(tets.size() * 4);
+    for(long unsigned int i = 0; i < tets.size(); i++) {
+        getTetFaces(tets[i], &faces[i * 4]);
+    }
+    int bits = 1;
+    while((1ll << bits) < numPoints)
+        bits++;
+
+    // face indices, sorted by key
+    std::vector<int> order(faces.size());
+    if(bits <= FACE_KEY_BITS) {
+        std::vector<std::pair<uint64_t, int>> keys(faces.size());
+        for(long unsigned int i = 0; i < faces.size(); i++) {
+            glm::ivec3 sorted = sortedFace(faces[i]);
+            uint64_t key = ((uint64_t)sorted.x << (2 * bits)) | ((uint64_t)sorted.y << bits) | (uint64_t)sorted.z;
+            keys[i] = std::make_pair(key, (int)i);
         }
+        radixSortKeys(keys, numPoints > 0 ? (1ull << (3 * bits)) - 1 : 0);
+        for(long unsigned int i = 0; i < keys.size(); i++) {
+            order[i] = keys[i].second;
+        }
+    }
+    else {
+        // Past 2^21 nodes the key doesn't fit in 64 bits, so compare the sorted faces
+        // themselves. Same order as the radix sort (which is stable), just slower.
+        std::vector<glm::ivec3> sorted(faces.size());
+        for(long unsigned int i = 0; i < faces.size(); i++) {
+            sorted[i] = sortedFace(faces[i]);
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&sorted](int a, int b) {
+            const glm::ivec3& fa = sorted[a];
+            const glm::ivec3& fb = sorted[b];
+            if(fa.x != fb.x) return fa.x < fb.x;
+            if(fa.y != fb.y) return fa.y < fb.y;
+            if(fa.z != fb.z) return fa.z < fb.z;
+            return a < b;
+        });
     }
+
+    std::vector<glm::ivec3> boundary;
+    for(size_t i = 0; i < order.size();) {
+        glm::ivec3 key = sortedFace(faces[order[i]]);
+        size_t j = i + 1;
+        while(j < order.size() && sortedFace(faces[order[j]]) == key)
+            j++;
+        if(j - i == 1)
+            boundary.push_back(faces[order[i]]);
+        i = j;
+    }
+    return boundary;
+}
+}
+
+void TetMesh::calcFacesAndNorms() {
+    TetRestState& rest = mutableRest();
+    // the surface mesh is every face that isn't shared between two tets
+    rest.faces = extractBoundaryFaces(rest.tets, m_points.size());
+    m_nodeFaces.clear();
+    m_surfaceDirty = true;
     calcNorms();
 
 }
 
 void TetMesh::calcNorms() {
-    getNormalsFromFaces(m_faces, m_points, m_norms);
+    const TetRestState& rest = *m_rest;
+    getNormalsFromFaces(rest.faces, m_points, m_norms);
+}
+
+size_t TetMesh::packSurface() {
+    const TetRestState& rest = *m_rest;
+    size_t bytes = 0;
+    if(m_surfaceDirty) {
+        m_surface.setFaces(rest.faces, m_points.size());
+        m_surfaceDirty = false;
+        bytes += m_surface.indices().size() * sizeof(int);
+    }
+    return bytes + m_surface.pack(m_points, m_norms);
+}
+
+double TetMesh::mechanicalEnergy() const {
+    double energy = 0;
+    for(long unsigned int i = 0; i < m_points.size(); i++) {
+        double m = m_pointMasses[i];
+        energy += 0.5 * m * glm::dot(m_vels[i], m_vels[i]) + m * FEM_GRAVITY * (m_points[i].y - FLOOR_Y);
+    }
+    return energy;
+}
+
+std::vector<object_node_t> tetMeshNodes(const std::vector<object_node_t>& nodes) {
+    std::vector<object_node_t> meshNodes;
+    for(unsigned long i = 0; i < nodes.size(); i++) {
+        object_node_t node = nodes[i];
+        switch(node.primitive.type) {
+        case PrimitiveType::PRIMITIVE_MESH:
+            printf("Mesh found: %s\n", node.primitive.meshfile.c_str());
+            fflush(stdout);
+            break;
+        case PrimitiveType::PRIMITIVE_SPHERE:
+            node.primitive.meshfile = "example-meshes/sphere.mesh";
+            break;
+        case PrimitiveType::PRIMITIVE_CUBE:
+            // if it's a cube and is first element, turn off physics
+            if (i == 0) node.disablePhysics = true;
+            node.primitive.meshfile = "example-meshes/cube.mesh";
+            break;
+        case PrimitiveType::PRIMITIVE_CONE:
+            node.primitive.meshfile = "example-meshes/cone.mesh";
+            break;
+        default:
+            continue;
+        }
+        meshNodes.push_back(node);
+    }
+    return meshNodes;
+}
+
+void loadTetMeshTemplates(const std::vector<object_node_t>& nodes,
+                          std::unordered_map<std::string, std::unique_ptr<TetMesh>>& map) {
+    // Parsing (and tetrahedralizing, for .obj) is most of the load time and no file depends
+    // on another, so each distinct file not loaded yet is its own job. The map slots are all
+    // inserted up front so the jobs never touch the map itself.
+    std::vector<std::pair<std::string, std::unique_ptr<TetMesh>*>> toLoad;
+    for(const object_node_t& node : nodes) {
+        const std::string& file = node.primitive.meshfile;
+        if(map.count(file) == 0) {
+            toLoad.emplace_back(file, &map[file]);
+        }
+    }
+    auto load = [&toLoad](int lo, int hi) {
+        for(int i = lo; i < hi; i++) {
+            *toLoad[i].second = std::make_unique<TetMesh>(toLoad[i].first);
+        }
+    };
+    if(!settings.femMultiThreading || toLoad.size() < 2) {
+        load(0, toLoad.size());
+    }
+    else {
+        femThreadPool().parallelFor(0, toLoad.size(), load);
+    }
+}
+
+int TetMesh::computeFracture() {
+    const TetRestState& rest = *m_rest;
+    // A tet fails when its largest principal stress (largest eigenvalue of the stress tensor)
+    // passes femFractureToughness; the crack runs perpendicular to that eigenvector.
+    // The step's first force pass already bounded every tet's largest principal stress (see
+    // m_stressBound), so only tets whose bound passed the toughness then get their stress
+    // recomputed, now, and eigensolved. A tet that only nears failing during this step is
+    // caught by the next one.
+    StressParams params = stressParams();
+    float toughness = settings.femFractureToughness;
+    std::vector<std::pair<float, int>> failing; // (principal stress, index into tets/normals)
+    std::vector<int> tets;
+    std::vector<glm::vec3> normals;
+    for(long unsigned int t = 0; t < rest.tetBlocks.size(); t++) {
+        if(m_stressBound[t] <= toughness)
+            continue;
+        glm::mat3x3 stress;
+        if(!computeTetStress(rest.tetBlocks[t], m_points.data(), m_vels.data(), params, stress))
+            continue;
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> es(glmToEigen(stress));
+        float maxStress = es.eigenvalues()[2]; // ascending
+        if(maxStress <= toughness)
+            continue;
+        Eigen::Vector3f n = es.eigenvectors().col(2);
+        failing.push_back(std::make_pair(maxStress, (int)normals.size()));
+        normals.push_back(glm::vec3(n[0], n[1], n[2]));
+        tets.push_back(t);
+    }
+    std::sort(failing.begin(), failing.end(), std::greater<std::pair<float, int>>());
+    int nsplit = 0;
+    for(long unsigned int i = 0; i < failing.size() && nsplit < FEM_MAX_FRACTURES_PER_STEP; i++) {
+        int idx = failing[i].second;
+        if(fracture(tets[idx], normals[idx]))
+            nsplit++;
+    }
+    return nsplit;
+}
+
+bool TetMesh::fracture(int tetIdx, glm::vec3 fracNorm) {
+    // Splits the node of tetIdx nearest the crack plane (through the tet's center, normal
+    // fracNorm) in two: tets on the positive side of the plane through that node move to a
+    // new copy of it. Only the tets and surface faces that touched the node are looked at, so
+    // a fracture costs O(tets around one node) rather than a rebuild of the mesh or a pass
+    // over its surface.
+    tet_t tet = m_rest->tets[tetIdx];
+    glm::vec3 center = getCenter(m_points, tet);
+    int node = tet.p1;
+    float best = INFINITY;
+    for(int k = 0; k < 4; k++) {
+        float d = std::abs(glm::dot(m_points[tet[k]] - center, fracNorm));
+        if(d < best) {
+            best = d;
+            node = tet[k];
+        }
+    }
+    glm::vec3 origin = m_points[node];
+    std::vector<int> affected = tetsTouching(node);
+    std::vector<int> positive, negative;
+    for(int t : affected) {
+        if(glm::dot(getCenter(m_points, m_rest->tets[t]) - origin, fracNorm) > 0)
+            positive.push_back(t);
+        else
+            negative.push_back(t);
+    }
+    if(positive.empty() || negative.empty())
+        return false; // the crack doesn't pass through this node
+    TetRestState& rest = mutableRest();
+
+    if(m_nodeFaces.empty()) {
+        m_nodeFaces.resize(m_points.size());
+        for(long unsigned int i = 0; i < rest.faces.size(); i++) {
+            for(int k = 0; k < 3; k++) {
+                m_nodeFaces[rest.faces[i][k]].push_back(i);
+            }
+        }
+    }
+    // surface faces touching the node are about to change, drop them. Highest index first,
+    // so the face swapped into each hole is never one still waiting to be dropped.
+    std::vector<int> stale = m_nodeFaces[node];
+    std::sort(stale.begin(), stale.end(), std::greater<int>());
+    for(int face : stale) {
+        removeSurfaceFace(face);
+    }
+
+    int newNode = addNewPoint();
+    m_points[newNode] = origin;
+    m_vels[newNode] = m_vels[node];
+    for(int t : positive) {
+        for(int k = 0; k < 4; k++) {
+            if(rest.tets[t][k] == node) {
+                rest.tets[t][k] = newNode;
+                rest.tetBlocks[t].node[k] = newNode;
+            }
+        }
+    }
+    m_pToTFractured[node] = negative;
+    m_pToTFractured[newNode] = positive;
+    m_isCrackTip[node] = true;
+    m_isCrackTip[newNode] = true;
+    // (splitting a node only removes shared nodes, so the tet coloring stays valid)
+
+    // A face touching node/newNode can only be shared by tets that touch it too, so counting
+    // faces over just the affected tets tells us exactly which ones are now on the surface.
+    std::unordered_map<glm::ivec3, std::pair<glm::ivec3, int>, ivec3_hash> counts;
+    glm::ivec3 faces[4];
+    for(int t : affected) {
+        getTetFaces(rest.tets[t], faces);
+        for(int f = 0; f < 4; f++) {
+            if(faceHas(faces[f], node) || faceHas(faces[f], newNode)) {
+                auto& entry = counts[sortedFace(faces[f])];
+                entry.first = faces[f];
+                entry.second++;
+            }
+        }
+    }
+    for(auto& it : counts) {
+        if(it.second.second == 1)
+            addSurfaceFace(it.second.first);
+    }
+
+    // lumped masses of the two halves; same per-tet share as calcPointMasses
+    m_pointMasses[node] = 0;
+    m_pointMasses[newNode] = 0;
+    for(int t : negative)
+        m_pointMasses[node] += MAT_DENSITY * 6 * rest.tetBlocks[t].restVolume * m_restScale / 4;
+    for(int t : positive)
+        m_pointMasses[newNode] += MAT_DENSITY * 6 * rest.tetBlocks[t].restVolume * m_restScale / 4;
+    m_invMass3.clear(); // rebuilt by prepareScratch
+    m_fractured = true;
+    m_surfaceDirty = true;
+    return true;
+}
+
+namespace {
+// union-find root with path halving
+int findRoot(std::vector<int>& parent, int i) {
+    while(parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
 }
 
-void TetMesh::draw() {
-    //update(1);
-    std::vector<GLfloat> vertexData;
-    for(auto it = m_faces.begin(); it != m_faces.end(); it++) {
-        if(!it->second)
+std::vector<std::unique_ptr<TetMesh>> TetMesh::splitComponents() {
+    const TetRestState& rest = *m_rest;
+    std::vector<std::unique_ptr<TetMesh>> pieces;
+    if(!m_fractured)
+        return pieces;
+    m_fractured = false;
+
+    // tets sharing a node are connected
+    std::vector<int> parent(m_points.size());
+    for(long unsigned int i = 0; i < parent.size(); i++) {
+        parent[i] = i;
+    }
+    for(long unsigned int t = 0; t < rest.tets.size(); t++) {
+        tet_t tet = rest.tets[t];
+        int root = findRoot(parent, tet.p1);
+        for(int k = 1; k < 4; k++) {
+            int other = findRoot(parent, tet[k]);
+            if(other != root)
+                parent[other] = root;
+        }
+    }
+
+    // number the components in order of their first tet
+    std::vector<int> compOfRoot(m_points.size(), -1);
+    std::vector<int> tetComp(rest.tets.size());
+    std::vector<int> compSize;
+    for(long unsigned int t = 0; t < rest.tets.size(); t++) {
+        int root = findRoot(parent, rest.tets[t].p1);
+        if(compOfRoot[root] < 0) {
+            compOfRoot[root] = compSize.size();
+            compSize.push_back(0);
+        }
+        tetComp[t] = compOfRoot[root];
+        compSize[tetComp[t]]++;
+    }
+    if(compSize.size() <= 1)
+        return pieces;
+
+    // the biggest piece stays in this mesh, the rest become new ones
+    int keep = std::max_element(compSize.begin(), compSize.end()) - compSize.begin();
+    for(int c = 0; c < (int)compSize.size(); c++) {
+        if(c == keep)
+            continue;
+        pieces.push_back(std::make_unique<TetMesh>());
+        extractComponent(tetComp, c, *pieces.back());
+    }
+    TetMesh kept;
+    extractComponent(tetComp, keep, kept);
+    *this = std::move(kept);
+    return pieces;
+}
+
+void TetMesh::extractComponent(const std::vector<int>& tetComp, int comp, TetMesh& out) const {
+    // copies the tets labelled comp into out with nodes and tets renumbered from 0
+    out.m_onode = m_onode;
+    out.m_material = m_material;
+    out.m_restFrameInv = m_restFrameInv;
+    out.m_restScale = m_restScale;
+    const TetRestState& rest = *m_rest;
+    TetRestState& outRest = out.mutableRest();
+    std::vector<int> nodeMap(m_points.size(), -1);
+    for(long unsigned int t = 0; t < rest.tets.size(); t++) {
+        if(tetComp[t] != comp)
+            continue;
+        tet_t tet = rest.tets[t];
+        TetBlock blk = rest.tetBlocks[t];
+        for(int k = 0; k < 4; k++) {
+            int n = tet[k];
+            if(nodeMap[n] < 0) {
+                nodeMap[n] = out.addNewPoint();
+                out.m_points[nodeMap[n]] = m_points[n];
+                out.m_vels[nodeMap[n]] = m_vels[n];
+                out.m_norms[nodeMap[n]] = m_norms[n];
+                out.m_pointMasses[nodeMap[n]] = m_pointMasses[n];
+                out.m_isCrackTip[nodeMap[n]] = m_isCrackTip[n];
+            }
+            tet[k] = nodeMap[n];
+            blk.node[k] = nodeMap[n];
+        }
+        outRest.tets.push_back(tet);
+        outRest.baryTransforms.push_back(rest.baryTransforms[t]);
+        outRest.tetBlocks.push_back(blk);
+    }
+    // a surface face belongs to exactly one tet, so if one of its nodes made it over they all did
+    for(const glm::ivec3& f : rest.faces) {
+        if(nodeMap[f.x] < 0)
             continue;
-        int p1idx = it->first.x;
-        int p2idx = it->first.y;
-        int p3idx = it->first.z;
-#define pushXYZ(vd, v) vd.push_back(v.x); \
-        vd.push_back(v.y); \
-        vd.push_back(v.z);
-
-        pushXYZ(vertexData, m_points[p1idx]);
-        pushXYZ(vertexData, m_norms[p1idx]);
-        pushXYZ(vertexData, m_points[p2idx]);
-        pushXYZ(vertexData, m_norms[p2idx]);
-        pushXYZ(vertexData, m_points[p3idx]);
-        pushXYZ(vertexData, m_norms[p3idx]);
-#undef pushXYZ
-    }
-    OpenGLShape shape;
-    shape.setVertexData(vertexData.data(), vertexData.size(), VBO::GEOMETRY_LAYOUT::LAYOUT_TRIANGLES, vertexData.size() / 6);
-    shape.setAttribute(ShaderAttrib::POSITION, 3, 0, VBOAttribMarker::DATA_TYPE::FLOAT, false);
-    shape.setAttribute(ShaderAttrib::NORMAL, 3, sizeof(GLfloat) * 3, VBOAttribMarker::DATA_TYPE::FLOAT, true);
-    shape.buildVAO();
-
-    if (m_faces.size() != 0) {
-    shape.draw();
+        outRest.faces.push_back(glm::ivec3(nodeMap[f.x], nodeMap[f.y], nodeMap[f.z]));
     }
+    out.m_pToTMap = tetsTouchingPoint(outRest.tets, out.m_points.size());
+    out.calcTetColors();
 }
 
 void TetMesh::offsetPos(glm::vec3 offset) {
@@ -1,18 +1,34 @@
 #ifndef TETMESH_H
 #define TETMESH_H
 #include <unordered_map>
-#include "ui/SupportCanvas3D.h"
-#include "scenegraph/Scene.h"
-#include "openglshape.h"
-#include "ui/mainwindow.h"
-#include "ThreadPool.h"
-#include "gl/shaders/ShaderAttribLocations.h"
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "CS123SceneData.h"
+#include "tetkernel.h"
+#include "surfacebuffer.h"
 
 
 const float FLOOR_Y = -3.75;
 const float KILL_FLOOR_Y = -20;
 const float FLOOR_RADIUS = 9.0;
 
+// meshes with fewer tets than this assemble stress forces on the calling thread
+const int FEM_PARALLEL_MIN_TETS = 2048;
+// colors with fewer tets than this are not worth a trip through the thread pool
+const int FEM_PARALLEL_MIN_BATCH = 256;
+// node color masks are 64 bits wide; tets that can't get one of those go in an
+// overflow color that is always assembled serially
+const int FEM_MAX_TET_COLORS = 64;
+// relative residual and iteration cap for the backward Euler CG solve
+const float FEM_CG_TOLERANCE = 1e-4;
+const int FEM_CG_MAX_ITERATIONS = 200;
+// most tets computeFracture will split in one step, worst first
+const int FEM_MAX_FRACTURES_PER_STEP = 4;
+// downward acceleration on every node
+const float FEM_GRAVITY = 0.1;
+
 
 // combination hash function that combines hashes of each element
 template <typename...> struct hashh;
@@ -61,6 +77,30 @@ typedef struct tet {
     }
 } tet_t;
 
+// node -> tets touching it in compressed sparse row form: the tets of node n are
+// tets[offsets[n]] .. tets[offsets[n + 1] - 1]. Built once per template and shared
+// read-only by every instance of it.
+struct NodeTetAdjacency {
+    std::vector<int> offsets;
+    std::vector<int> tets;
+};
+
+// The parts of a mesh that don't change while it simulates (until it fractures), in the
+// coordinates it was built in. Every instance of a template shares one of these.
+struct TetRestState {
+    std::vector<tet_t> tets;
+    // outward-wound surface triangles (see calcFacesAndNorms)
+    std::vector<glm::ivec3> faces;
+    std::vector<glm::mat3x3> baryTransforms;
+    // packed copy of tets + baryTransforms for the stress kernel (see calcTetBlocks)
+    std::vector<TetBlock, AlignedAllocator<TetBlock, 64>> tetBlocks;
+    // tet indices grouped by color, where no two tets of a color share a node, so a
+    // whole color can be assembled in parallel without locking. Color c is
+    // colorOrder[colorOffsets[c]] .. colorOrder[colorOffsets[c + 1] - 1].
+    std::vector<int> colorOrder;
+    std::vector<int> colorOffsets;
+};
+
 typedef struct materialFEM {
     float incompressibility;
     float rigidity;
@@ -68,46 +108,121 @@ typedef struct materialFEM {
 } mat_t;
 
 
+struct SurfaceGL;
+
 class TetMesh
 {
 public:
     TetMesh(){}
     TetMesh(object_node_t node, std::unordered_map<std::string, std::unique_ptr<TetMesh>>& map);
     TetMesh(std::string filename, glm::mat4x4 trans=glm::mat4x4(), std::string nodefile=std::string());
-    std::vector<TetMesh> fracture(int tetIdx, glm::vec3 fracNorm);
+    bool fracture(int tetIdx, glm::vec3 fracNorm);
+    // Moves every piece that fracturing has cut off into its own mesh, leaving the biggest
+    // piece in this one. Does nothing unless something fractured since the last call.
+    std::vector<std::unique_ptr<TetMesh>> splitComponents();
     bool update(float timestep);
     void draw();
-    const object_node_t& getONode() { return m_onode; }
+    // Brings the surface buffer up to date for drawing (no GL calls) and returns the bytes
+    // draw() would upload for it: vertex data every time, indices only after the surface changed.
+    size_t packSurface();
+    // bytes the last draw() sent to the GPU
+    size_t bytesUploaded() const { return m_bytesUploaded; }
+    const object_node_t& getONode() const { return m_onode; }
+    // node positions as they are now, in world space (node.trans is already applied)
+    const std::vector<glm::vec3>& points() const { return m_points; }
+    // outward-wound surface triangles indexing points()
+    const std::vector<glm::ivec3>& faces() const { return m_rest->faces; }
+    size_t numTets() const { return m_rest->tets.size(); }
+    // kinetic + gravitational potential energy (elastic energy isn't counted)
+    double mechanicalEnergy() const;
+    // Writes the mesh, as it is now, to a binary .tmb with its faces, bary transforms and
+    // masses precomputed (see tetmeshbinary.h). Meant for freshly loaded meshes.
+    bool saveBinary(const std::string& filename) const;
     std::vector<glm::vec3> getFaceTris();
     void offsetPos(glm::vec3 offset);
 private:
+    uint32_t loadBinary(const std::string& filename);
     void calcFacesAndNorms();
     void calcNorms();
-    void computeFracture(const tet_t& tet, glm::mat3x3 stress);
-    void computeStressForces(std::vector<glm::vec3>& forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels);
+    int computeFracture();
+    void computeStressForces(std::vector<glm::vec3>& forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels,
+                             float *stressBound = nullptr);
     void computeAllForces(std::vector<glm::vec3>& forcePerNode);
-    void computeAllForcesFrom(std::vector<glm::vec3> &forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels);
+    void computeAllForcesFrom(std::vector<glm::vec3> &forcePerNode, const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels,
+                              float *stressBound = nullptr);
     void computeCollisionForces(std::vector<glm::vec3>& forcePerNode,  const std::vector<glm::vec3>& points, const std::vector<glm::vec3>& vels, float floorY);
     void calcBaryTransforms();
     void calcPointMasses();
+    void calcTetColors();
+    void calcTetBlocks();
+    void prepareScratch();
+    void stepRK4(float timestep);
+    void stepBackwardEuler(float timestep);
     bool checkBad();
     int addNewPoint();
+    void removeSurfaceFace(int face);
+    void addSurfaceFace(glm::ivec3 face);
+    std::vector<int> tetsTouching(int node) const;
+    TetRestState& mutableRest();
+    StressParams stressParams() const;
+    void extractComponent(const std::vector<int>& tetComp, int comp, TetMesh& out) const;
     std::vector<glm::vec3> m_points;
     std::vector<bool> m_isCrackTip;
     std::vector<glm::vec3> m_vels;
     std::vector<glm::vec3> m_norms;
-    std::vector<tet_t> m_tets;
-    std::vector<std::vector<int>> m_pToTMap;
-    std::unordered_map<glm::ivec3, bool, ivec3_hash> m_faces;
-    std::vector<glm::mat3x3> m_baryTransforms;
+    // shared with every other instance of the same template until fracture() changes it
+    std::shared_ptr<const TetRestState> m_rest = std::make_shared<TetRestState>();
+    // inverse of the linear transform from m_rest's coordinates to this mesh's rest shape,
+    // and that transform's |determinant| (the volume/mass scale)
+    glm::mat3x3 m_restFrameInv;
+    float m_restScale = 1;
+    std::shared_ptr<const NodeTetAdjacency> m_pToTMap;
+    // nodes whose tet list fracture() changed, overriding m_pToTMap (copy-on-write per node,
+    // so the shared adjacency never has to be copied)
+    std::unordered_map<int, std::vector<int>> m_pToTFractured;
+    // indices into rest.faces of the faces touching each node, so fracture() can find the
+    // faces around a node without a pass over the whole surface. Built by the first
+    // fracture(), empty until then and after calcFacesAndNorms() replaces the faces.
+    std::vector<std::vector<int>> m_nodeFaces;
 
-    ThreadPool p;
     object_node_t m_onode;
     mat_t m_material;
     // using lumped mass model, so rather than store an entire NxN matrix we will just store a vector
     std::vector<float> m_pointMasses;
+    // RK4 scratch, sized to m_points once and reused every substep (see prepareScratch)
+    std::vector<glm::vec3> m_forces, m_xnext, m_vnext, m_sumX, m_sumV;
+    // 1 / mass repeated for x, y and z so the stage loops can run over flat floats
+    std::vector<float> m_invMass3;
+    // per tet, a bound on its largest principal stress from the first force pass of the last
+    // step (see computeStressBatch), so computeFracture only looks closely at tets near failing
+    std::vector<float> m_stressBound;
     bool mustDie;
+    // set by fracture(), cleared by splitComponents()
+    bool m_fractured = false;
+
+    // surface geometry for draw(). The index list is rebuilt from the faces only when
+    // m_surfaceDirty; the vertex data is repacked and uploaded in place every frame.
+    SurfaceBuffer m_surface;
+    bool m_surfaceDirty = true;
+    // GL buffers for the surface, made by the first draw() (see tetmeshdraw.cpp). A
+    // shared_ptr so this header, and builds that never draw, don't need the GL headers.
+    std::shared_ptr<SurfaceGL> m_surfaceGL;
+    size_t m_bytesUploaded = 0;
 
 };
 
+// The nodes of a parsed scene that get simulated as TetMeshes, with primitive.meshfile pointed
+// at the stock mesh for spheres, cubes and cones. A cube that is the scene's first node is the
+// ground, so its physics is disabled.
+std::vector<object_node_t> tetMeshNodes(const std::vector<object_node_t>& nodes);
+
+// Loads the template of every file the nodes use that isn't in map yet, several files at once
+// on the stress assembly pool, so that TetMesh(node, map) only has to copy from one.
+void loadTetMeshTemplates(const std::vector<object_node_t>& nodes,
+                          std::unordered_map<std::string, std::unique_ptr<TetMesh>>& map);
+
+// Worker threads for stress assembly and template loading, 0 for one per core. The pool is
+// made the first time either needs it, so this has to be called before that to take effect.
+void setFemThreads(unsigned threads);
+
 #endif // TETMESH_H
@@ -0,0 +1,151 @@
+#include "tetmeshbinary.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+const uint64_t BLOCK_ALIGN = 64;
+
+uint64_t alignUp(uint64_t n) {
+    return (n + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+}
+
+// is [offset, offset + bytes) a block that fits in the file? (absent blocks always fit)
+bool blockFits(uint64_t offset, uint64_t bytes, size_t fileSize) {
+    if(offset == 0)
+        return true;
+    return offset % BLOCK_ALIGN == 0 && offset >= sizeof(TetmeshBinary::Header)
+            && offset <= fileSize && bytes <= fileSize - offset;
+}
+
+// is every one of the n node indices one of the numPoints points?
+bool indicesInRange(const int32_t *indices, uint64_t n, uint32_t numPoints) {
+    for(uint64_t i = 0; i < n; i++) {
+        if(indices[i] < 0 || (uint32_t)indices[i] >= numPoints)
+            return false;
+    }
+    return true;
+}
+}
+
+namespace TetmeshBinary {
+
+MappedFile::MappedFile(const std::string& filename) :
+    m_data(nullptr),
+    m_size(0),
+    m_header(nullptr)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        printf("Warning: could not open %s.\n", filename.data());
+        return;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+        printf("Warning: %s is too small to be a .tmb file.\n", filename.data());
+        close(fd);
+        return;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if(data == MAP_FAILED) {
+        printf("Warning: could not mmap %s.\n", filename.data());
+        return;
+    }
+    m_data = static_cast<const char *>(data);
+    m_size = st.st_size;
+
+    const Header *h = reinterpret_cast<const Header *>(m_data);
+    uint64_t np = h->numPoints, nt = h->numTets, nf = h->numFaces;
+    bool valid = std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) == 0 && h->version == VERSION
+            && h->pointsOffset != 0 && h->tetsOffset != 0
+            && blockFits(h->pointsOffset, np * 3 * sizeof(float), m_size)
+            && blockFits(h->tetsOffset, nt * 4 * sizeof(int32_t), m_size)
+            && blockFits(h->facesOffset, nf * 3 * sizeof(int32_t), m_size)
+            && blockFits(h->baryOffset, nt * 9 * sizeof(float), m_size)
+            && blockFits(h->massesOffset, np * sizeof(float), m_size)
+            // loaders go by the flags, so each has to match whether its block is there
+            && !(h->flags & HAS_FACES) == !h->facesOffset
+            && !(h->flags & HAS_BARY) == !h->baryOffset
+            && !(h->flags & HAS_MASSES) == !h->massesOffset;
+    if(!valid) {
+        printf("Warning: %s is not a valid .tmb file.\n", filename.data());
+        return;
+    }
+    // the tets and faces are copied out as is and indexed straight into the points later
+    const int32_t *faces = h->facesOffset ? reinterpret_cast<const int32_t *>(m_data + h->facesOffset) : nullptr;
+    if(!indicesInRange(reinterpret_cast<const int32_t *>(m_data + h->tetsOffset), nt * 4, h->numPoints)
+            || (faces && !indicesInRange(faces, nf * 3, h->numPoints))) {
+        printf("Warning: %s has node indices past its %u points.\n", filename.data(), h->numPoints);
+        return;
+    }
+    m_header = h;
+}
+
+MappedFile::~MappedFile()
+{
+    if(m_data)
+        munmap(const_cast<char *>(m_data), m_size);
+}
+
+bool write(const std::string& filename,
+           uint32_t numPoints, const float *points,
+           uint32_t numTets, const int32_t *tets,
+           uint32_t numFaces, const int32_t *faces,
+           const float *bary, const float *masses) {
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.numPoints = numPoints;
+    h.numTets = numTets;
+    h.numFaces = faces ? numFaces : 0;
+
+    // lay the blocks out back to back, each starting on a BLOCK_ALIGN boundary
+    struct Block { const void *data; uint64_t bytes; uint64_t *offset; uint32_t flag; };
+    Block blocks[] = {
+        {points, (uint64_t)numPoints * 3 * sizeof(float), &h.pointsOffset, 0},
+        {tets, (uint64_t)numTets * 4 * sizeof(int32_t), &h.tetsOffset, 0},
+        {faces, (uint64_t)h.numFaces * 3 * sizeof(int32_t), &h.facesOffset, HAS_FACES},
+        {bary, (uint64_t)numTets * 9 * sizeof(float), &h.baryOffset, HAS_BARY},
+        {masses, (uint64_t)numPoints * sizeof(float), &h.massesOffset, HAS_MASSES},
+    };
+    uint64_t end = alignUp(sizeof(Header));
+    for(Block& b : blocks) {
+        if(!b.data)
+            continue;
+        *b.offset = end;
+        h.flags |= b.flag;
+        end = alignUp(end + b.bytes);
+    }
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if(!f) {
+        printf("Warning: could not open %s for writing.\n", filename.data());
+        return false;
+    }
+    bool good = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint64_t pos = sizeof(h);
+    std::vector<char> zeros(BLOCK_ALIGN, 0);
+    for(Block& b : blocks) {
+        if(!b.data || !good)
+            continue;
+        good = fwrite(zeros.data(), 1, *b.offset - pos, f) == *b.offset - pos
+                && fwrite(b.data, 1, b.bytes, f) == b.bytes;
+        pos = *b.offset + b.bytes;
+    }
+    good = fclose(f) == 0 && good;
+    if(!good)
+        printf("Warning: failed writing %s.\n", filename.data());
+    return good;
+}
+
+bool isBinaryFile(const std::string& filename) {
+    return filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".tmb") == 0;
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef TETMESHBINARY_H
+#define TETMESHBINARY_H
+#include <cstdint>
+#include <string>
+
+// Binary tet mesh files (.tmb). A fixed header is followed by 64-byte aligned blocks in
+// native (little endian) byte order, so a loader can mmap the file and copy the blocks
+// straight out without parsing anything:
+//     points  float32 x 3 per point
+//     tets    int32 x 4 per tet
+//     faces   int32 x 3 per outward-wound surface triangle     (optional)
+//     bary    float32 x 9 per tet, column-major rest inverse   (optional)
+//     masses  float32 per point, lumped                        (optional)
+// The optional blocks are precomputed in the file's own coordinates.
+namespace TetmeshBinary
+{
+    const char MAGIC[4] = {'T', 'M', 'B', '1'};
+    const uint32_t VERSION = 1;
+
+    enum Flags {
+        HAS_FACES = 1,
+        HAS_BARY = 2,
+        HAS_MASSES = 4
+    };
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t flags;
+        uint32_t numPoints;
+        uint32_t numTets;
+        uint32_t numFaces;
+        // byte offsets of each block from the start of the file, 0 if absent
+        uint64_t pointsOffset;
+        uint64_t tetsOffset;
+        uint64_t facesOffset;
+        uint64_t baryOffset;
+        uint64_t massesOffset;
+    };
+
+    // A read-only mapping of a .tmb file. ok() is false if the file couldn't be mapped or
+    // doesn't look like a .tmb (bad magic/version, blocks past the end of the file, flags that
+    // don't match the blocks, or tet/face node indices outside the points). The block pointers
+    // are only valid while this is alive; optional blocks are nullptr when absent.
+    class MappedFile
+    {
+    public:
+        MappedFile(const std::string& filename);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool ok() const { return m_header != nullptr; }
+        const Header& header() const { return *m_header; }
+        const float *points() const { return block<float>(m_header->pointsOffset); }
+        const int32_t *tets() const { return block<int32_t>(m_header->tetsOffset); }
+        const int32_t *faces() const { return block<int32_t>(m_header->facesOffset); }
+        const float *bary() const { return block<float>(m_header->baryOffset); }
+        const float *masses() const { return block<float>(m_header->massesOffset); }
+
+    private:
+        template <typename T>
+        const T *block(uint64_t offset) const {
+            return offset ? reinterpret_cast<const T *>(m_data + offset) : nullptr;
+        }
+
+        const char *m_data;
+        size_t m_size;
+        const Header *m_header;
+    };
+
+    // Writes a .tmb. faces, bary and masses may be nullptr to leave that block out.
+    bool write(const std::string& filename,
+               uint32_t numPoints, const float *points,
+               uint32_t numTets, const int32_t *tets,
+               uint32_t numFaces, const int32_t *faces,
+               const float *bary, const float *masses);
+
+    bool isBinaryFile(const std::string& filename);
+}
+
+#endif // TETMESHBINARY_H
@@ -0,0 +1,47 @@
+#include "tetmesh.h"
+#include "GL/glew.h"
+#include "gl/shaders/ShaderAttribLocations.h"
+#include "gl/datatype/VBO.h"
+#include "gl/datatype/VBOAttribMarker.h"
+#include "gl/datatype/IBO.h"
+#include "gl/datatype/VAO.h"
+
+// TetMesh's drawing, kept out of tetmesh.cpp so the physics builds without GL (see
+// simbench.pro).
+
+using namespace CS123::GL;
+
+struct SurfaceGL {
+    std::unique_ptr<VBO> vbo;
+    std::unique_ptr<IBO> ibo;
+    std::unique_ptr<VAO> vao;
+};
+
+void TetMesh::draw() {
+    if(!m_surfaceGL) {
+        m_surfaceGL = std::make_shared<SurfaceGL>();
+        m_surfaceDirty = true; // first draw, or the GL objects went away with a move
+    }
+    SurfaceGL& gl = *m_surfaceGL;
+    bool rebuild = m_surfaceDirty || !gl.vao;
+    m_bytesUploaded = packSurface();
+    const std::vector<float>& vertexData = m_surface.vertexData();
+    const std::vector<int>& indices = m_surface.indices();
+    if(indices.empty())
+        return;
+    if(rebuild) {
+        std::vector<VBOAttribMarker> markers;
+        markers.push_back(VBOAttribMarker(ShaderAttrib::POSITION, 3, 0, VBOAttribMarker::DATA_TYPE::FLOAT, false));
+        markers.push_back(VBOAttribMarker(ShaderAttrib::NORMAL, 3, sizeof(GLfloat) * 3, VBOAttribMarker::DATA_TYPE::FLOAT, true));
+        gl.vbo = std::make_unique<VBO>(vertexData.data(), vertexData.size(), markers,
+                                       VBO::GEOMETRY_LAYOUT::LAYOUT_TRIANGLES, GL_DYNAMIC_DRAW);
+        gl.ibo = std::make_unique<IBO>(indices.data(), indices.size());
+        gl.vao = std::make_unique<VAO>(*gl.vbo, *gl.ibo, indices.size());
+    }
+    else {
+        gl.vbo->setData(vertexData.data(), vertexData.size());
+    }
+    gl.vao->bind();
+    gl.vao->draw();
+    gl.vao->unbind();
+}
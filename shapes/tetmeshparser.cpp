@@ -5,195 +5,514 @@
 #include <sstream>
 #include <sys/time.h>
 #include <functional>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "timing.h"
+#include "ThreadPool.h"
+#include "tetmeshbinary.h"
 
 namespace {
+// switches every tetrahedralize call uses; part of the tet cache key
+const char TETGEN_SWITCHES[] = "p";
+
 tetgenbehavior _;
-bool success = _.parse_commandline("p");
-int numTimesParsed = 0;
+bool success = _.parse_commandline((char *)TETGEN_SWITCHES);
 
 const tetgenbehavior tet_behavior = _;
 
-bool strIsIntable(const std::string& str) {
-    if(str.length() == 0)
+// tetgen isn't reentrant: every tetrahedralize() call runs exactinit(), which rewrites the
+// file-scope epsilon and error bounds in predicates.cxx and scales its static filters by the
+// input's bounding box, and refills tetgenmesh's static lookup tables. Files still parse (and
+// hit the tet cache) in parallel, but only one tetrahedralize() runs at a time.
+std::mutex tetgenMutex;
+
+// Tetrahedralizing a detailed surface takes a while, so results are cached on disk as
+// .tmb files (points and tets only) named after a hash of the input points, facets and
+// switches.
+const char TET_CACHE_DIR[] = ".tetcache";
+
+// FNV-1a
+uint64_t hashBytes(uint64_t h, const void *data, size_t bytes) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for(size_t i = 0; i < bytes; i++) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+std::string tetCachePath(const tetgenio& in) {
+    uint64_t h = 14695981039346656037ull;
+    h = hashBytes(h, TETGEN_SWITCHES, sizeof(TETGEN_SWITCHES));
+    h = hashBytes(h, &in.numberofpoints, sizeof(in.numberofpoints));
+    h = hashBytes(h, in.pointlist, in.numberofpoints * 3 * sizeof(REAL));
+    h = hashBytes(h, &in.numberoffacets, sizeof(in.numberoffacets));
+    for(int i = 0; i < in.numberoffacets; i++) {
+        const tetgenio::facet& f = in.facetlist[i];
+        for(int j = 0; j < f.numberofpolygons; j++) {
+            const tetgenio::polygon& poly = f.polygonlist[j];
+            h = hashBytes(h, &poly.numberofvertices, sizeof(poly.numberofvertices));
+            h = hashBytes(h, poly.vertexlist, poly.numberofvertices * sizeof(int));
+        }
+        h = hashBytes(h, &f.numberofholes, sizeof(f.numberofholes));
+        h = hashBytes(h, f.holelist, f.numberofholes * 3 * sizeof(REAL));
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tmb", (unsigned long long)h);
+    return std::string(TET_CACHE_DIR) + "/" + name;
+}
+
+bool loadCachedTets(const std::string& path, tetgenio *out) {
+    if(access(path.c_str(), R_OK) != 0)
         return false;
-    if(str[0] == '-' || str[0] == '+') {
-        return strIsIntable(str.substr(1));
+    TetmeshBinary::MappedFile file(path);
+    if(!file.ok())
+        return false;
+    const TetmeshBinary::Header& h = file.header();
+    out->firstnumber = 0;
+    out->numberofpoints = h.numPoints;
+    out->pointlist = new REAL[h.numPoints * 3];
+    std::copy(file.points(), file.points() + h.numPoints * 3, out->pointlist);
+    out->numberofcorners = 4;
+    out->numberoftetrahedra = h.numTets;
+    out->tetrahedronlist = new int[h.numTets * 4];
+    std::copy(file.tets(), file.tets() + h.numTets * 4, out->tetrahedronlist);
+    return true;
+}
+
+void saveCachedTets(const std::string& path, const tetgenio& out) {
+    if(mkdir(TET_CACHE_DIR, 0755) != 0 && errno != EEXIST) {
+        printf("Warning: could not create %s, not caching tets.\n", TET_CACHE_DIR);
+        return;
+    }
+    std::vector<float> points(out.pointlist, out.pointlist + out.numberofpoints * 3);
+    // written under a name of its own and renamed, so concurrent loads of the same input
+    // never see a half-written file
+    std::ostringstream tmpPath;
+    tmpPath << path << "." << getpid() << "." << std::this_thread::get_id();
+    if(TetmeshBinary::write(tmpPath.str(), out.numberofpoints, points.data(),
+                            out.numberoftetrahedra, out.tetrahedronlist, 0, nullptr, nullptr, nullptr)) {
+        rename(tmpPath.str().c_str(), path.c_str());
+    } else {
+        unlink(tmpPath.str().c_str());
     }
-    return str.find_first_not_of("0123456789") == std::string::npos; // i.e. no non-digits
 }
 
-int getFirstIntFromVTN(const std::string& vtn) {
-    if(strIsIntable(vtn))
-        return std::stoi(vtn);
-    else {
-        std::string v = vtn.substr(0, vtn.find('/'));
-        assert(strIsIntable(v));
-        return std::stoi(v);
+void tetrahedralizeCached(tetgenio *in, tetgenio *out) {
+    std::string cachePath = tetCachePath(*in);
+    if(loadCachedTets(cachePath, out)) {
+        printf("Loaded %d tets from %s.\n", out->numberoftetrahedra, cachePath.data());
+        return;
     }
+    printf("About to tetrahedralize...\n");
+    fflush(stdout);
+    double start = get_time();
+    // tetrahedralize may write to its behavior, so each call gets its own copy
+    tetgenbehavior behavior = tet_behavior;
+    {
+        std::lock_guard<std::mutex> lock(tetgenMutex);
+        tetrahedralize(&behavior, in, out);
+    }
+    printf("Done tetrahedralizing. Took %f secs.\n", get_time() - start);
+    fflush(stdout);
+    saveCachedTets(cachePath, *out);
 }
+
+// tetgenio frees its lists with delete[] (see tetgenio::deinitialize), so they're
+// allocated with new[] here
+void setPoints(tetgenio *out, const std::vector<REAL>& coords) {
+    out->firstnumber = 0;
+    out->numberofpoints = coords.size() / 3;
+    out->pointlist = new REAL[coords.size()];
+    std::copy(coords.begin(), coords.end(), out->pointlist);
 }
 
-bool TetmeshParser::parseObjFile(std::string objfilename, tetgenio *out) {
-    std::ifstream infile(objfilename);
-    std::string line;
-    std::vector<REAL> vertCoords;
-    std::vector<int> faceIdxs;
-    while(std::getline(infile, line)) {
-        line.erase(0, line.find_first_not_of(" \n\r\t"));
-        if(line[0] == '#')
-            continue;
-        else if(line[0] == 'v') {
-            if(line[1] == 'n' || line[1] == 't' || line[1] == 'p') {
-                // texcors, normals, or param space all ignored
-                continue;
-            }
-            // now we make a stream of floats representing the x,y,z[,w] and read from it
-            std::istringstream strm(&line[1]);
-            float x = 99, y = 99, z = 99;
-            if(!(strm >> x >> y >> z)) {
-                printf("Attempted to read line:\n%s\nAs string stream of x,y,z, but failed.\n", line.data());
-                printf("Read: %f, %f, %f\n", x, y, z);
-                continue;
+// one single-triangle facet per face, same as a .smesh with no markers or holes
+void setTriangleFacets(tetgenio *out, const std::vector<int>& faceIdxs) {
+    out->numberoffacets = faceIdxs.size() / 3;
+    out->facetlist = new tetgenio::facet[out->numberoffacets];
+    for(int i = 0; i < out->numberoffacets; i++) {
+        tetgenio::facet& f = out->facetlist[i];
+        tetgenio::init(&f);
+        f.numberofpolygons = 1;
+        f.polygonlist = new tetgenio::polygon[1];
+        tetgenio::init(f.polygonlist);
+        f.polygonlist[0].numberofvertices = 3;
+        f.polygonlist[0].vertexlist = new int[3];
+        std::copy(&faceIdxs[i * 3], &faceIdxs[i * 3] + 3, f.polygonlist[0].vertexlist);
+    }
+}
+
+void setTets(tetgenio *out, const std::vector<int>& tetIdxs) {
+    out->numberofcorners = 4;
+    out->numberoftetrahedra = tetIdxs.size() / 4;
+    out->tetrahedronlist = new int[tetIdxs.size()];
+    std::copy(tetIdxs.begin(), tetIdxs.end(), out->tetrahedronlist);
+}
+
+// Text files are parsed straight out of an mmap. Big files are split at line boundaries
+// into chunks parsed concurrently, each into its own ParsedChunk, which are then
+// concatenated in file order.
+const size_t PARSE_MIN_CHUNK_BYTES = 1 << 20;
+
+ThreadPool& parserThreadPool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+class TextFile
+{
+public:
+    TextFile(const std::string& filename) : m_data(nullptr), m_size(0) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data != MAP_FAILED) {
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const char *>(data);
+                m_size = st.st_size;
             }
-            vertCoords.push_back(x);
-            vertCoords.push_back(y);
-            vertCoords.push_back(z);
         }
-        else if(line[0] == 'f') {
-            // we make a stream of ints representing the triangle corners
-            std::istringstream strm(&line[1]);
-            std::string v1, v2, v3, tmp;
-            int i1, i2, i3;
-            if(!(strm >> v1 >> v2 >> v3)) {
-                printf("Attempted to read line:\n%s\nAs string stream of v1,v2,v3, but failed.\n", line.data());
-                continue;
-            }
-            if(strm >> tmp) {
-                // > 3 verts
-                printf("Line parsed as:\n%s\nHas >3 vertices listed. Ignoring addl verts.\n", line.data());
-            }
-            i1 = getFirstIntFromVTN(v1);
-            i2 = getFirstIntFromVTN(v2);
-            i3 = getFirstIntFromVTN(v3);
-            // -1 because .obj indexes from 1
-            faceIdxs.push_back(i1 - 1);
-            faceIdxs.push_back(i2 - 1);
-            faceIdxs.push_back(i3 - 1);
+        close(fd);
+    }
+    ~TextFile() {
+        if(m_data)
+            munmap(const_cast<char *>(m_data), m_size);
+    }
+    TextFile(const TextFile&) = delete;
+    TextFile& operator=(const TextFile&) = delete;
+
+    const char *begin() const { return m_data; }
+    const char *end() const { return m_data + m_size; }
+
+private:
+    const char *m_data;
+    size_t m_size;
+};
+
+inline bool isLineSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char *skipSpaces(const char *p, const char *end) {
+    while(p < end && isLineSpace(*p))
+        p++;
+    return p;
+}
+
+// first character of the next line (or end)
+inline const char *nextLine(const char *p, const char *end) {
+    const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+    return nl ? nl + 1 : end;
+}
+
+// end of the token starting at p
+inline const char *tokenEnd(const char *p, const char *end) {
+    while(p < end && !isLineSpace(*p) && *p != '\n')
+        p++;
+    return p;
+}
+
+// Reads the (optionally signed) integer at the start of the token at p and moves p past
+// the whole token, so OBJ's v/vt/vn reads as v. False if there's no integer there.
+bool parseInt(const char *&p, const char *end, int& out) {
+    p = skipSpaces(p, end);
+    const char *q = p;
+    bool neg = false;
+    if(q < end && (*q == '-' || *q == '+'))
+        neg = *q++ == '-';
+    const char *digits = q;
+    long value = 0;
+    while(q < end && *q >= '0' && *q <= '9' && q - digits < 10)
+        value = value * 10 + (*q++ - '0');
+    if(q == digits || (q < end && *q >= '0' && *q <= '9') || value > INT_MAX)
+        return false; // no digits, or too many for an int
+    out = neg ? -value : value;
+    p = tokenEnd(q, end);
+    return true;
+}
+
+// Reads the decimal number token at p and moves p past it. Plain decimals with at most 15
+// significant digits and a small exponent (what mesh exporters write) are converted
+// exactly with one multiply or divide; anything else goes through strtod.
+bool parseReal(const char *&p, const char *end, REAL& out) {
+    static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                   1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                   1e20, 1e21, 1e22};
+    p = skipSpaces(p, end);
+    const char *tokEnd = tokenEnd(p, end);
+    if(p == tokEnd)
+        return false;
+    const char *q = p;
+    bool neg = false;
+    if(*q == '-' || *q == '+')
+        neg = *q++ == '-';
+    uint64_t mantissa = 0;
+    int sigDigits = 0, exp10 = 0;
+    bool anyDigits = false;
+    for(; q < tokEnd && *q >= '0' && *q <= '9'; q++) {
+        anyDigits = true;
+        if(mantissa || *q != '0')
+            sigDigits++;
+        mantissa = mantissa * 10 + (*q - '0');
+    }
+    if(q < tokEnd && *q == '.') {
+        for(q++; q < tokEnd && *q >= '0' && *q <= '9'; q++) {
+            anyDigits = true;
+            if(mantissa || *q != '0')
+                sigDigits++;
+            mantissa = mantissa * 10 + (*q - '0');
+            exp10--;
         }
     }
-    // XXX The reason we are not directly initializing a tetgenio object is because there's a bunch of random stuff that has to be initialized.
-    std::ofstream ofile("tmp.smesh");
-    ofile << "# tmp.smesh autogenerated by convertObjFile(" << objfilename << ")" << std::endl;
-    // number nodes, number dims (always 3), number attributes (currently 0), has boundary marker (no)
-    ofile << vertCoords.size() / 3 << " " << 3 << " " << 0 << " " << 0 << std::endl;
-    ofile << std::endl;
-    for(unsigned long i = 0; i < vertCoords.size() / 3; i++) {
-        ofile << i << " ";
-        ofile << vertCoords[i * 3] << " ";
-        ofile << vertCoords[i * 3 + 1] << " ";
-        ofile << vertCoords[i * 3 + 2];
-        ofile << std::endl;
+    if(anyDigits && q < tokEnd && (*q == 'e' || *q == 'E')) {
+        const char *e = q + 1;
+        bool eneg = false;
+        if(e < tokEnd && (*e == '-' || *e == '+'))
+            eneg = *e++ == '-';
+        int ev = 0;
+        const char *edigits = e;
+        for(; e < tokEnd && *e >= '0' && *e <= '9' && ev < 10000; e++)
+            ev = ev * 10 + (*e - '0');
+        if(e > edigits) {
+            exp10 += eneg ? -ev : ev;
+            q = e;
+        }
     }
-    ofile << std::endl;
-    // number facets, has boundary marker (no)
-    ofile << faceIdxs.size() / 3 << " " << 0 << std::endl;
-    ofile << std::endl;
-    for(unsigned long i = 0; i < faceIdxs.size() / 3; i++) {
-        ofile << 3 << " ";
-        ofile << faceIdxs[i * 3] << " ";
-        ofile << faceIdxs[i * 3 + 1] << " ";
-        ofile << faceIdxs[i * 3 + 2];
-        ofile << std::endl;
+    if(anyDigits && q == tokEnd && sigDigits <= 15 && exp10 >= -22 && exp10 <= 22) {
+        double v = exp10 < 0 ? mantissa / POW10[-exp10] : mantissa * POW10[exp10];
+        out = neg ? -v : v;
+        p = tokEnd;
+        return true;
     }
-    ofile << std::endl;
-    // number holes (0)
-    ofile << 0 << std::endl;
-    ofile.close();
-    printf("About to tgio.load_poly...\n");
-    fflush(stdout);
-    out->load_poly("tmp");
-    printf("Done with tgio.load_poly.\n");
-    fflush(stdout);
+    // slow path; strtod needs a terminated copy since the mapping isn't
+    char buf[64];
+    size_t len = tokEnd - p;
+    if(len >= sizeof(buf))
+        return false;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    char *parsedEnd;
+    out = strtod(buf, &parsedEnd);
+    if(parsedEnd != buf + len)
+        return false;
+    p = tokEnd;
     return true;
 }
 
-bool TetmeshParser::parseMeshFile(std::string meshFileName, tetgenio *out) {
-    numTimesParsed++;
-    printf("parsed %d times\n", numTimesParsed);
-    fflush(stdout);
-    std::ifstream in(meshFileName);
-    std::string line;
-    std::vector<float> vertCoords;
-    std::vector<int> tetCoords;
-    while(std::getline(in, line)) {
+void warnLine(const char *line, const char *end, const char *what) {
+    const char *lineEnd = nextLine(line, end);
+    int len = lineEnd - line;
+    if(len > 0 && line[len - 1] == '\n')
+        len--;
+    printf("Attempted to read line:\n%.*s\nAs %s, but failed.\n", len, line, what);
+}
+
+struct ParsedChunk {
+    std::vector<REAL> coords;
+    std::vector<int> idxs;
+    // slots of idxs holding an index relative to this chunk's first vertex (negative OBJ
+    // indices), fixed up once the vertex counts of earlier chunks are known
+    std::vector<size_t> relative;
+};
+
+// Splits [begin, end) into chunks ending on line boundaries, runs parseChunk on each
+// (concurrently when there's more than one) and concatenates the results into merged.
+void parseChunked(const char *begin, const char *end,
+                  const std::function<void(const char *, const char *, ParsedChunk&)>& parseChunk,
+                  ParsedChunk& merged) {
+    ThreadPool& pool = parserThreadPool();
+    size_t bytes = end - begin;
+    size_t nchunks = std::max<size_t>(1, std::min(pool.size(), bytes / PARSE_MIN_CHUNK_BYTES));
+    std::vector<const char *> bounds(nchunks + 1);
+    bounds[0] = begin;
+    bounds[nchunks] = end;
+    for(size_t i = 1; i < nchunks; i++) {
+        const char *guess = std::max(bounds[i - 1], begin + bytes * i / nchunks);
+        bounds[i] = guess == begin ? begin : nextLine(guess - 1, end);
+    }
+    std::vector<ParsedChunk> chunks(nchunks);
+    if(nchunks == 1) {
+        parseChunk(begin, end, chunks[0]);
+    } else {
+        pool.parallelFor(0, nchunks, [&](int lo, int hi) {
+            for(int i = lo; i < hi; i++) {
+                parseChunk(bounds[i], bounds[i + 1], chunks[i]);
+            }
+        });
+    }
+
+    size_t ncoords = 0, nidxs = 0;
+    for(ParsedChunk& c : chunks) {
+        ncoords += c.coords.size();
+        nidxs += c.idxs.size();
+    }
+    merged.coords.reserve(ncoords);
+    merged.idxs.reserve(nidxs);
+    for(ParsedChunk& c : chunks) {
+        int firstVertex = merged.coords.size() / 3;
+        size_t firstIdx = merged.idxs.size();
+        merged.coords.insert(merged.coords.end(), c.coords.begin(), c.coords.end());
+        merged.idxs.insert(merged.idxs.end(), c.idxs.begin(), c.idxs.end());
+        for(size_t slot : c.relative) {
+            merged.idxs[firstIdx + slot] += firstVertex;
+        }
+    }
+}
+
+// OBJ: "v x y z [w]" vertices and "f a b c" triangles whose corners may be v, v/vt,
+// v//vn or v/vt/vn, 1-based or negative (relative to the last vertex so far)
+void parseObjChunk(const char *p, const char *end, ParsedChunk& out) {
+    while(p < end) {
+        const char *line = skipSpaces(p, end);
+        const char *next = nextLine(line, end);
+        if(line + 1 < end && line[0] == 'v' && isLineSpace(line[1])) {
+            const char *q = line + 1;
+            REAL x, y, z;
+            if(parseReal(q, next, x) && parseReal(q, next, y) && parseReal(q, next, z)) {
+                out.coords.push_back(x);
+                out.coords.push_back(y);
+                out.coords.push_back(z);
+            } else {
+                warnLine(line, end, "x,y,z");
+            }
+        }
+        else if(line + 1 < end && line[0] == 'f' && isLineSpace(line[1])) {
+            const char *q = line + 1;
+            int corner[3];
+            bool good = true;
+            for(int k = 0; k < 3 && good; k++) {
+                good = parseInt(q, next, corner[k]) && corner[k] != 0;
+            }
+            if(!good) {
+                warnLine(line, end, "v1,v2,v3");
+            } else {
+                int localVerts = out.coords.size() / 3;
+                for(int k = 0; k < 3; k++) {
+                    if(corner[k] < 0) {
+                        out.relative.push_back(out.idxs.size());
+                        out.idxs.push_back(localVerts + corner[k]);
+                    } else {
+                        // -1 because .obj indexes from 1
+                        out.idxs.push_back(corner[k] - 1);
+                    }
+                }
+                q = skipSpaces(q, next);
+                if(q < next && *q != '\n')
+                    printf("Face has >3 vertices listed. Ignoring addl verts.\n");
+            }
+        }
+        // comments, normals, texcoords etc. are ignored
+        p = next;
+    }
+}
+
+// .mesh: "v x y z" points and "t a b c d" 0-based tets
+void parseMeshChunk(const char *p, const char *end, ParsedChunk& out) {
+    while(p < end) {
+        const char *line = p;
+        const char *next = nextLine(line, end);
         if(line[0] == 'v') {
-            std::istringstream strm(&line[1]);
-            float x = 99, y = 99, z = 99;
-            if(!(strm >> x >> y >> z)) {
-                printf("Attempted to read line:\n%s\nAs string stream of x,y,z, but failed.\n", line.data());
-                printf("Read: %f, %f, %f\n", x, y, z);
-                continue;
+            const char *q = line + 1;
+            REAL x, y, z;
+            if(parseReal(q, next, x) && parseReal(q, next, y) && parseReal(q, next, z)) {
+                out.coords.push_back(x);
+                out.coords.push_back(y);
+                out.coords.push_back(z);
+            } else {
+                warnLine(line, end, "x,y,z");
             }
-            vertCoords.push_back(x);
-            vertCoords.push_back(y);
-            vertCoords.push_back(z);
         }
         else if(line[0] == 't') {
-            std::istringstream strm(&line[1]);
-            int x = 99, y = 99, z = 99, w = 99;;
-            if(!(strm >> x >> y >> z >> w)) {
-                printf("Attempted to read line:\n%s\nAs string stream of x,y,z,w ints but failed.\n", line.data());
-                printf("Read: %d, %d, %d, %d\n", x, y, z, w);
-                continue;
+            const char *q = line + 1;
+            int t[4];
+            if(parseInt(q, next, t[0]) && parseInt(q, next, t[1]) && parseInt(q, next, t[2]) && parseInt(q, next, t[3])) {
+                out.idxs.insert(out.idxs.end(), t, t + 4);
+            } else {
+                warnLine(line, end, "x,y,z,w ints");
             }
-            tetCoords.push_back(x);
-            tetCoords.push_back(y);
-            tetCoords.push_back(z);
-            tetCoords.push_back(w);
         }
+        p = next;
     }
-    std::ofstream ofile;
-    ofile.open("tmp.ele", std::ios_base::trunc);
-    assert(ofile);
-    // first ele. Line is num tets, num verts/shape (4 for tet), 0 boundary
-    ofile << tetCoords.size()/4 << " " << 4 << " " << 0;
-    ofile << std::endl;
-    for(unsigned long i = 0; i < tetCoords.size()/4; i++) {
-        ofile << i << " ";
-        ofile << tetCoords[i*4] << " ";
-        ofile << tetCoords[i*4+1] << " ";
-        ofile << tetCoords[i*4+2] << " ";
-        ofile << tetCoords[i*4+3];
-        ofile << std::endl;
+}
+}
+
+bool TetmeshParser::parseObjFile(std::string objfilename, tetgenio *out) {
+    TextFile file(objfilename);
+    if(!file.begin()) {
+        printf("Warning: could not read %s.\n", objfilename.data());
+        return false;
     }
-    ofile.close();
-    std::ofstream onodes;
-    onodes.open("tmp.node", std::ios_base::trunc);
-    assert(onodes);
-    // Line is num nodes, dimension, num attributes, 0 for boundary
-    onodes << vertCoords.size()/3 << " " << 3 << " " << 0 << " " << 0;
-    onodes << std::endl;
-    for(unsigned long i = 0; i < vertCoords.size()/3; i++) {
-        onodes << i << " ";
-        onodes << vertCoords[i*3] << " ";
-        onodes << vertCoords[i*3+1] << " ";
-        onodes << vertCoords[i*3+2] << " ";
-        onodes << std::endl;
+    ParsedChunk parsed;
+    parseChunked(file.begin(), file.end(), parseObjChunk, parsed);
+    setPoints(out, parsed.coords);
+    setTriangleFacets(out, parsed.idxs);
+    return true;
+}
+
+bool TetmeshParser::parseMeshFile(std::string meshFileName, tetgenio *out) {
+    TextFile file(meshFileName);
+    if(!file.begin()) {
+        printf("Warning: could not read %s.\n", meshFileName.data());
+        return false;
     }
-    onodes.close();
-    printf("About to tgio.load_node...\n");
-    fflush(stdout);
-    out->load_node("tmp");
-    printf("Done with tgio.load_node.\n");
-    printf("About to tgio.load_tet...\n");
-    out->load_tet("tmp");
-    printf("Done with tgio.load_tet.\n");
-    printf("SAVE EMEMEMME ME \n");
-    fflush(stdout);
+    ParsedChunk parsed;
+    parseChunked(file.begin(), file.end(), parseMeshChunk, parsed);
+    setPoints(out, parsed.coords);
+    setTets(out, parsed.idxs);
     return true;
 }
 
+void TetmeshParser::benchmark(std::string filename) {
+    // the line-at-a-time istringstream tokenizing both parsers used before, as a baseline
+    double start = get_time();
+    std::ifstream in(filename);
+    std::string line;
+    size_t bytes = 0, numbers = 0;
+    while(std::getline(in, line)) {
+        bytes += line.size() + 1;
+        if(line.empty())
+            continue;
+        std::istringstream strm(&line[1]);
+        if(line[0] == 'v') {
+            float x, y, z;
+            numbers += (strm >> x >> y >> z) ? 3 : 0;
+        } else if(line[0] == 't') {
+            int a, b, c, d;
+            numbers += (strm >> a >> b >> c >> d) ? 4 : 0;
+        } else if(line[0] == 'f') {
+            std::string a, b, c;
+            numbers += (strm >> a >> b >> c) ? 3 : 0;
+        }
+    }
+    double streamSecs = get_time() - start;
+
+    start = get_time();
+    tetgenio out;
+    bool isObj = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".obj") == 0;
+    if(isObj)
+        parseObjFile(filename, &out);
+    else
+        parseMeshFile(filename, &out);
+    double fastSecs = get_time() - start;
+
+    double mb = bytes / (1024.0 * 1024.0);
+    printf("%s: %.1f MB, %d points, %d %s\n", filename.data(), mb, out.numberofpoints,
+           isObj ? out.numberoffacets : out.numberoftetrahedra, isObj ? "faces" : "tets");
+    printf("  istringstream: %.3f s, %.1f MB/s (%lu numbers)\n", streamSecs, mb / streamSecs, numbers);
+    printf("  chunked mmap (%lu threads): %.3f s, %.1f MB/s\n", parserThreadPool().size(), fastSecs, mb / fastSecs);
+}
+
 bool TetmeshParser::parse(std::string filename, tetgenio *out) {
     assert(success);
     int ext_idx = filename.rfind('.');
@@ -207,19 +526,13 @@ bool TetmeshParser::parse(std::string filename, tetgenio *out) {
         // TODO: parse obj, create tetgenio, tetrahedralize
         tetgenio in;
         parseObjFile(filename, &in);
-        printf("About to tetrahedralize...\n");
-        fflush(stdout);
-        double start = get_time();
-        tetrahedralize((tetgenbehavior *)&tet_behavior, &in, out);
-        out->save_elements("tmp");
-        printf("Done tetrahedralizing. Took %f secs.\n", get_time() - start);
-        fflush(stdout);
+        tetrahedralizeCached(&in, out);
     }
     else if(ext.compare(".smesh") == 0) {
         // TODO: convert to .ele
         tetgenio in;
         in.load_poly((char *)noext.c_str());
-        tetrahedralize((tetgenbehavior *)&tet_behavior, &in, out);
+        tetrahedralizeCached(&in, out);
     }
     else if(ext.compare(".ele") == 0) {
         std::string nodefile = filename.substr(0, ext_idx) + ".node";
@@ -1,10 +1,6 @@
 #ifndef TETMESHPARSER_H
 #define TETMESHPARSER_H
-#include "ui/SupportCanvas3D.h"
-#include "scenegraph/Scene.h"
-#include "openglshape.h"
-#include "ui/mainwindow.h"
-#include "gl/shaders/ShaderAttribLocations.h"
+#include <string>
 #include "tetgen/tetgen.h"
 
 namespace TetmeshParser
@@ -12,6 +8,9 @@ namespace TetmeshParser
     bool parse(std::string filename, tetgenio *out);
     bool parseObjFile(std::string filename, tetgenio *out);
     bool parseMeshFile(std::string filename, tetgenio *out);
+    // Times parsing filename (.obj or .mesh) against line-by-line istringstream tokenizing
+    // and prints both in MB/s.
+    void benchmark(std::string filename);
 }
 
 #endif // TETMESHPARSER_H
@@ -0,0 +1,162 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/resource.h>
+#include "Settings.h"
+#include "Scene.h"
+#include "CS123XmlSceneParser.h"
+#include "shapes/tetmesh.h"
+#include "shapes/tetmeshparser.h"
+#include "shapes/timing.h"
+
+// Steps TetMeshes with no window or GL context, so the solver can be benchmarked and
+// regression-tested on machines without a GPU. Also hosts the mesh tools that don't need
+// the GUI.
+
+namespace {
+void usage() {
+    printf("usage: simbench [--steps N] [--dt seconds] [--integrator rk4|euler] [--fracture]\n"
+           "                [--serial | --threads N] scene.xml | meshfile...\n"
+           "       simbench --convert in.mesh out.tmb\n"
+           "       simbench --bench-parse in.mesh\n");
+}
+
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// every simulated node of the XML scenes, plus each plain mesh file as-is at the origin
+std::vector<object_node_t> loadNodes(const std::vector<std::string>& inputs) {
+    std::vector<object_node_t> nodes;
+    for(const std::string& input : inputs) {
+        if(endsWith(input, ".xml")) {
+            CS123XmlSceneParser parser(input);
+            if(!parser.parse()) {
+                printf("Warning: could not parse scene %s.\n", input.data());
+                continue;
+            }
+            Scene scene;
+            Scene::parse(&scene, &parser);
+            std::vector<object_node_t> sceneNodes = tetMeshNodes(scene.m_nodes);
+            nodes.insert(nodes.end(), sceneNodes.begin(), sceneNodes.end());
+        } else {
+            object_node_t node;
+            node.primitive.type = PrimitiveType::PRIMITIVE_MESH;
+            node.primitive.meshfile = input;
+            nodes.push_back(node);
+        }
+    }
+    return nodes;
+}
+
+double totalEnergy(const std::vector<std::unique_ptr<TetMesh>>& meshes) {
+    double energy = 0;
+    for(auto& mesh : meshes) {
+        energy += mesh->mechanicalEnergy();
+    }
+    return energy;
+}
+}
+
+int main(int argc, char *argv[]) {
+    settings.loadSettingsOrDefaults();
+
+    if(argc == 4 && strcmp(argv[1], "--convert") == 0) {
+        TetMesh mesh(argv[2]);
+        return mesh.saveBinary(argv[3]) ? 0 : 1;
+    }
+    if(argc == 3 && strcmp(argv[1], "--bench-parse") == 0) {
+        TetmeshParser::benchmark(argv[2]);
+        return 0;
+    }
+
+    int steps = 1000;
+    float dt = -1;
+    std::vector<std::string> inputs;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--steps" && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if(arg == "--dt" && i + 1 < argc) {
+            dt = atof(argv[++i]);
+        } else if(arg == "--integrator" && i + 1 < argc) {
+            std::string name = argv[++i];
+            settings.femIntegrator = name == "euler" ? FEM_INTEGRATOR_BACKWARD_EULER : FEM_INTEGRATOR_RK4;
+        } else if(arg == "--fracture") {
+            settings.femFracture = true;
+        } else if(arg == "--serial") {
+            settings.femMultiThreading = false;
+        } else if(arg == "--threads" && i + 1 < argc) {
+            setFemThreads(atoi(argv[++i]));
+        } else if(arg.compare(0, 2, "--") == 0) {
+            usage();
+            return 1;
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if(inputs.empty()) {
+        usage();
+        return 1;
+    }
+    if(dt <= 0) {
+        // same substep the GUI takes
+        int perFrame = settings.femIntegrator == FEM_INTEGRATOR_BACKWARD_EULER
+                ? settings.femImplicitStepsPerFrame : settings.femStepsPerFrame;
+        dt = settings.femTimeStep / perFrame;
+    }
+
+    double loadStart = get_time();
+    std::unordered_map<std::string, std::unique_ptr<TetMesh>> templates;
+    std::vector<std::unique_ptr<TetMesh>> meshes;
+    std::vector<object_node_t> nodes = loadNodes(inputs);
+    loadTetMeshTemplates(nodes, templates);
+    for(const object_node_t& node : nodes) {
+        if(!node.disablePhysics)
+            meshes.push_back(std::make_unique<TetMesh>(node, templates));
+    }
+    double loadSecs = get_time() - loadStart;
+    if(meshes.empty()) {
+        printf("Nothing to simulate.\n");
+        return 1;
+    }
+
+    double energyStart = totalEnergy(meshes);
+    size_t tetSteps = 0;
+    int died = 0;
+    double start = get_time();
+    for(int s = 0; s < steps && !meshes.empty(); s++) {
+        std::vector<std::unique_ptr<TetMesh>> alive;
+        for(auto& mesh : meshes) {
+            tetSteps += mesh->numTets();
+            if(mesh->update(dt)) {
+                died++;
+                continue;
+            }
+            for(auto& piece : mesh->splitComponents()) {
+                alive.push_back(std::move(piece));
+            }
+            alive.push_back(std::move(mesh));
+        }
+        meshes = std::move(alive);
+    }
+    double secs = get_time() - start;
+    double energyEnd = totalEnergy(meshes);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("\n");
+    printf("loaded in %.3f s\n", loadSecs);
+    printf("%d steps of %g s, %lu meshes left, %d died\n", steps, dt, meshes.size(), died);
+    printf("%.3f s, %.1f steps/s, %.1f ns/tet/step\n", secs, steps / secs, secs * 1e9 / std::max<size_t>(tetSteps, 1));
+    printf("peak RSS %.1f MB\n", usage.ru_maxrss / 1024.0); // ru_maxrss is in KB on Linux
+    printf("mechanical energy %g -> %g, drift %+.3f%%%s\n", energyStart, energyEnd,
+           100 * (energyEnd - energyStart) / std::abs(energyStart),
+           died ? " (includes the energy of meshes that died)" : "");
+    return 0;
+}
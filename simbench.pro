@@ -0,0 +1,60 @@
+# -------------------------------------------------
+# Headless FEM runner/benchmark (simbench.cpp). Builds the TetMesh physics without
+# Qt widgets or OpenGL, so it runs on machines with no GPU or display:
+#     qmake simbench.pro -o Makefile.simbench && make -f Makefile.simbench
+# -------------------------------------------------
+QT += xml
+QT -= opengl widgets
+TARGET = simbench
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= app_bundle
+
+QMAKE_CXXFLAGS += -Ofast -std=c++14
+
+# keep objects apart from CS123.pro's, several sources are shared
+OBJECTS_DIR = simbench-build
+MOC_DIR = simbench-build
+
+LIBS += tetgen/libtet.a
+libtet.target = tetgen/libtet.a
+libtet.commands = cd tetgen && make -f makefile
+QMAKE_EXTRA_TARGETS += libtet
+OBJECTS += tetgen/libtet.a
+SOURCES += \
+    simbench.cpp \
+    scenegraph/Scene.cpp \
+    ui/Settings.cpp \
+    lib/BGRA.cpp \
+    lib/CS123XmlSceneParser.cpp \
+    shapes/tetmesh.cpp \
+    shapes/tetkernel.cpp \
+    shapes/surfacebuffer.cpp \
+    shapes/tetmeshparser.cpp \
+    shapes/tetmeshbinary.cpp \
+    shapes/timing.cpp
+
+HEADERS += \
+    scenegraph/Scene.h \
+    scenegraph/ThreadPool.h \
+    ui/Settings.h \
+    lib/BGRA.h \
+    lib/CS123SceneData.h \
+    lib/CS123ISceneParser.h \
+    lib/CS123XmlSceneParser.h \
+    shapes/tetmesh.h \
+    shapes/tetkernel.h \
+    shapes/surfacebuffer.h \
+    shapes/tetmeshparser.h \
+    shapes/tetmeshbinary.h \
+    shapes/timing.h \
+    tetgen/tetgen.h
+
+INCLUDEPATH += glm camera lib scenegraph ui tetgen Eigen
+DEPENDPATH += glm camera lib scenegraph ui tetgen
+DEFINES += _USE_MATH_DEFINES
+DEFINES += GLM_SWIZZLE GLM_FORCE_RADIANS
+
+QMAKE_CXXFLAGS_RELEASE -= -O2
+QMAKE_CXXFLAGS_RELEASE += -O3
+QMAKE_CXXFLAGS += -g
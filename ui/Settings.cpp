@@ -71,6 +71,7 @@ void Settings::loadSettingsOrDefaults() {
     useDirectionalLights = s.value("useDirectionalLights", true).toBool();
     useSpotLights = s.value("useSpotLights", true).toBool();
     useKDTree = s.value("useKDTree", true).toBool();
+    rayAccelerator = s.value("rayAccelerator", RAY_ACCEL_KDTREE).toInt();
 
     useBumpMapping = s.value("useBumpMapping", false).toBool();
     useParallax = s.value("useParallax", false).toBool();
@@ -85,6 +86,11 @@ void Settings::loadSettingsOrDefaults() {
     femRigidity = 2000;
     femBulkViscosity = 800;
     femShearViscosity = 1200    ;
+    femMultiThreading = true;
+    femIntegrator = FEM_INTEGRATOR_RK4;
+    femImplicitStepsPerFrame = 4;
+    femFracture = false;
+    femFractureToughness = 1500;
     
     useShadowMapping = 1;
     metalBalls = 1;
@@ -156,6 +162,7 @@ void Settings::saveSettings() {
     s.setValue("useDirectionalLights", useDirectionalLights);
     s.setValue("useSpotLights", useSpotLights);
     s.setValue("useKDTree", useKDTree);
+    s.setValue("rayAccelerator", rayAccelerator);
 
     s.setValue("useBumpMapping", useBumpMapping);
     s.setValue("useParallax", useParallax);
@@ -65,6 +65,19 @@ enum CameraMode {
     CAMERAMODE_CAMTRANS
 };
 
+// Enumeration values for the FEM time integrator
+enum FEMIntegrator {
+    FEM_INTEGRATOR_RK4,             // explicit, needs many small steps per frame
+    FEM_INTEGRATOR_BACKWARD_EULER   // implicit, stable at much larger steps
+};
+
+// Enumeration values for the spatial index the ray tracer walks
+enum RayAccelerator {
+    RAY_ACCEL_KDTREE,               // SAH kd-tree, smallest but slowest to build
+    RAY_ACCEL_BVH,                  // binned-SAH bounding volume hierarchy
+    RAY_ACCEL_BVH4                  // the same BVH collapsed to 4-wide nodes tested with SSE
+};
+
 /**
  * @struct Settings
  *
@@ -133,7 +146,8 @@ struct Settings {
     bool usePointLights;        // Enable or disable point lighting.
     bool useDirectionalLights;  // Enable or disable directional lighting (extra credit).
     bool useSpotLights;         // Enable or disable spot lights (extra credit).
-    bool useKDTree;
+    bool useKDTree;             // Trace through an acceleration structure instead of testing every primitive.
+    int rayAccelerator;         // @see RayAccelerator
 
     bool useBumpMapping;
     bool useParallax;
@@ -147,6 +161,11 @@ struct Settings {
     float femRigidity;
     float femBulkViscosity;
     float femShearViscosity;
+    bool femMultiThreading;     // Assemble stress forces of large meshes on the thread pool.
+    int femIntegrator;          // @see FEMIntegrator
+    int femImplicitStepsPerFrame; // Replaces femStepsPerFrame when using backward Euler.
+    bool femFracture;           // Split tets whose principal stress passes femFractureToughness.
+    float femFractureToughness;
 
     int showFXAAEdges;
     int useShadowMapping;